@@ -17,6 +17,7 @@ BuildRequires:  libtool
 BuildRequires:  gcc
 BuildRequires:  make
 BuildRequires:  libgcrypt-devel
+BuildRequires:  pkgconfig(fuse3)
 BuildRequires:  pkgconfig(glib-2.0)
 Requires:       %{name}-libs%{?_isa} = %{version}-%{release}
 
@@ -68,6 +69,8 @@ rm -rf %{buildroot}%{_docdir}/%{name}
 %files
 %license COPYING LICENSE
 %doc README.md AUTHORS
+%{_bindir}/nks-mount
+%{_bindir}/nks-pack
 %{_bindir}/nks-scan
 %{_bindir}/unnks
 
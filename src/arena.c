@@ -0,0 +1,134 @@
+#include <glib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define BLOCK_SIZE (64 * 1024)
+#define ALIGNMENT  16
+
+#define ALIGN(size) (((size) + ALIGNMENT - 1) & ~(size_t) (ALIGNMENT - 1))
+
+/* Precedes the data of every block, keeping it 16 byte aligned. */
+typedef union
+{
+  size_t      size;	/* Bytes of data following the header */
+  long double align;
+  char	      pad[ALIGNMENT];
+} BlockHeader;
+
+struct NksArena
+{
+  GPtrArray *blocks;	/* BlockHeader */
+  guint	     block;	/* Index of the block being filled */
+  size_t     used;	/* Bytes used of that block */
+};
+
+NksArena *
+nks_arena_new (void)
+{
+  NksArena *arena;
+
+  arena = g_malloc0 (sizeof (*arena));
+  arena->blocks = g_ptr_array_new_with_free_func (&g_free);
+
+  return arena;
+}
+
+void
+nks_arena_free (NksArena *arena)
+{
+  if (arena == NULL)
+    return;
+
+  g_ptr_array_free (arena->blocks, true);
+  g_free (arena);
+}
+
+static BlockHeader *
+new_block (size_t size)
+{
+  BlockHeader *header;
+
+  size = ALIGN (size);
+
+  header = g_malloc (sizeof (*header) + size);
+  header->size = size;
+
+  return header;
+}
+
+/* Takes size bytes from the current position, without aligning them. */
+static void *
+take (NksArena *arena, size_t size)
+{
+  BlockHeader *header = NULL;
+  void *p;
+
+  if (arena->block < arena->blocks->len)
+    header = g_ptr_array_index (arena->blocks, arena->block);
+
+  if (header == NULL || header->size - arena->used < size)
+    {
+      /* Move on to the next block, replacing it if it is too small for an
+       * oversized allocation. */
+      if (header != NULL)
+	arena->block++;
+
+      if (arena->block == arena->blocks->len)
+	g_ptr_array_add (arena->blocks, new_block (MAX (size, BLOCK_SIZE)));
+      else
+	{
+	  header = g_ptr_array_index (arena->blocks, arena->block);
+	  if (header->size < size)
+	    {
+	      g_free (header);
+	      g_ptr_array_index (arena->blocks, arena->block)
+		= new_block (MAX (size, BLOCK_SIZE));
+	    }
+	}
+
+      header = g_ptr_array_index (arena->blocks, arena->block);
+      arena->used = 0;
+    }
+
+  p = (char *) (header + 1) + arena->used;
+  arena->used += size;
+
+  return p;
+}
+
+void *
+nks_arena_alloc (NksArena *arena, size_t size)
+{
+  /* Blocks are a multiple of the alignment long, so this stays inside. */
+  arena->used = ALIGN (arena->used);
+
+  return take (arena, size);
+}
+
+char *
+nks_arena_strdup (NksArena *arena, const char *str)
+{
+  size_t len = strlen (str) + 1;
+
+  return memcpy (take (arena, len), str, len);
+}
+
+NksArenaMark
+nks_arena_mark (const NksArena *arena)
+{
+  NksArenaMark mark;
+
+  mark.block = arena->block;
+  mark.used  = arena->used;
+
+  return mark;
+}
+
+void
+nks_arena_release (NksArena *arena, NksArenaMark mark)
+{
+  arena->block = mark.block;
+  arena->used  = mark.used;
+}
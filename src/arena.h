@@ -0,0 +1,29 @@
+#ifndef NKS_ARENA_H
+#define NKS_ARENA_H
+
+#include <stddef.h>
+
+/*
+ * A stack allocator.  Memory is handed out from large blocks and never freed
+ * piecemeal; instead a mark taken with nks_arena_mark is released again, which
+ * gives back everything allocated since in one step.  Blocks are kept for
+ * reuse until the arena is freed.
+ */
+typedef struct NksArena NksArena;
+
+typedef struct
+{
+  unsigned int block;
+  size_t	     used;
+} NksArenaMark;
+
+NksArena *nks_arena_new (void);
+void nks_arena_free (NksArena *arena);
+
+void *nks_arena_alloc (NksArena *arena, size_t size);
+char *nks_arena_strdup (NksArena *arena, const char *str);
+
+NksArenaMark nks_arena_mark (const NksArena *arena);
+void nks_arena_release (NksArena *arena, NksArenaMark mark);
+
+#endif
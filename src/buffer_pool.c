@@ -0,0 +1,141 @@
+#include <glib.h>
+
+#include "buffer_pool.h"
+
+#define MIN_CLASS	  12	/* 4 KiB */
+#define MAX_CLASS	  26	/* 64 MiB */
+#define CLASS_COUNT	  (MAX_CLASS - MIN_CLASS + 1)
+#define MAX_POOLED_SIZE	  (64 * 1024 * 1024)
+
+/* Precedes every buffer handed out, keeping the data 16 byte aligned. */
+typedef union
+{
+  struct
+  {
+    unsigned int size_class;	/* Or CLASS_COUNT if not pooled */
+    void	*next;		/* Next free buffer of the same class */
+  } h;
+  long double align;
+  char	      pad[16];
+} BufferHeader;
+
+struct NksBufferPool
+{
+  GMutex	lock;
+  BufferHeader *free_lists[CLASS_COUNT];
+  size_t	pooled_size;	/* Total size of the free buffers */
+};
+
+NksBufferPool *
+nks_buffer_pool_new (void)
+{
+  NksBufferPool *pool;
+
+  pool = g_malloc0 (sizeof (*pool));
+  g_mutex_init (&pool->lock);
+
+  return pool;
+}
+
+void
+nks_buffer_pool_free (NksBufferPool *pool)
+{
+  BufferHeader *header;
+  unsigned int n;
+
+  if (pool == NULL)
+    return;
+
+  for (n = 0; n < CLASS_COUNT; n++)
+    {
+      while (pool->free_lists[n] != NULL)
+	{
+	  header = pool->free_lists[n];
+	  pool->free_lists[n] = header->h.next;
+	  g_free (header);
+	}
+    }
+
+  g_mutex_clear (&pool->lock);
+  g_free (pool);
+}
+
+static unsigned int
+size_class (size_t size)
+{
+  unsigned int n;
+
+  for (n = MIN_CLASS; n <= MAX_CLASS; n++)
+    {
+      if (size <= ((size_t) 1 << n))
+	return n - MIN_CLASS;
+    }
+
+  return CLASS_COUNT;
+}
+
+void *
+nks_buffer_pool_alloc (NksBufferPool *pool, size_t size)
+{
+  BufferHeader *header = NULL;
+  unsigned int n;
+
+  n = size_class (size);
+
+  if (n < CLASS_COUNT)
+    {
+      g_mutex_lock (&pool->lock);
+
+      header = pool->free_lists[n];
+      if (header != NULL)
+	{
+	  pool->free_lists[n] = header->h.next;
+	  pool->pooled_size -= (size_t) 1 << (n + MIN_CLASS);
+	}
+
+      g_mutex_unlock (&pool->lock);
+
+      size = (size_t) 1 << (n + MIN_CLASS);
+    }
+
+  if (header == NULL)
+    {
+      header = g_malloc (sizeof (*header) + size);
+      header->h.size_class = n;
+    }
+
+  return header + 1;
+}
+
+void
+nks_buffer_pool_release (NksBufferPool *pool, void *buffer)
+{
+  BufferHeader *header;
+  unsigned int n;
+  size_t size;
+
+  if (buffer == NULL)
+    return;
+
+  header = (BufferHeader *) buffer - 1;
+  n = header->h.size_class;
+
+  if (n < CLASS_COUNT)
+    {
+      g_mutex_lock (&pool->lock);
+
+      size = (size_t) 1 << (n + MIN_CLASS);
+
+      if (pool->pooled_size + size <= MAX_POOLED_SIZE)
+	{
+	  header->h.next = pool->free_lists[n];
+	  pool->free_lists[n] = header;
+	  pool->pooled_size += size;
+	  header = NULL;
+	}
+
+      g_mutex_unlock (&pool->lock);
+    }
+
+  g_free (header);
+}
@@ -0,0 +1,20 @@
+#ifndef NKS_BUFFER_POOL_H
+#define NKS_BUFFER_POOL_H
+
+#include <stddef.h>
+
+/*
+ * Recycles buffers in power-of-two size classes, so that reading many
+ * entries of similar sizes does not allocate and free each time.  Buffers
+ * above the largest class are allocated and freed directly.  A pool may be
+ * used from several threads at once.
+ */
+typedef struct NksBufferPool NksBufferPool;
+
+NksBufferPool *nks_buffer_pool_new (void);
+void nks_buffer_pool_free (NksBufferPool *pool);
+
+void *nks_buffer_pool_alloc (NksBufferPool *pool, size_t size);
+void nks_buffer_pool_release (NksBufferPool *pool, void *buffer);
+
+#endif
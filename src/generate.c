@@ -0,0 +1,101 @@
+#include <glib.h>
+
+#include "generate.h"
+
+static uint64_t
+mix (uint64_t x)
+{
+  x += UINT64_C (0x9e3779b97f4a7c15);
+  x = (x ^ (x >> 30)) * UINT64_C (0xbf58476d1ce4e5b9);
+  x = (x ^ (x >> 27)) * UINT64_C (0x94d049bb133111eb);
+  return x ^ (x >> 31);
+}
+
+static ssize_t
+fill_generated (void *buffer, size_t size, off_t offset,
+		NksGeneratedFile *file)
+{
+  uint8_t *bp = buffer;
+  uint64_t word = 0;
+  uint64_t pos;
+  size_t n;
+
+  for (n = 0; n < size; n++)
+    {
+      pos = offset + n;
+
+      if (n == 0 || pos % 8 == 0)
+	word = mix (file->seed ^ (pos / 8));
+
+      bp[n] = word >> (8 * (pos % 8));
+    }
+
+  return size;
+}
+
+int
+nks_generate_files (NksWriter *writer, const NksGeneratorOptions *options,
+		    NksGeneratedFile *files, NksGeneratedFunc func, void *data)
+{
+  GPtrArray *dirs;
+  uint64_t state = options->seed;
+  uint64_t size;
+  unsigned long level;
+  unsigned long n;
+  guint first, last, d;
+  unsigned int flags;
+  char *path;
+  int r = 0;
+
+  /* Directories, breadth-first; the root is the empty path. */
+  dirs = g_ptr_array_new_with_free_func (g_free);
+  g_ptr_array_add (dirs, g_strdup (""));
+
+  for (first = 0, level = 0; level < options->depth && r == 0; level++)
+    {
+      last = dirs->len;
+
+      for (d = first; d < last && r == 0; d++)
+	{
+	  for (n = 0; n < options->fanout && r == 0; n++)
+	    {
+	      path = g_strdup_printf ("%s%sdir%03lu",
+				      (char *) g_ptr_array_index (dirs, d),
+				      d == 0 ? "" : "/", n);
+	      r = nks_writer_add_directory (writer, path);
+	      g_ptr_array_add (dirs, path);
+	    }
+	}
+
+      first = last;
+    }
+
+  for (n = 0; n < options->files && r == 0; n++)
+    {
+      d = n % dirs->len;
+
+      state = mix (state);
+      size  = (options->min_size
+	       + state % (options->max_size - options->min_size + 1));
+
+      state = mix (state);
+      flags = (state % 100 < options->encrypted ? NKS_WRITE_ENCRYPTED : 0);
+
+      files[n].seed = mix (state);
+
+      path = g_strdup_printf ("%s%sfile%06lu.bin",
+			      (char *) g_ptr_array_index (dirs, d),
+			      d == 0 ? "" : "/", n);
+
+      r = nks_writer_add_file_func (writer, path, size, flags,
+				    (NksFillFunc) &fill_generated, &files[n]);
+      if (func != NULL)
+	func (path, size, r, data);
+
+      g_free (path);
+    }
+
+  g_ptr_array_free (dirs, true);
+
+  return r;
+}
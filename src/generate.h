@@ -0,0 +1,46 @@
+#ifndef NKS_GENERATE_H
+#define NKS_GENERATE_H
+
+#include <stdint.h>
+
+#include "nks.h"
+
+/*
+ * Archives of generated files, for nks-pack and nks-bench.  The contents of
+ * each file come from splitmix64 seeded per file, so that any piece of a file
+ * can be produced on its own, and the same options always give the same
+ * archive.
+ *
+ * Directories are depth levels of fanout subdirectories each, created
+ * breadth-first, and files are spread over all of them in turn.
+ */
+typedef struct
+{
+  unsigned long files;
+  uint64_t	min_size;
+  uint64_t	max_size;
+  unsigned long depth;
+  unsigned long fanout;
+  unsigned long encrypted;	/* Percentage of encrypted files */
+  uint64_t	seed;
+} NksGeneratorOptions;
+
+typedef struct
+{
+  uint64_t seed;
+} NksGeneratedFile;
+
+/* Called after each file was added, or failed to be with error. */
+typedef void (*NksGeneratedFunc) (const char *path, uint64_t size, int error,
+				  void *data);
+
+/*
+ * Adds the directories and files described by options to writer.  files must
+ * hold options->files elements and be kept until the writer is closed, as the
+ * contents are only produced then.  Stops at the first error.
+ */
+int nks_generate_files (NksWriter *writer, const NksGeneratorOptions *options,
+			NksGeneratedFile *files, NksGeneratedFunc func,
+			void *data);
+
+#endif
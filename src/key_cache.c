@@ -0,0 +1,187 @@
+#include <glib.h>
+#include <string.h>
+
+#include "key_cache.h"
+#include "keys.h"
+#include "libs.h"
+#include "nks.h"
+#include "util.h"
+
+/* 64 keystreams */
+#define DEFAULT_LIMIT (64 * NKS_SET_KEY_SIZE)
+
+struct NksSetKey
+{
+  uint32_t set_id;
+  gint	   ref_count;
+  GList	  *link;	/* Position in lru, or NULL if not cached */
+  uint8_t  data[NKS_SET_KEY_SIZE];
+};
+
+G_LOCK_DEFINE_STATIC (cache);
+
+static GHashTable *keys;	/* set_id -> NksSetKey */
+static GQueue	   lru = G_QUEUE_INIT;	/* Most recently used first */
+static size_t	   limit = DEFAULT_LIMIT;
+static uint64_t	   hits;
+static uint64_t	   misses;
+static uint64_t	   evictions;
+
+static void
+unref_key (NksSetKey *key)
+{
+  if (g_atomic_int_dec_and_test (&key->ref_count))
+    g_free (key);
+}
+
+/* Must be called with the cache lock held. */
+static void
+evict (size_t max_size)
+{
+  NksSetKey *key;
+
+  while (lru.length > 0 && lru.length * NKS_SET_KEY_SIZE > max_size)
+    {
+      key = g_queue_pop_tail (&lru);
+      key->link = NULL;
+
+      g_hash_table_remove (keys, GUINT_TO_POINTER (key->set_id));
+      unref_key (key);
+      evictions++;
+    }
+}
+
+/* Must be called with the cache lock held. */
+static NksSetKey *
+lookup (uint32_t set_id)
+{
+  NksSetKey *key;
+
+  if (keys == NULL)
+    return NULL;
+
+  key = g_hash_table_lookup (keys, GUINT_TO_POINTER (set_id));
+  if (key == NULL)
+    return NULL;
+
+  g_queue_unlink (&lru, key->link);
+  g_queue_push_head_link (&lru, key->link);
+  g_atomic_int_inc (&key->ref_count);
+
+  return key;
+}
+
+/* Sets cached to whether the keystream was found in the cache, even if this
+ * fails, and generated to whether it had to be computed by this call. */
+int
+nks_key_cache_acquire (uint32_t set_id, NksSetKey **ret, bool *cached,
+		       bool *generated)
+{
+  const NksLibraryDesc *lib;
+  NksSetKey *key;
+  NksSetKey *other;
+  int r;
+
+  *generated = false;
+
+  G_LOCK (cache);
+  key = lookup (set_id);
+  if (key != NULL)
+    hits++;
+  else
+    misses++;
+  G_UNLOCK (cache);
+
+  *cached = (key != NULL);
+
+  if (key != NULL)
+    {
+      *ret = key;
+      return 0;
+    }
+
+  lib = nks_get_library_desc (set_id);
+  if (lib == NULL)
+    return -ENOKEY;
+
+  /* Generate outside the lock, so that other sets can be served meanwhile. */
+  key = g_malloc (sizeof (*key));
+  key->set_id	 = set_id;
+  key->ref_count = 1;
+  key->link	 = NULL;
+
+  r = nks_create_0110_key (&lib->gen_key, key->data, sizeof (key->data));
+  if (r != 0)
+    {
+      g_free (key);
+      return r;
+    }
+
+  *generated = true;
+
+  G_LOCK (cache);
+
+  /* Another thread may have generated the same keystream meanwhile. */
+  other = lookup (set_id);
+  if (other != NULL)
+    {
+      G_UNLOCK (cache);
+      g_free (key);
+      *ret = other;
+      return 0;
+    }
+
+  if (limit >= NKS_SET_KEY_SIZE)
+    {
+      if (keys == NULL)
+	keys = g_hash_table_new (NULL, NULL);
+
+      evict (limit - NKS_SET_KEY_SIZE);
+
+      /* One reference belongs to the cache. */
+      g_atomic_int_inc (&key->ref_count);
+      g_queue_push_head (&lru, key);
+      key->link = lru.head;
+      g_hash_table_insert (keys, GUINT_TO_POINTER (set_id), key);
+    }
+
+  G_UNLOCK (cache);
+
+  *ret = key;
+  return 0;
+}
+
+void
+nks_key_cache_release (NksSetKey *key)
+{
+  if (key != NULL)
+    unref_key (key);
+}
+
+const uint8_t *
+nks_set_key_data (const NksSetKey *key)
+{
+  return key->data;
+}
+
+void
+nks_set_key_cache_limit (size_t size)
+{
+  G_LOCK (cache);
+  limit = size;
+  evict (limit);
+  G_UNLOCK (cache);
+}
+
+void
+nks_get_key_cache_stats (NksKeyCacheStats *stats)
+{
+  G_LOCK (cache);
+  stats->hits	   = hits;
+  stats->misses	   = misses;
+  stats->evictions = evictions;
+  stats->count	   = lru.length;
+  stats->size	   = lru.length * NKS_SET_KEY_SIZE;
+  stats->limit	   = limit;
+  G_UNLOCK (cache);
+}
@@ -0,0 +1,23 @@
+#ifndef NKS_KEY_CACHE_H
+#define NKS_KEY_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define NKS_SET_KEY_SIZE 0x10000
+
+/*
+ * A process-wide cache of 0x0110 set keystreams, shared by every open
+ * archive.  Keystreams are reference counted, so one that is evicted while
+ * an archive still uses it stays valid until it is released.  The least
+ * recently acquired keystreams are evicted once the cache grows beyond its
+ * limit (see nks_set_key_cache_limit).
+ */
+typedef struct NksSetKey NksSetKey;
+
+int nks_key_cache_acquire (uint32_t set_id, NksSetKey **ret, bool *cached,
+			   bool *generated);
+void nks_key_cache_release (NksSetKey *key);
+const uint8_t *nks_set_key_data (const NksSetKey *key);
+
+#endif
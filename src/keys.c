@@ -3,6 +3,7 @@
 #include <stdlib.h>
 
 #include "keys.h"
+#include "nks_xor.h"
 #include "util.h"
 
 static uint8_t  nks_0100_keys[32][16];
@@ -11,14 +12,20 @@ static uint8_t *nks_0110_base_key;
 static void
 generate_0100_keys (void)
 {
+  static gsize initialised = 0;
   uint32_t seed = UINT32_C (0x6ee38fe0);
   int key, n;
 
+  if (!g_once_init_enter (&initialised))
+    return;
+
   for (key = 0; key < 32; key++)
     {
       for (n = 0; n < 16; n++)
 	nks_0100_keys[key][n] = rand_ms (&seed) & 0xff;
     }
+
+  g_once_init_leave (&initialised, 1);
 }
 
 int
@@ -30,8 +37,7 @@ nks_get_0100_key (uint32_t key_index, const uint8_t **key, size_t *length)
   if (key_index >= 0x20)
     return -ENOKEY;
 
-  if (nks_0100_keys[0][0] == 0)
-    generate_0100_keys ();
+  generate_0100_keys ();
 
   ret_key    = nks_0100_keys[key_index];
   ret_length = 0x10;
@@ -48,10 +54,11 @@ nks_get_0100_key (uint32_t key_index, const uint8_t **key, size_t *length)
 static void
 generate_0110_base_key (void)
 {
+  static gsize initialised = 0;
   int n;
   uint32_t seed;
-  
-  if (nks_0110_base_key != NULL)
+
+  if (!g_once_init_enter (&initialised))
     return;
 
   nks_0110_base_key = g_malloc (0x10000);
@@ -59,24 +66,59 @@ generate_0110_base_key (void)
 
   for (n = 0; n < 0x10000; n++)
     nks_0110_base_key[n] = rand_ms (&seed) & 0xff;
+
+  g_once_init_leave (&initialised, 1);
 }
 
 static int
 initialise_gcrypt (void)
 {
-  if (gcry_control (GCRYCTL_INITIALIZATION_FINISHED_P))
-    return 0;
+  /* 1 if initialised successfully, 2 if the library version is wrong */
+  static gsize state = 0;
+  gsize r;
 
-  if (!gcry_check_version (GCRYPT_VERSION))
+  if (g_once_init_enter (&state))
     {
-      fprintf (stderr, "Error: Incompatible gcrypt version.\n");
-      return -ENOTSUP;
+      r = 1;
+
+      if (!gcry_control (GCRYCTL_INITIALIZATION_FINISHED_P))
+	{
+	  if (gcry_check_version (GCRYPT_VERSION))
+	    {
+	      gcry_control (GCRYCTL_DISABLE_SECMEM, 0);
+	      gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
+	    }
+	  else
+	    {
+	      fprintf (stderr, "Error: Incompatible gcrypt version.\n");
+	      r = 2;
+	    }
+	}
+
+      g_once_init_leave (&state, r);
     }
 
-  gcry_control (GCRYCTL_DISABLE_SECMEM, 0);
-  gcry_control (GCRYCTL_INITIALIZATION_FINISHED, 0);
+  return (state == 1 ? 0 : -ENOTSUP);
+}
 
-  return 0;
+/* The format only carries into the low 15 bytes of the counter, while CTR
+ * mode carries through all 16.  They agree unless those 15 bytes wrap
+ * within the blocks we generate. */
+static bool
+counter_wraps (const uint8_t *ctr, size_t blocks)
+{
+  unsigned int carry = 0;
+  size_t add = blocks - 1;
+  size_t n;
+
+  for (n = 15; n > 0; n--)
+    {
+      carry += ctr[n] + (add & 0xff);
+      carry >>= 8;
+      add >>= 8;
+    }
+
+  return (carry != 0);
 }
 
 static void
@@ -96,10 +138,10 @@ nks_create_0110_key (const NksGeneratingKey *gk, void *buffer, size_t len)
 {
   gcry_cipher_hd_t cipher;
   uint8_t ctr[16];
-  uint8_t *bkp;
   uint8_t *bp;
-  size_t n, m;
+  size_t n;
   int algo;
+  int mode;
   int r;
 
   if (gk->key == NULL)
@@ -111,15 +153,14 @@ nks_create_0110_key (const NksGeneratingKey *gk, void *buffer, size_t len)
   if (gk->iv == NULL || gk->iv_len != 16)
     return -EINVAL;
 
-  if (buffer == NULL || len < 16 || (len & 15) != 0)
+  if (buffer == NULL || len < 16 || len > 0x10000 || (len & 15) != 0)
     return -EINVAL;
 
   r = initialise_gcrypt ();
   if (r != 0)
     return r;
 
-  if (nks_0110_base_key == NULL)
-    generate_0110_base_key ();
+  generate_0110_base_key ();
 
   switch (gk->key_len)
     {
@@ -129,42 +170,50 @@ nks_create_0110_key (const NksGeneratingKey *gk, void *buffer, size_t len)
     default: abort (); break;
     }
 
-  if (gcry_cipher_open (&cipher, algo, GCRY_CIPHER_MODE_ECB, 0) != 0)
+  memcpy (ctr, gk->iv, 16);
+
+  /* Encrypting zeros in CTR mode yields the keystream in one call, unless
+   * the counter wraps; then the blocks are encrypted one by one. */
+  mode = (counter_wraps (ctr, len / 16)
+	  ? GCRY_CIPHER_MODE_ECB : GCRY_CIPHER_MODE_CTR);
+
+  if (gcry_cipher_open (&cipher, algo, mode, 0) != 0)
     return -ENOTSUP;
 
   if (gcry_cipher_setkey (cipher, gk->key, gk->key_len) != 0)
-    {
-      r = -ENOTSUP;
-      goto err;
-    }
+    goto err;
 
-  memcpy (ctr, gk->iv, 16);
+  if (mode == GCRY_CIPHER_MODE_CTR)
+    {
+      if (gcry_cipher_setctr (cipher, ctr, 16) != 0)
+	goto err;
 
-  bp = buffer;
-  bkp = nks_0110_base_key;
+      memset (buffer, 0, len);
 
-  for (n = 0; 16 * n < len; n++)
+      if (gcry_cipher_encrypt (cipher, buffer, len, NULL, 0) != 0)
+	goto err;
+    }
+  else
     {
-      if (gcry_cipher_encrypt (cipher, bp, 16, ctr, 16) != 0)
-	{
-	  r = -ENOTSUP;
-	  goto err;
-	}
+      bp = buffer;
 
-      for (m = 0; m < 16; m++)
-	bp[m] ^= bkp[m];
-
-      increment_counter (ctr, 16);
+      for (n = 0; 16 * n < len; n++)
+	{
+	  if (gcry_cipher_encrypt (cipher, bp, 16, ctr, 16) != 0)
+	    goto err;
 
-      bp += 16;
-      bkp += 16;
+	  increment_counter (ctr, 16);
+	  bp += 16;
+	}
     }
 
   gcry_cipher_close (cipher);
 
+  nks_xor_key (buffer, buffer, len, nks_0110_base_key, 0x10000, 0);
+
   return 0;
 
 err:
   gcry_cipher_close (cipher);
-  return r;
+  return -ENOTSUP;
 }
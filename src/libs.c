@@ -6,6 +6,9 @@
 
 #include "lib_data.c"
 
+/* Protects the lazy expansion of the generating keys in libraries. */
+G_LOCK_DEFINE_STATIC (libraries);
+
 void
 nks_library_desc_free (NksLibraryDesc *desc)
 {
@@ -32,7 +35,9 @@ nks_get_library_desc (uint32_t id)
   if (lib == NULL)
     return lib;
 
+  G_LOCK (libraries);
   nks_generating_key_expand (&lib->gen_key);
+  G_UNLOCK (libraries);
 
   return lib;
 }
@@ -0,0 +1,639 @@
+#include <errno.h>
+#include <getopt.h>
+#include <glib.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_SYS_RESOURCE_H
+# include <sys/resource.h>
+#endif
+
+#include "generate.h"
+#include "nks.h"
+#include "util.h"
+
+/* Keyboard Collection, whose key is always known */
+#define DEFAULT_SET_ID 0x0d
+
+typedef struct
+{
+  const char   *name;
+  unsigned long files;
+  unsigned long depth;
+  unsigned long fanout;
+  uint64_t	min_size;
+  uint64_t	max_size;
+  unsigned int	encrypted;	/* Percentage of encrypted files */
+} Shape;
+
+static const Shape shapes[] =
+{
+  { "wide", 20000, 0,  0, 1024,	     4096,	50  },
+  { "deep", 4000,  8,  2, 4096,	     32768,	50  },
+  { "tiny", 50000, 2, 16, 0,	     256,	50  },
+  { "huge", 4,	   0,  0, 64 << 20,  64 << 20,	100 },
+};
+
+typedef struct
+{
+  const Shape *shape;
+  unsigned int version;
+  char	      *path;
+  GPtrArray   *files;		/* Paths of all files */
+  uint64_t     bytes;		/* Total size of all files */
+  NksGeneratedFile *generated;
+} Archive;
+
+typedef struct
+{
+  int64_t syscr;		/* read-like system calls, or -1 */
+  int64_t syscw;		/* write-like system calls, or -1 */
+  long	  max_rss;		/* Process-wide peak RSS so far in KiB, or -1 */
+} Usage;
+
+static const char  *work_dir   = NULL;
+static const char  *only_shape = NULL;
+static unsigned int only_version = 0;
+static uint32_t	    set_id     = DEFAULT_SET_ID;
+static double	    scale      = 1.0;
+static bool	    keep       = false;
+static Usage	    overhead;	/* System calls made by get_usage itself */
+
+static void
+print_help (const char *argv0)
+{
+  printf_utf8 (
+    "Usage: %s [OPTIONS]\n"
+    "\n"
+    "Generates archives of several shapes and measures opening, listing,\n"
+    "lookups and extraction.  Results are printed as one JSON object per\n"
+    "line.\n"
+    "\n"
+    "Options:\n"
+    "  -d  --dir=DIR        Keep archives and extracted files in DIR\n"
+    "  -k  --keep           Do not remove the archives afterwards\n"
+    "  -s  --shape=NAME     Only run wide, deep, tiny or huge archives\n"
+    "  -F  --format=VERSION Only run 0100 or 0110 archives\n"
+    "      --scale=FACTOR   Multiply file counts and huge file sizes by FACTOR\n"
+    "      --set-id=ID      Library whose key encrypts 0110 files\n"
+    "  -h  --help           Print out usage instructions\n",
+    argv0);
+}
+
+static void
+parse_arguments (int argc, char **argv)
+{
+  int op, index = 0;
+  unsigned long n;
+  size_t i;
+  char *end;
+  static struct option options[] =
+  {
+    {"dir",    true,  NULL, 'd'},
+    {"format", true,  NULL, 'F'},
+    {"help",   false, NULL, 'h'},
+    {"keep",   false, NULL, 'k'},
+    {"scale",  true,  NULL, 'S'},
+    {"set-id", true,  NULL, 'I'},
+    {"shape",  true,  NULL, 's'},
+    {NULL,     false, NULL, 0}
+  };
+
+  for (;;)
+    {
+      op = getopt_long (argc, argv, "d:F:hks:", options, &index);
+      if (op == -1)
+	break;
+
+      switch (op)
+	{
+	case 'd':
+	  work_dir = optarg;
+	  break;
+
+	case 'F':
+	  only_version = strtoul (optarg, &end, 16);
+	  if (*end != '\0'
+	      || (only_version != 0x0100 && only_version != 0x0110))
+	    {
+	      fprintf_utf8 (stderr, "%s: Invalid format: %s\n", argv[0],
+			    optarg);
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
+
+	case 'k':
+	  keep = true;
+	  break;
+
+	case 's':
+	  for (i = 0; i < G_N_ELEMENTS (shapes); i++)
+	    {
+	      if (strcmp (optarg, shapes[i].name) == 0)
+		break;
+	    }
+
+	  if (i == G_N_ELEMENTS (shapes))
+	    {
+	      fprintf_utf8 (stderr, "%s: Invalid shape: %s\n", argv[0],
+			    optarg);
+	      exit (EXIT_FAILURE);
+	    }
+
+	  only_shape = optarg;
+	  break;
+
+	case 'S':
+	  scale = g_ascii_strtod (optarg, &end);
+	  if (*end != '\0' || !(scale > 0 && scale <= 1000))
+	    {
+	      fprintf_utf8 (stderr, "%s: Invalid scale: %s\n", argv[0],
+			    optarg);
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
+
+	case 'I':
+	  errno = 0;
+	  n = strtoul (optarg, &end, 0);
+	  if (*optarg == '\0' || *end != '\0' || errno != 0
+	      || n > UINT32_MAX)
+	    {
+	      fprintf_utf8 (stderr, "%s: Invalid set id: %s\n", argv[0],
+			    optarg);
+	      exit (EXIT_FAILURE);
+	    }
+	  set_id = n;
+	  break;
+
+	case 'h':
+	  print_help (argv[0]);
+	  exit (EXIT_SUCCESS);
+	  break;
+
+	default:
+	  fprintf_utf8 (stderr, "Try `%s --help' for more information.\n",
+			argv[0]);
+	  exit (EXIT_FAILURE);
+	}
+    }
+}
+
+static int64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+get_usage (Usage *usage)
+{
+  char *contents;
+  char *p;
+
+  usage->syscr	 = -1;
+  usage->syscw	 = -1;
+  usage->max_rss = -1;
+
+  /* Only Linux counts system calls per process. */
+  if (g_file_get_contents ("/proc/self/io", &contents, NULL, NULL))
+    {
+      if ((p = strstr (contents, "syscr: ")) != NULL)
+	usage->syscr = g_ascii_strtoll (p + 7, NULL, 10);
+      if ((p = strstr (contents, "syscw: ")) != NULL)
+	usage->syscw = g_ascii_strtoll (p + 7, NULL, 10);
+
+      g_free (contents);
+    }
+
+#ifdef HAVE_SYS_RESOURCE_H
+  {
+    struct rusage ru;
+
+    if (getrusage (RUSAGE_SELF, &ru) == 0)
+      usage->max_rss = ru.ru_maxrss;
+  }
+#endif
+}
+
+static int
+compare_samples (const void *a, const void *b)
+{
+  int64_t x = *(const int64_t *) a;
+  int64_t y = *(const int64_t *) b;
+
+  return (x > y) - (x < y);
+}
+
+static double
+percentile (GArray *samples, double p)
+{
+  guint n;
+
+  n = (guint) (p * (samples->len - 1) + 0.5);
+  return g_array_index (samples, int64_t, n) / 1000.0;
+}
+
+/* Prints one result line; samples holds the duration of each operation in
+ * nanoseconds. */
+static void
+report (const Archive *archive, const char *op, GArray *samples,
+	uint64_t bytes, const Usage *before)
+{
+  Usage after;
+  int64_t total = 0;
+  double seconds;
+  guint n;
+
+  if (samples->len == 0)
+    return;
+
+  get_usage (&after);
+
+  for (n = 0; n < samples->len; n++)
+    total += g_array_index (samples, int64_t, n);
+
+  g_array_sort (samples, &compare_samples);
+  seconds = total / 1e9;
+
+  printf ("{\"archive\":\"%s-%04x\",\"shape\":\"%s\",\"format\":\"%04x\","
+	  "\"files\":%u,\"bytes\":%" PRIu64 ",\"op\":\"%s\",\"n\":%u,"
+	  "\"seconds\":%.6f,\"mib_per_s\":%.2f,\"ops_per_s\":%.1f,"
+	  "\"p50_us\":%.3f,\"p90_us\":%.3f,\"p99_us\":%.3f,\"max_us\":%.3f,"
+	  "\"read_syscalls\":%" PRId64 ",\"write_syscalls\":%" PRId64 ","
+	  "\"process_peak_rss_kib\":%ld}\n",
+	  archive->shape->name, archive->version, archive->shape->name,
+	  archive->version, archive->files->len, archive->bytes, op,
+	  samples->len, seconds,
+	  seconds > 0 ? bytes / seconds / (1024 * 1024) : 0.0,
+	  seconds > 0 ? samples->len / seconds : 0.0,
+	  percentile (samples, 0.50), percentile (samples, 0.90),
+	  percentile (samples, 0.99), percentile (samples, 1.0),
+	  before->syscr < 0 ? -1
+			    : after.syscr - before->syscr - overhead.syscr,
+	  before->syscw < 0 ? -1
+			    : after.syscw - before->syscw - overhead.syscw,
+	  after.max_rss);
+  fflush (stdout);
+
+  g_array_set_size (samples, 0);
+}
+
+static void
+add_generated (const char *path, uint64_t size, int error, Archive *archive)
+{
+  g_ptr_array_add (archive->files, g_strdup (path));
+  archive->bytes += size;
+}
+
+static int
+create_archive (Archive *archive)
+{
+  const Shape *shape = archive->shape;
+  NksGeneratorOptions options;
+  NksWriter *writer;
+  int r;
+
+  options.files	    = MAX (1, (unsigned long) (shape->files * scale));
+  options.min_size  = shape->min_size;
+  options.max_size  = shape->max_size;
+  options.depth	    = shape->depth;
+  options.fanout    = shape->fanout;
+  options.encrypted = shape->encrypted;
+  options.seed	    = 1;
+
+  /* Archives with few files scale their size instead. */
+  if (shape->files < 100)
+    {
+      options.files    = shape->files;
+      options.min_size = MIN (shape->min_size * scale, UINT32_MAX);
+      options.max_size = MIN (shape->max_size * scale, UINT32_MAX);
+    }
+
+  r = nks_create (archive->path, archive->version, set_id, &writer);
+  if (r != 0)
+    return r;
+
+  archive->files     = g_ptr_array_new_with_free_func (g_free);
+  archive->generated = g_new (NksGeneratedFile, options.files);
+  archive->bytes     = 0;
+
+  r = nks_generate_files (writer, &options, archive->generated,
+			  (NksGeneratedFunc) &add_generated, archive);
+  if (r != 0)
+    {
+      nks_writer_discard (writer);
+      return r;
+    }
+
+  return nks_writer_close (writer);
+}
+
+typedef struct
+{
+  const char *dir;		/* Extract into dir, or only count */
+  size_t      entries;
+  int	      error;
+} WalkContext;
+
+static bool
+walk_entry (Nks *nks, const NksEntry *entry, WalkContext *ctx);
+
+static void
+walk (Nks *nks, const NksEntry *dir_entry, const char *dir, WalkContext *ctx)
+{
+  WalkContext sub = *ctx;
+  int r;
+
+  sub.dir = dir;
+  r = nks_list_dir_entry (nks, dir_entry, (NksTraverseFunc) &walk_entry, &sub);
+  if (r != 0 && sub.error == 0)
+    sub.error = r;
+
+  ctx->entries = sub.entries;
+  if (ctx->error == 0)
+    ctx->error = sub.error;
+}
+
+static bool
+walk_entry (Nks *nks, const NksEntry *entry, WalkContext *ctx)
+{
+  char *path = NULL;
+  int r = 0;
+
+  ctx->entries++;
+
+  if (ctx->dir != NULL)
+    path = g_build_filename (ctx->dir, entry->name, NULL);
+
+  if (entry->type == NKS_ENT_DIRECTORY)
+    {
+      if (path != NULL && mkdir (path, 0777) != 0)
+	r = -errno;
+
+      if (r == 0)
+	walk (nks, entry, path, ctx);
+    }
+  else if (path != NULL)
+    r = nks_extract_file_entry (nks, entry, path);
+
+  if (r != 0 && ctx->error == 0)
+    ctx->error = r;
+
+  g_free (path);
+
+  return (ctx->error == 0);
+}
+
+static void
+remove_tree (const char *path)
+{
+  const char *name;
+  char *child;
+  GDir *dir;
+
+  dir = g_dir_open (path, 0, NULL);
+  if (dir != NULL)
+    {
+      while ((name = g_dir_read_name (dir)) != NULL)
+	{
+	  child = g_build_filename (path, name, NULL);
+	  remove_tree (child);
+	  g_free (child);
+	}
+
+      g_dir_close (dir);
+      rmdir (path);
+    }
+  else
+    unlink (path);
+}
+
+static int
+run_archive (Archive *archive)
+{
+  NksEntry root_entry;
+  NksEntry entry;
+  WalkContext ctx;
+  GArray *samples;
+  GRand *rand;
+  Usage before;
+  uint64_t bytes;
+  int64_t start;
+  char *out;
+  Nks *nks;
+  int n;
+  int r;
+
+  root_entry.name   = "";
+  root_entry.offset = 0;
+  root_entry.type   = NKS_ENT_DIRECTORY;
+
+  samples = g_array_new (false, false, sizeof (int64_t));
+  rand	  = g_rand_new_with_seed (1);
+
+  get_usage (&before);
+  start = now_ns ();
+  r = create_archive (archive);
+  start = now_ns () - start;
+  if (r != 0)
+    goto end;
+  g_array_append_val (samples, start);
+  report (archive, "create", samples, archive->bytes, &before);
+
+  get_usage (&before);
+  for (n = 0; n < 10; n++)
+    {
+      start = now_ns ();
+      r = nks_open_flags (archive->path, NKS_OPEN_MMAP | NKS_OPEN_INDEX,
+			  &nks);
+      start = now_ns () - start;
+      if (r != 0)
+	goto end;
+      g_array_append_val (samples, start);
+      nks_close (nks);
+    }
+  report (archive, "open", samples, 0, &before);
+
+  r = nks_open_flags (archive->path, NKS_OPEN_MMAP | NKS_OPEN_INDEX, &nks);
+  if (r != 0)
+    goto end;
+
+  get_usage (&before);
+  for (n = 0; n < 3; n++)
+    {
+      memset (&ctx, 0, sizeof (ctx));
+
+      start = now_ns ();
+      walk (nks, &root_entry, NULL, &ctx);
+      start = now_ns () - start;
+      g_array_append_val (samples, start);
+    }
+  report (archive, "list", samples, 0, &before);
+
+  get_usage (&before);
+  for (n = 0; n < 10000; n++)
+    {
+      const char *path;
+
+      path = g_ptr_array_index (archive->files,
+				g_rand_int_range (rand, 0, archive->files->len));
+
+      start = now_ns ();
+      r = nks_find_entry (nks, path, &entry);
+      start = now_ns () - start;
+      if (r != 0)
+	goto close;
+      g_array_append_val (samples, start);
+      nks_entry_free (&entry);
+    }
+  report (archive, "find", samples, 0, &before);
+
+  out = g_build_filename (work_dir, "out", NULL);
+  remove_tree (out);
+  if (mkdir (out, 0777) != 0)
+    {
+      r = -errno;
+      g_free (out);
+      goto close;
+    }
+
+  get_usage (&before);
+  memset (&ctx, 0, sizeof (ctx));
+  start = now_ns ();
+  walk (nks, &root_entry, out, &ctx);
+  start = now_ns () - start;
+  r = ctx.error;
+  if (r == 0)
+    {
+      g_array_append_val (samples, start);
+      report (archive, "extract_all", samples, archive->bytes, &before);
+    }
+  remove_tree (out);
+  g_free (out);
+  if (r != 0)
+    goto close;
+
+  out	= g_build_filename (work_dir, "one", NULL);
+  bytes = 0;
+
+  get_usage (&before);
+  for (n = 0; n < 100; n++)
+    {
+      const char *path;
+
+      path = g_ptr_array_index (archive->files,
+				g_rand_int_range (rand, 0, archive->files->len));
+      r = nks_find_entry (nks, path, &entry);
+      if (r != 0)
+	break;
+
+      unlink (out);
+
+      start = now_ns ();
+      r = nks_extract_file_entry (nks, &entry, out);
+      start = now_ns () - start;
+      if (r == 0)
+	{
+	  g_array_append_val (samples, start);
+	  bytes += nks_file_size (nks, &entry);
+	}
+      nks_entry_free (&entry);
+      if (r != 0)
+	break;
+    }
+  if (r == 0)
+    report (archive, "extract_one", samples, bytes, &before);
+  unlink (out);
+  g_free (out);
+
+close:
+  nks_close (nks);
+
+end:
+  if (!keep)
+    unlink (archive->path);
+
+  g_rand_free (rand);
+  g_array_free (samples, true);
+
+  return r;
+}
+
+int
+main (int argc, char **argv)
+{
+  static const unsigned int versions[] = { 0x0100, 0x0110 };
+  Archive archive;
+  Usage before;
+  char *tmp_dir = NULL;
+  bool ok = true;
+  size_t s, v;
+  int r;
+
+  parse_arguments (argc, argv);
+
+  get_usage (&before);
+  get_usage (&overhead);
+  overhead.syscr -= before.syscr;
+  overhead.syscw -= before.syscw;
+
+  if (work_dir == NULL)
+    {
+      tmp_dir = g_dir_make_tmp ("nks-bench-XXXXXX", NULL);
+      if (tmp_dir == NULL)
+	{
+	  fprintf_utf8 (stderr, "%s: Cannot create a temporary directory\n",
+			argv[0]);
+	  return EXIT_FAILURE;
+	}
+      work_dir = tmp_dir;
+    }
+  else if (mkdir (work_dir, 0777) != 0 && errno != EEXIST)
+    {
+      perror (work_dir);
+      return EXIT_FAILURE;
+    }
+
+  for (s = 0; s < G_N_ELEMENTS (shapes); s++)
+    {
+      if (only_shape != NULL && strcmp (only_shape, shapes[s].name) != 0)
+	continue;
+
+      for (v = 0; v < G_N_ELEMENTS (versions); v++)
+	{
+	  if (only_version != 0 && only_version != versions[v])
+	    continue;
+
+	  memset (&archive, 0, sizeof (archive));
+	  archive.shape	  = &shapes[s];
+	  archive.version = versions[v];
+	  archive.path	  = g_strdup_printf ("%s" SEP "%s-%04x.%s", work_dir,
+					     shapes[s].name, versions[v],
+					     versions[v] == 0x0100
+					     ? "nks" : "nkx");
+
+	  r = run_archive (&archive);
+	  if (r != 0)
+	    {
+	      fprintf_utf8 (stderr, "%s: %s\n", archive.path, strerror (-r));
+	      ok = false;
+	    }
+
+	  if (archive.files != NULL)
+	    g_ptr_array_free (archive.files, true);
+	  g_free (archive.generated);
+	  g_free (archive.path);
+	}
+    }
+
+  if (tmp_dir != NULL && !keep)
+    remove_tree (tmp_dir);
+  g_free (tmp_dir);
+
+  return (ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
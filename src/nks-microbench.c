@@ -0,0 +1,447 @@
+#include <getopt.h>
+#include <glib.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gen_key.h"
+#include "keys.h"
+#include "nks_reader.h"
+#include "nks_xor.h"
+#include "util.h"
+
+typedef struct
+{
+  const char *kernel;
+  const char *variant;
+  size_t      size;		/* Bytes processed per operation */
+  void	     *data;
+} Case;
+
+typedef void (*KernelFunc) (Case *c);
+
+static const char *only_kernel = NULL;
+static double	   min_time    = 0.2;	/* Seconds per case */
+static volatile uintptr_t sink;		/* Keeps results alive */
+
+static void
+print_help (const char *argv0)
+{
+  printf_utf8 (
+    "Usage: %s [OPTIONS]\n"
+    "\n"
+    "Times the decryption, keystream, key generation, name decoding and\n"
+    "path kernels on their own.  Results are printed as one JSON object per\n"
+    "line.\n"
+    "\n"
+    "Options:\n"
+    "  -k  --kernel=NAME    Only run xor, keystream, rand, utf16, casefold\n"
+    "                       or path\n"
+    "  -t  --time=SECONDS   Run each case for at least SECONDS (default 0.2)\n"
+    "  -h  --help           Print out usage instructions\n",
+    argv0);
+}
+
+static void
+parse_arguments (int argc, char **argv)
+{
+  int op, index = 0;
+  char *end;
+  static struct option options[] =
+  {
+    {"help",   false, NULL, 'h'},
+    {"kernel", true,  NULL, 'k'},
+    {"time",   true,  NULL, 't'},
+    {NULL,     false, NULL, 0}
+  };
+
+  for (;;)
+    {
+      op = getopt_long (argc, argv, "hk:t:", options, &index);
+      if (op == -1)
+	break;
+
+      switch (op)
+	{
+	case 'k':
+	  only_kernel = optarg;
+	  break;
+
+	case 't':
+	  min_time = g_ascii_strtod (optarg, &end);
+	  if (*end != '\0' || !(min_time > 0 && min_time <= 60))
+	    {
+	      fprintf_utf8 (stderr, "%s: Invalid time: %s\n", argv[0], optarg);
+	      exit (EXIT_FAILURE);
+	    }
+	  break;
+
+	case 'h':
+	  print_help (argv[0]);
+	  exit (EXIT_SUCCESS);
+	  break;
+
+	default:
+	  fprintf_utf8 (stderr, "Try `%s --help' for more information.\n",
+			argv[0]);
+	  exit (EXIT_FAILURE);
+	}
+    }
+}
+
+static int64_t
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Runs func in batches which double in size until min_time has passed. */
+static void
+run (Case *c, KernelFunc func)
+{
+  uint64_t ops = 0;
+  uint64_t batch = 1;
+  uint64_t n;
+  int64_t start;
+  int64_t elapsed;
+  double seconds;
+
+  if (only_kernel != NULL && strcmp (only_kernel, c->kernel) != 0)
+    return;
+
+  /* One untimed call, to warm caches and one-time initialisation. */
+  func (c);
+
+  start = now_ns ();
+  do
+    {
+      for (n = 0; n < batch; n++)
+	func (c);
+
+      ops += batch;
+      batch *= 2;
+      elapsed = now_ns () - start;
+    }
+  while (elapsed < min_time * 1e9);
+
+  seconds = elapsed / 1e9;
+
+  printf ("{\"kernel\":\"%s\",\"variant\":\"%s\",\"size\":%zu,"
+	  "\"ops\":%" PRIu64 ",\"ns_per_op\":%.2f,\"mib_per_s\":%.2f}\n",
+	  c->kernel, c->variant, c->size, ops, elapsed / (double) ops,
+	  c->size * (double) ops / seconds / (1024 * 1024));
+  fflush (stdout);
+}
+
+/* Decryption, as done while extracting encrypted entries */
+
+typedef struct
+{
+  uint8_t	*buffer;
+  const uint8_t *key;
+  size_t	 key_length;
+} XorData;
+
+static void
+xor_kernel (Case *c)
+{
+  XorData *d = c->data;
+
+  sink = nks_xor_key (d->buffer, d->buffer, c->size, d->key, d->key_length,
+		      3);
+}
+
+/* Keystream setup of 0x0110 archives */
+
+static void
+keystream_kernel (Case *c)
+{
+  NksGeneratingKey *gk = c->data;
+  uint8_t buffer[0x10000];
+
+  if (nks_create_0110_key (gk, buffer, c->size) == 0)
+    sink = buffer[0];
+}
+
+/* rand_ms byte streams, as used for the fixed keys and key expansion */
+
+/* Seeds gk the way the library table does, with 4-byte key and iv. */
+static void
+init_short_key (NksGeneratingKey *gk)
+{
+  memset (gk, 0, sizeof (*gk));
+  memcpy (gk->key, "\x60\xa2\x19\x2b", 4);
+  gk->key_len = 4;
+  memcpy (gk->iv, "\x60\xda\xb1\xcb", 4);
+  gk->iv_len = 4;
+}
+
+static void
+rand_kernel (Case *c)
+{
+  uint8_t *buffer = c->data;
+  uint32_t seed = UINT32_C (0x608da0a2);
+  size_t n;
+
+  for (n = 0; n < c->size; n++)
+    buffer[n] = rand_ms (&seed) & 0xff;
+
+  sink = buffer[c->size - 1];
+}
+
+static void
+expand_kernel (Case *c)
+{
+  NksGeneratingKey gk;
+
+  init_short_key (&gk);
+  nks_generating_key_expand (&gk);
+
+  sink = gk.key[0] ^ gk.iv[0];
+}
+
+/* Name decoding of 0x0110 entries */
+
+static void
+utf16_kernel (Case *c)
+{
+  NksReader *reader = c->data;
+  char *name;
+
+  nks_reader_seek (reader, 0);
+  if (nks_reader_read_utf16_le_string (reader, &name))
+    {
+      sink = (uintptr_t) name[0];
+      g_free (name);
+    }
+}
+
+/* Case-insensitive name comparison, as done by nks_find_entry */
+
+typedef struct
+{
+  char *name;
+  char *folded_target;
+} CasefoldData;
+
+static void
+casefold_kernel (Case *c)
+{
+  CasefoldData *d = c->data;
+  char *folded;
+
+  folded = g_utf8_casefold (d->name, -1);
+  sink = g_utf8_collate (d->folded_target, folded);
+  g_free (folded);
+}
+
+/* Path helpers */
+
+static void
+join_kernel (Case *c)
+{
+  char buffer[FILENAME_MAX + 1];
+
+  sink = join_path_segments (c->data, "Sample.wav", buffer, sizeof (buffer));
+}
+
+static void
+segments_kernel (Case *c)
+{
+  char segment[FILENAME_MAX + 1];
+  const char *rest = c->data;
+
+  while (rest != NULL && *rest != '\0')
+    {
+      if (extract_path_segment (rest, segment, sizeof (segment), &rest) != 0)
+	break;
+    }
+
+  sink = segment[0];
+}
+
+static void
+valid_name_kernel (Case *c)
+{
+  sink = valid_file_name (c->data);
+}
+
+static char *
+make_name (size_t length)
+{
+  static const char pattern[] = "Grand Piano Ä Velocity Layer ";
+  GString *name;
+
+  name = g_string_new (NULL);
+  while (g_utf8_strlen (name->str, -1) < (glong) length)
+    g_string_append_unichar (name,
+			     g_utf8_get_char (g_utf8_offset_to_pointer
+					      (pattern, name->len
+					       % (sizeof (pattern) - 3))));
+
+  return g_string_free (name, false);
+}
+
+static char *
+make_path (size_t segments)
+{
+  GString *path;
+  size_t n;
+
+  path = g_string_new (NULL);
+  for (n = 0; n < segments; n++)
+    g_string_append_printf (path, "%sFolder %02zu", n == 0 ? "" : "/", n);
+
+  return g_string_free (path, false);
+}
+
+/* Maps a file holding the UTF-16 name, so that the reader works from
+ * memory like it does on mapped archives. */
+static bool
+open_utf16_reader (const char *name, NksReader *reader)
+{
+  gunichar2 *utf16;
+  char *file_name;
+  glong len;
+  bool ok;
+  int fd;
+
+  utf16 = g_utf8_to_utf16 (name, -1, NULL, &len, NULL);
+  fd = g_file_open_tmp ("nks-microbench-XXXXXX", &file_name, NULL);
+  if (fd < 0)
+    {
+      g_free (utf16);
+      return false;
+    }
+
+  unlink (file_name);
+  g_free (file_name);
+
+  /* Little-endian hosts only, which is all this needs to measure. */
+  ok = (write (fd, utf16, 2 * (len + 1)) == 2 * (len + 1));
+  g_free (utf16);
+
+  if (ok && !nks_reader_init_mmap (reader, fd))
+    nks_reader_init (reader, fd);
+
+  return ok;
+}
+
+int
+main (int argc, char **argv)
+{
+  static const size_t xor_sizes[] = { 64, 1024, 16384, 262144, 4194304 };
+  static const size_t keystream_sizes[] = { 16, 4096, 0x10000 };
+  static const size_t name_lengths[] = { 8, 32, 128 };
+  static const size_t path_segments[] = { 1, 4, 16 };
+  const uint8_t *key16;
+  uint8_t *key64k;
+  NksGeneratingKey gk;
+  XorData xor_data;
+  CasefoldData casefold_data;
+  NksReader reader;
+  Case c;
+  char variant[32];
+  size_t n;
+  int r;
+
+  parse_arguments (argc, argv);
+
+  nks_get_0100_key (0, &key16, NULL);
+  key64k = g_malloc (0x10000);
+  for (n = 0; n < 0x10000; n++)
+    key64k[n] = n * 167;
+
+  xor_data.buffer = g_malloc0 (xor_sizes[G_N_ELEMENTS (xor_sizes) - 1]);
+
+  for (n = 0; n < G_N_ELEMENTS (xor_sizes); n++)
+    {
+      xor_data.key	  = key16;
+      xor_data.key_length = 16;
+      c = (Case) { "xor", "key16", xor_sizes[n], &xor_data };
+      run (&c, &xor_kernel);
+
+      xor_data.key	  = key64k;
+      xor_data.key_length = 0x10000;
+      c = (Case) { "xor", "key64k", xor_sizes[n], &xor_data };
+      run (&c, &xor_kernel);
+    }
+
+  init_short_key (&gk);
+  nks_generating_key_expand (&gk);
+
+  r = nks_create_0110_key (&gk, xor_data.buffer, 16);
+  if (r != 0)
+    fprintf_utf8 (stderr, "%s: Cannot create keystream: %s\n", argv[0],
+		  strerror (-r));
+  else
+    {
+      for (n = 0; n < G_N_ELEMENTS (keystream_sizes); n++)
+	{
+	  c = (Case) { "keystream", "aes256", keystream_sizes[n], &gk };
+	  run (&c, &keystream_kernel);
+	}
+    }
+
+  c = (Case) { "rand", "bytes", 16, xor_data.buffer };
+  run (&c, &rand_kernel);
+  c = (Case) { "rand", "bytes", 0x10000, xor_data.buffer };
+  run (&c, &rand_kernel);
+  c = (Case) { "rand", "expand", 48, NULL };
+  run (&c, &expand_kernel);
+
+  for (n = 0; n < G_N_ELEMENTS (name_lengths); n++)
+    {
+      char *name = make_name (name_lengths[n]);
+
+      g_snprintf (variant, sizeof (variant), "%zu-chars", name_lengths[n]);
+
+      if (open_utf16_reader (name, &reader))
+	{
+	  c = (Case) { "utf16", variant, 2 * (name_lengths[n] + 1), &reader };
+	  run (&c, &utf16_kernel);
+	  nks_reader_clear (&reader);
+	  close (reader.fd);
+	}
+
+      /* The worst case: names which only differ at the end. */
+      casefold_data.name	  = name;
+      casefold_data.folded_target = g_utf8_casefold (name, -1);
+      casefold_data.folded_target[strlen (casefold_data.folded_target) - 1]
+	^= 1;
+
+      c = (Case) { "casefold", variant, strlen (name), &casefold_data };
+      run (&c, &casefold_kernel);
+
+      g_free (casefold_data.folded_target);
+      g_free (name);
+    }
+
+  for (n = 0; n < G_N_ELEMENTS (path_segments); n++)
+    {
+      char *path = make_path (path_segments[n]);
+
+      g_snprintf (variant, sizeof (variant), "join-%zu", path_segments[n]);
+      c = (Case) { "path", variant, strlen (path), path };
+      run (&c, &join_kernel);
+
+      g_snprintf (variant, sizeof (variant), "segments-%zu", path_segments[n]);
+      c = (Case) { "path", variant, strlen (path), path };
+      run (&c, &segments_kernel);
+
+      g_snprintf (variant, sizeof (variant), "valid-%zu", path_segments[n]);
+      c = (Case) { "path", variant, strlen (path), path };
+      run (&c, &valid_name_kernel);
+
+      g_free (path);
+    }
+
+  g_free (xor_data.buffer);
+  g_free (key64k);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,824 @@
+#define FUSE_USE_VERSION 31
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse_lowlevel.h>
+#include <glib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#include "nks.h"
+
+/* Decrypted file data is cached in blocks of this size. */
+#define BLOCK_SIZE (128 * 1024)
+
+/* Default size of the block cache, in MiB. */
+#define DEFAULT_CACHE_SIZE 64
+
+/* Idle read handles kept per file for later requests. */
+#define MAX_IDLE_FILES 4
+
+/* A mounted archive never changes, so the kernel may cache everything. */
+#define ATTR_TIMEOUT 86400.0
+
+/*
+ * Nodes are made as the kernel asks for them, from the entries of the
+ * directories it looks into.  Entries at the same offset in the archive, as
+ * those of a directory reached through an alias, share one node, so a tree
+ * which refers back to itself is still finite.
+ */
+typedef struct
+{
+  NksEntry    entry;
+  fuse_ino_t  parent;	/* The first directory the entry was found in */
+  off_t	      size;	/* -1 until first asked for */
+  bool	      listed;	/* Whether children and names are filled in */
+  GArray     *children;	/* Inode numbers, for directories */
+  GHashTable *names;	/* Name -> inode number, for directories */
+  GMutex      lock;
+  GSList     *files;	/* Idle NksFile handles */
+} Node;
+
+typedef struct
+{
+  guint64 key;		/* Inode number and block index */
+  gint	  ref_count;
+  GList	 *link;		/* Position in lru, or NULL if not cached */
+  size_t  size;
+  uint8_t data[];
+} Block;
+
+typedef struct
+{
+  char		*archive;
+  unsigned long	 cache_size;
+} Options;
+
+static Nks	  *nks;
+static GMutex	   tree_lock;
+static GPtrArray  *nodes;	/* Node * by inode number - 1 */
+static GHashTable *inodes;	/* Entry offset -> inode number */
+static struct stat archive_st;
+
+static GMutex	   cache_lock;
+static GHashTable *blocks;	/* key -> Block */
+static GQueue	   lru = G_QUEUE_INIT;	/* Most recently used first */
+static size_t	   cache_limit;
+
+static const struct fuse_opt option_spec[] =
+{
+  { "cache_size=%lu", offsetof (Options, cache_size), 0 },
+  FUSE_OPT_END
+};
+
+static void
+print_usage (const char *argv0)
+{
+  printf ("Usage: %s [options] ARCHIVE MOUNTPOINT\n\n"
+	  "nks-mount options:\n"
+	  "    -o cache_size=MIB      size of the decrypted block cache "
+	  "(default: %d)\n\n",
+	  argv0, DEFAULT_CACHE_SIZE);
+}
+
+/* Must be called with the tree lock held. */
+static Node *
+lookup_node (fuse_ino_t ino)
+{
+  if (ino == 0 || ino > nodes->len)
+    return NULL;
+
+  return g_ptr_array_index (nodes, ino - 1);
+}
+
+static Node *
+get_node (fuse_ino_t ino)
+{
+  Node *node;
+
+  g_mutex_lock (&tree_lock);
+  node = lookup_node (ino);
+  g_mutex_unlock (&tree_lock);
+
+  return node;
+}
+
+/* Returns the inode number of the entry, making a node for it first if
+ * there is none yet.  Must be called with the tree lock held. */
+static fuse_ino_t
+add_node (const NksEntry *entry, fuse_ino_t parent)
+{
+  gpointer key = GSIZE_TO_POINTER ((gsize) entry->offset);
+  gpointer ino;
+  Node *node;
+
+  if (g_hash_table_lookup_extended (inodes, key, NULL, &ino))
+    return GPOINTER_TO_SIZE (ino);
+
+  node = g_malloc0 (sizeof (*node));
+  nks_entry_copy (entry, &node->entry);
+  node->parent = parent;
+  node->size   = -1;
+  g_mutex_init (&node->lock);
+
+  if (entry->type == NKS_ENT_DIRECTORY)
+    {
+      node->children = g_array_new (false, false, sizeof (fuse_ino_t));
+      node->names    = g_hash_table_new (g_str_hash, g_str_equal);
+    }
+
+  g_ptr_array_add (nodes, node);
+  g_hash_table_insert (inodes, key, GSIZE_TO_POINTER (nodes->len));
+
+  return nodes->len;
+}
+
+static void
+free_node (Node *node)
+{
+  g_slist_free_full (node->files, (GDestroyNotify) &nks_file_close);
+  g_mutex_clear (&node->lock);
+
+  if (node->children != NULL)
+    {
+      g_array_free (node->children, true);
+      g_hash_table_destroy (node->names);
+    }
+
+  nks_entry_free (&node->entry);
+  g_free (node);
+}
+
+static bool
+add_child (Nks *nks, const NksEntry *entry, gpointer parent)
+{
+  fuse_ino_t dir_ino = GPOINTER_TO_SIZE (parent);
+  fuse_ino_t ino;
+  Node *dir;
+
+  if (entry->type != NKS_ENT_DIRECTORY && entry->type != NKS_ENT_FILE)
+    return true;
+
+  /* The first of several entries with the same name wins. */
+  dir = lookup_node (dir_ino);
+  if (g_hash_table_contains (dir->names, entry->name))
+    return true;
+
+  ino = add_node (entry, dir_ino);
+
+  g_array_append_val (dir->children, ino);
+  g_hash_table_insert (dir->names, lookup_node (ino)->entry.name,
+		       GSIZE_TO_POINTER (ino));
+
+  return true;
+}
+
+/* Fills in the children of a directory the first time they are asked for.
+ * With the index the archive was opened with, this reads nothing from the
+ * archive itself.  Must be called with the tree lock held. */
+static int
+list_node (fuse_ino_t ino, Node *dir)
+{
+  int r;
+
+  if (dir->listed)
+    return 0;
+
+  r = nks_list_dir_entry (nks, &dir->entry, (NksTraverseFunc) &add_child,
+			  GSIZE_TO_POINTER (ino));
+  if (r != 0)
+    {
+      g_array_set_size (dir->children, 0);
+      g_hash_table_remove_all (dir->names);
+      return r;
+    }
+
+  dir->listed = true;
+
+  return 0;
+}
+
+static void
+init_tree (void)
+{
+  NksEntry root_entry;
+  fuse_ino_t ino;
+
+  nodes	 = g_ptr_array_new_with_free_func ((GDestroyNotify) &free_node);
+  inodes = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  root_entry.name   = "";
+  root_entry.offset = 0;
+  root_entry.type   = NKS_ENT_DIRECTORY;
+
+  ino = add_node (&root_entry, FUSE_ROOT_ID);
+  g_assert (ino == FUSE_ROOT_ID);
+}
+
+/* Sizes are read when first asked for, since that means decoding the header
+ * of the file. */
+static int
+get_size (Node *node, off_t *ret)
+{
+  off_t size;
+
+  g_mutex_lock (&node->lock);
+  size = node->size;
+  g_mutex_unlock (&node->lock);
+
+  if (size < 0)
+    {
+      size = nks_file_size (nks, &node->entry);
+      if (size < 0)
+	return size;
+
+      g_mutex_lock (&node->lock);
+      node->size = size;
+      g_mutex_unlock (&node->lock);
+    }
+
+  *ret = size;
+
+  return 0;
+}
+
+static int
+fill_attr (fuse_ino_t ino, Node *node, struct stat *st)
+{
+  off_t size;
+  int r;
+
+  memset (st, 0, sizeof (*st));
+
+  st->st_ino	 = ino;
+  st->st_uid	 = archive_st.st_uid;
+  st->st_gid	 = archive_st.st_gid;
+  st->st_atime	 = archive_st.st_atime;
+  st->st_mtime	 = archive_st.st_mtime;
+  st->st_ctime	 = archive_st.st_ctime;
+  st->st_blksize = BLOCK_SIZE;
+
+  if (node->children != NULL)
+    {
+      st->st_mode  = S_IFDIR | 0555;
+      st->st_nlink = 2;
+    }
+  else
+    {
+      r = get_size (node, &size);
+      if (r != 0)
+	return r;
+
+      st->st_mode   = S_IFREG | 0444;
+      st->st_nlink  = 1;
+      st->st_size   = size;
+      st->st_blocks = (size + 511) / 512;
+    }
+
+  return 0;
+}
+
+static void
+unref_block (Block *block)
+{
+  if (g_atomic_int_dec_and_test (&block->ref_count))
+    g_free (block);
+}
+
+/* Must be called with the cache lock held. */
+static void
+evict (size_t max_size)
+{
+  Block *block;
+
+  while (lru.length > 0 && lru.length * BLOCK_SIZE > max_size)
+    {
+      block = g_queue_pop_tail (&lru);
+      block->link = NULL;
+
+      g_hash_table_remove (blocks, &block->key);
+      unref_block (block);
+    }
+}
+
+/* Must be called with the cache lock held. */
+static Block *
+lookup_block (guint64 key)
+{
+  Block *block;
+
+  if (blocks == NULL)
+    return NULL;
+
+  block = g_hash_table_lookup (blocks, &key);
+  if (block == NULL)
+    return NULL;
+
+  g_queue_unlink (&lru, block->link);
+  g_queue_push_head_link (&lru, block->link);
+  g_atomic_int_inc (&block->ref_count);
+
+  return block;
+}
+
+/* Reads through a handle of the node's own, so that requests for the same
+ * file do not wait for each other. */
+static int
+read_block (Node *node, off_t offset, void *buffer, size_t size)
+{
+  NksFile *file = NULL;
+  ssize_t count;
+  size_t done = 0;
+  int r = 0;
+
+  g_mutex_lock (&node->lock);
+  if (node->files != NULL)
+    {
+      file = node->files->data;
+      node->files = g_slist_delete_link (node->files, node->files);
+    }
+  g_mutex_unlock (&node->lock);
+
+  if (file == NULL)
+    {
+      r = nks_file_open (nks, &node->entry, &file);
+      if (r != 0)
+	return r;
+    }
+
+  while (done < size)
+    {
+      count = nks_file_pread (file, (uint8_t *) buffer + done, size - done,
+			      offset + done);
+      if (count <= 0)
+	{
+	  r = (count < 0 ? count : -EIO);
+	  break;
+	}
+
+      done += count;
+    }
+
+  g_mutex_lock (&node->lock);
+  if (g_slist_length (node->files) < MAX_IDLE_FILES)
+    {
+      node->files = g_slist_prepend (node->files, file);
+      file = NULL;
+    }
+  g_mutex_unlock (&node->lock);
+
+  nks_file_close (file);
+
+  return r;
+}
+
+static int
+get_block (fuse_ino_t ino, Node *node, off_t size, uint64_t index,
+	   Block **ret)
+{
+  guint64 key = ((guint64) ino << 32) | index;
+  Block *block;
+  Block *other;
+  off_t offset;
+  int r;
+
+  g_mutex_lock (&cache_lock);
+  block = lookup_block (key);
+  g_mutex_unlock (&cache_lock);
+
+  if (block != NULL)
+    {
+      *ret = block;
+      return 0;
+    }
+
+  offset = (off_t) index * BLOCK_SIZE;
+
+  /* Decrypt outside the lock, so that other blocks can be served
+   * meanwhile. */
+  block = g_malloc (sizeof (*block) + BLOCK_SIZE);
+  block->key	   = key;
+  block->ref_count = 1;
+  block->link	   = NULL;
+  block->size	   = MIN ((uintmax_t) (size - offset), BLOCK_SIZE);
+
+  r = read_block (node, offset, block->data, block->size);
+  if (r != 0)
+    {
+      g_free (block);
+      return r;
+    }
+
+  g_mutex_lock (&cache_lock);
+
+  /* Another thread may have read the same block meanwhile. */
+  other = lookup_block (key);
+  if (other != NULL)
+    {
+      g_mutex_unlock (&cache_lock);
+      g_free (block);
+      *ret = other;
+      return 0;
+    }
+
+  if (cache_limit >= BLOCK_SIZE)
+    {
+      if (blocks == NULL)
+	blocks = g_hash_table_new (g_int64_hash, g_int64_equal);
+
+      evict (cache_limit - BLOCK_SIZE);
+
+      /* One reference belongs to the cache. */
+      g_atomic_int_inc (&block->ref_count);
+      g_queue_push_head (&lru, block);
+      block->link = lru.head;
+      g_hash_table_insert (blocks, &block->key, block);
+    }
+
+  g_mutex_unlock (&cache_lock);
+
+  *ret = block;
+
+  return 0;
+}
+
+static void
+mount_lookup (fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  struct fuse_entry_param e;
+  Node *dir;
+  gpointer ino;
+  int r;
+
+  g_mutex_lock (&tree_lock);
+
+  dir = lookup_node (parent);
+  if (dir == NULL)
+    r = -ENOENT;
+  else if (dir->names == NULL)
+    r = -ENOTDIR;
+  else
+    r = list_node (parent, dir);
+
+  if (r == 0 && !g_hash_table_lookup_extended (dir->names, name, NULL, &ino))
+    r = -ENOENT;
+
+  g_mutex_unlock (&tree_lock);
+
+  if (r != 0)
+    {
+      fuse_reply_err (req, -r);
+      return;
+    }
+
+  memset (&e, 0, sizeof (e));
+  e.ino		  = GPOINTER_TO_SIZE (ino);
+  e.attr_timeout  = ATTR_TIMEOUT;
+  e.entry_timeout = ATTR_TIMEOUT;
+
+  r = fill_attr (e.ino, get_node (e.ino), &e.attr);
+  if (r != 0)
+    fuse_reply_err (req, -r);
+  else
+    fuse_reply_entry (req, &e);
+}
+
+static void
+mount_getattr (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  Node *node = get_node (ino);
+  struct stat st;
+  int r;
+
+  if (node == NULL)
+    {
+      fuse_reply_err (req, ENOENT);
+      return;
+    }
+
+  r = fill_attr (ino, node, &st);
+  if (r != 0)
+    fuse_reply_err (req, -r);
+  else
+    fuse_reply_attr (req, &st, ATTR_TIMEOUT);
+}
+
+static void
+mount_readdir (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+	       struct fuse_file_info *fi)
+{
+  Node *dir;
+  const char *name;
+  fuse_ino_t child;
+  struct stat st;
+  char *buffer;
+  size_t entry_size;
+  size_t len = 0;
+  off_t n;
+  int r;
+
+  g_mutex_lock (&tree_lock);
+
+  dir = lookup_node (ino);
+  if (dir == NULL)
+    r = -ENOENT;
+  else if (dir->children == NULL)
+    r = -ENOTDIR;
+  else
+    r = list_node (ino, dir);
+
+  if (r != 0)
+    {
+      g_mutex_unlock (&tree_lock);
+      fuse_reply_err (req, -r);
+      return;
+    }
+
+  buffer = g_malloc (size);
+
+  /* Offsets 0 and 1 are "." and "..", the children follow. */
+  for (n = off; n < (off_t) dir->children->len + 2; n++)
+    {
+      if (n == 0)
+	{
+	  name  = ".";
+	  child = ino;
+	}
+      else if (n == 1)
+	{
+	  name  = "..";
+	  child = dir->parent;
+	}
+      else
+	{
+	  child = g_array_index (dir->children, fuse_ino_t, n - 2);
+	  name  = lookup_node (child)->entry.name;
+	}
+
+      memset (&st, 0, sizeof (st));
+      st.st_ino	 = child;
+      st.st_mode = (lookup_node (child)->children != NULL ? S_IFDIR
+							   : S_IFREG);
+
+      entry_size = fuse_add_direntry (req, buffer + len, size - len, name,
+				      &st, n + 1);
+      if (entry_size > size - len)
+	break;
+
+      len += entry_size;
+    }
+
+  g_mutex_unlock (&tree_lock);
+
+  fuse_reply_buf (req, buffer, len);
+  g_free (buffer);
+}
+
+static void
+mount_open (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  Node *node = get_node (ino);
+
+  if (node == NULL)
+    fuse_reply_err (req, ENOENT);
+  else if (node->children != NULL)
+    fuse_reply_err (req, EISDIR);
+  else if ((fi->flags & O_ACCMODE) != O_RDONLY)
+    fuse_reply_err (req, EROFS);
+  else
+    {
+      /* File contents never change, so cached pages stay valid across
+       * opens. */
+      fi->keep_cache = 1;
+      fuse_reply_open (req, fi);
+    }
+}
+
+static void
+mount_read (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+	    struct fuse_file_info *fi)
+{
+  Node *node = get_node (ino);
+  Block *block;
+  char *buffer;
+  off_t file_size;
+  size_t start;
+  size_t count;
+  size_t len = 0;
+  int r;
+
+  if (node == NULL || off < 0)
+    {
+      fuse_reply_err (req, EINVAL);
+      return;
+    }
+
+  r = get_size (node, &file_size);
+  if (r != 0)
+    {
+      fuse_reply_err (req, -r);
+      return;
+    }
+
+  if (off >= file_size)
+    {
+      fuse_reply_buf (req, NULL, 0);
+      return;
+    }
+
+  size = MIN ((uintmax_t) size, (uintmax_t) (file_size - off));
+  buffer = g_malloc (size);
+
+  while (len < size)
+    {
+      r = get_block (ino, node, file_size, (off + len) / BLOCK_SIZE, &block);
+      if (r != 0)
+	{
+	  g_free (buffer);
+	  fuse_reply_err (req, -r);
+	  return;
+	}
+
+      start = (off + len) % BLOCK_SIZE;
+      count = MIN (block->size - start, size - len);
+      memcpy (buffer + len, block->data + start, count);
+      len += count;
+
+      unref_block (block);
+    }
+
+  fuse_reply_buf (req, buffer, len);
+  g_free (buffer);
+}
+
+static void
+mount_statfs (fuse_req_t req, fuse_ino_t ino)
+{
+  struct statvfs st;
+
+  memset (&st, 0, sizeof (st));
+  st.f_bsize   = BLOCK_SIZE;
+  st.f_frsize  = 512;
+  st.f_blocks  = (archive_st.st_size + 511) / 512;
+  st.f_namemax = 255;
+
+  /* Only the entries looked at so far are known. */
+  g_mutex_lock (&tree_lock);
+  st.f_files = nodes->len;
+  g_mutex_unlock (&tree_lock);
+
+  fuse_reply_statfs (req, &st);
+}
+
+static const struct fuse_lowlevel_ops operations =
+{
+  .lookup  = mount_lookup,
+  .getattr = mount_getattr,
+  .readdir = mount_readdir,
+  .open	   = mount_open,
+  .read	   = mount_read,
+  .statfs  = mount_statfs,
+};
+
+static int
+process_arg (void *data, const char *arg, int key, struct fuse_args *outargs)
+{
+  Options *options = data;
+
+  /* The first plain argument is the archive, the second the mount point. */
+  if (key == FUSE_OPT_KEY_NONOPT && options->archive == NULL)
+    {
+      options->archive = g_strdup (arg);
+      return 0;
+    }
+
+  return 1;
+}
+
+int
+main (int argc, char **argv)
+{
+  struct fuse_args args = FUSE_ARGS_INIT (argc, argv);
+  struct fuse_cmdline_opts opts;
+  struct fuse_session *se = NULL;
+  Options options;
+  int ret = EXIT_FAILURE;
+  int r;
+
+  memset (&opts, 0, sizeof (opts));
+  memset (&options, 0, sizeof (options));
+  options.cache_size = DEFAULT_CACHE_SIZE;
+
+  if (fuse_opt_parse (&args, &options, option_spec, &process_arg) != 0
+      || fuse_parse_cmdline (&args, &opts) != 0)
+    goto end;
+
+  if (opts.show_help)
+    {
+      print_usage (argv[0]);
+      fuse_cmdline_help ();
+      fuse_lowlevel_help ();
+      ret = EXIT_SUCCESS;
+      goto end;
+    }
+
+  if (opts.show_version)
+    {
+      printf ("nks-mount " PACKAGE_VERSION "\n");
+      fuse_lowlevel_version ();
+      ret = EXIT_SUCCESS;
+      goto end;
+    }
+
+  if (options.archive == NULL || opts.mountpoint == NULL)
+    {
+      print_usage (argv[0]);
+      goto end;
+    }
+
+  cache_limit = MIN (options.cache_size, SIZE_MAX >> 20) << 20;
+
+  if (stat (options.archive, &archive_st) != 0)
+    {
+      perror (options.archive);
+      goto end;
+    }
+
+  /* Every request reads through its own cursor, so the session can run
+   * several threads. */
+  r = nks_open_flags (options.archive,
+		      NKS_OPEN_MMAP | NKS_OPEN_INDEX | NKS_OPEN_REENTRANT,
+		      &nks);
+  if (r == -ENOTSUP)
+    {
+      opts.singlethread = 1;
+      r = nks_open_flags (options.archive, NKS_OPEN_MMAP | NKS_OPEN_INDEX,
+			  &nks);
+    }
+  if (r != 0)
+    {
+      fprintf (stderr, "%s: %s\n", options.archive, strerror (-r));
+      goto end;
+    }
+
+  init_tree ();
+
+  se = fuse_session_new (&args, &operations, sizeof (operations), NULL);
+  if (se == NULL)
+    goto end;
+
+  if (fuse_set_signal_handlers (se) != 0)
+    goto end;
+
+  if (fuse_session_mount (se, opts.mountpoint) != 0)
+    {
+      fuse_remove_signal_handlers (se);
+      goto end;
+    }
+
+  fuse_daemonize (opts.foreground);
+
+  if (opts.singlethread)
+    r = fuse_session_loop (se);
+  else
+    r = fuse_session_loop_mt (se, opts.clone_fd);
+
+  ret = (r == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+
+  fuse_session_unmount (se);
+  fuse_remove_signal_handlers (se);
+
+end:
+  if (se != NULL)
+    fuse_session_destroy (se);
+
+  if (blocks != NULL)
+    {
+      Block *block;
+
+      while ((block = g_queue_pop_head (&lru)) != NULL)
+	unref_block (block);
+
+      g_hash_table_destroy (blocks);
+    }
+
+  if (nodes != NULL)
+    {
+      g_ptr_array_free (nodes, true);
+      g_hash_table_destroy (inodes);
+    }
+
+  if (nks != NULL)
+    nks_close (nks);
+
+  free (opts.mountpoint);
+  fuse_opt_free_args (&args);
+  g_free (options.archive);
+
+  return ret;
+}
@@ -0,0 +1,450 @@
+#include <errno.h>
+#include <getopt.h>
+#include <glib.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <locale.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+# include <io.h>
+#endif
+
+#include "generate.h"
+#include "nks.h"
+#include "util.h"
+
+static const char  *file_name  = NULL;	/* Archive to create */
+static const char  *source_dir = NULL;	/* Directory to pack */
+static unsigned int version    = 0x0100;
+static uint32_t	    set_id     = 0;
+static bool	    encrypt    = false;
+static bool	    generate   = false;
+static bool	    verbose    = false;
+static FILE	   *listing    = NULL;	/* Where verbose output goes */
+
+static NksGeneratorOptions gen =
+{
+  .files     = 1000,
+  .min_size  = 65536,
+  .max_size  = 65536,
+  .depth     = 2,
+  .fanout    = 4,
+  .encrypted = 0,
+  .seed	     = 1,
+};
+
+static void
+print_help (const char *argv0)
+{
+  printf_utf8 (
+    "Usage: %s [OPTIONS] -f ARCHIVE DIRECTORY\n"
+    "  or:  %s [OPTIONS] -f ARCHIVE --generate [GENERATOR OPTIONS]\n"
+    "\n"
+    "Creates ARCHIVE from the contents of DIRECTORY, or from generated files.\n"
+    "\n"
+    "  -f  --file=ARCHIVE   Write to ARCHIVE, or stdout if ARCHIVE is -\n"
+    "\n"
+    "Options:\n"
+    "  -F  --format=VERSION Archive format: 0100 (nks, default) or 0110 (nkx)\n"
+    "  -s  --set-id=ID      Library whose key encrypts 0110 files\n"
+    "  -e  --encrypt        Encrypt all files\n"
+    "  -v  --verbose        Verbose operation\n"
+    "      --version        Print version and license information\n"
+    "  -h  --help           Print out usage instructions\n"
+    "\n"
+    "Generator options:\n"
+    "  -g  --generate       Generate files instead of reading DIRECTORY\n"
+    "      --files=N        Number of files (default 1000)\n"
+    "      --size=MIN[:MAX] File sizes in bytes, optionally with a K, M or G\n"
+    "                       suffix (default 64K)\n"
+    "      --depth=N        Levels of directories below the root (default 2)\n"
+    "      --fanout=N       Subdirectories of each directory (default 4)\n"
+    "      --encrypted=PCT  Percentage of files to encrypt (default 0)\n"
+    "      --seed=N         Seed for file sizes and contents (default 1)\n"
+    "\n"
+    "e.g. to create a 1 GiB test archive, use:\n"
+    "  %s -f test.nks --generate --files=4096 --size=256K --encrypted=50\n",
+    argv0, argv0, argv0);
+}
+
+static void
+print_version (void)
+{
+  printf_utf8 (
+    "nks-pack (" PACKAGE_NAME ") " PACKAGE_VERSION "\n"
+    "Copyright (C) 2008-2009  Unavowed <unavowed@vexillium.org>\n"
+    "License GPLv3+: GNU GPL version 3 or later "
+	      "<http://gnu.org/licenses/gpl.html>\n"
+    "This is free software: you are free to change and redistribute it.\n"
+    "There is NO WARRANTY, to the extent permitted by law.\n");
+}
+
+static bool
+parse_number (const char *text, unsigned long max, unsigned long *ret)
+{
+  char *end;
+  unsigned long n;
+
+  errno = 0;
+  n = strtoul (text, &end, 0);
+  if (*text == '\0' || *end != '\0' || errno != 0 || n > max)
+    return false;
+
+  *ret = n;
+  return true;
+}
+
+static bool
+parse_size (const char *text, const char **rest, uint64_t *ret)
+{
+  char *end;
+  uint64_t n;
+  unsigned int shift = 0;
+
+  errno = 0;
+  n = g_ascii_strtoull (text, &end, 10);
+  if (end == text || errno != 0)
+    return false;
+
+  switch (*end)
+    {
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+    }
+
+  if (n > (UINT32_MAX >> shift))
+    return false;
+
+  *ret	= n << shift;
+  *rest = end;
+  return true;
+}
+
+static void
+invalid_argument (const char *argv0, const char *what, const char *arg)
+{
+  fprintf_utf8 (stderr, "%s: Invalid %s: %s\n", argv0, what, arg);
+  exit (EXIT_FAILURE);
+}
+
+static void
+parse_arguments (int argc, char **argv)
+{
+  int op, index = 0;
+  unsigned long n;
+  static struct option options[] =
+  {
+    {"encrypt",   false, NULL, 'e'},
+    {"encrypted", true,  NULL, 'E'},
+    {"depth",	  true,  NULL, 'D'},
+    {"fanout",	  true,  NULL, 'O'},
+    {"file",	  true,  NULL, 'f'},
+    {"files",	  true,  NULL, 'N'},
+    {"format",	  true,  NULL, 'F'},
+    {"generate",  false, NULL, 'g'},
+    {"help",	  false, NULL, 'h'},
+    {"seed",	  true,  NULL, 'S'},
+    {"set-id",	  true,  NULL, 's'},
+    {"size",	  true,  NULL, 'Z'},
+    {"verbose",   false, NULL, 'v'},
+    {"version",   false, NULL, 'V'},
+    {NULL,	  false, NULL, 0}
+  };
+
+  for (;;)
+    {
+      op = getopt_long (argc, argv, "ef:F:ghs:vV", options, &index);
+      if (op == -1)
+	break;
+
+      switch (op)
+	{
+	case 'f':
+	  if (file_name != NULL)
+	    {
+	      fprintf_utf8 (stderr, "%s: Only one file name may be given.\n",
+			    argv[0]);
+	      exit (EXIT_FAILURE);
+	    }
+	  file_name = g_strdup (optarg);
+	  break;
+
+	case 'F':
+	  if (strcmp (optarg, "0100") == 0 || strcmp (optarg, "nks") == 0)
+	    version = 0x0100;
+	  else if (strcmp (optarg, "0110") == 0 || strcmp (optarg, "nkx") == 0)
+	    version = 0x0110;
+	  else
+	    invalid_argument (argv[0], "format", optarg);
+	  break;
+
+	case 's':
+	  if (!parse_number (optarg, UINT32_MAX, &n))
+	    invalid_argument (argv[0], "set id", optarg);
+	  set_id = n;
+	  break;
+
+	case 'e':
+	  encrypt = true;
+	  break;
+
+	case 'g':
+	  generate = true;
+	  break;
+
+	case 'N':
+	  if (!parse_number (optarg, UINT32_MAX, &gen.files))
+	    invalid_argument (argv[0], "number of files", optarg);
+	  break;
+
+	case 'Z':
+	  {
+	    const char *rest;
+
+	    if (!parse_size (optarg, &rest, &gen.min_size))
+	      invalid_argument (argv[0], "size", optarg);
+
+	    gen.max_size = gen.min_size;
+
+	    if (*rest == ':' && !parse_size (rest + 1, &rest, &gen.max_size))
+	      invalid_argument (argv[0], "size", optarg);
+
+	    if (*rest != '\0' || gen.max_size < gen.min_size)
+	      invalid_argument (argv[0], "size", optarg);
+	  }
+	  break;
+
+	case 'D':
+	  if (!parse_number (optarg, 32, &gen.depth))
+	    invalid_argument (argv[0], "depth", optarg);
+	  break;
+
+	case 'O':
+	  if (!parse_number (optarg, 65536, &gen.fanout))
+	    invalid_argument (argv[0], "fanout", optarg);
+	  break;
+
+	case 'E':
+	  if (!parse_number (optarg, 100, &gen.encrypted))
+	    invalid_argument (argv[0], "percentage", optarg);
+	  break;
+
+	case 'S':
+	  if (!parse_number (optarg, ULONG_MAX, &n))
+	    invalid_argument (argv[0], "seed", optarg);
+	  gen.seed = n;
+	  break;
+
+	case 'h':
+	  print_help (argv[0]);
+	  exit (EXIT_SUCCESS);
+	  break;
+
+	case 'v':
+	  verbose = true;
+	  break;
+
+	case 'V':
+	  print_version ();
+	  exit (EXIT_SUCCESS);
+	  break;
+
+	default:
+	  fprintf_utf8 (stderr, "Try `%s --help' for more information.\n",
+			argv[0]);
+	  exit (EXIT_FAILURE);
+	}
+    }
+
+  if (optind < argc)
+    source_dir = argv[optind++];
+
+  if (optind < argc || (source_dir != NULL) == generate)
+    {
+      fprintf_utf8 (stderr, "%s: Give either one directory or --generate.\n",
+		    argv[0]);
+      exit (EXIT_FAILURE);
+    }
+
+  if (encrypt)
+    gen.encrypted = 100;
+}
+
+static void
+report_generated (const char *path, uint64_t size, int error, void *data)
+{
+  if (verbose)
+    fprintf_utf8 (listing, "%s\n", path);
+
+  if (error != 0)
+    fprintf_utf8 (stderr, "%s: %s\n", path, strerror (-error));
+}
+
+static int
+compare_names (const void *a, const void *b)
+{
+  return strcmp (*(char * const *) a, *(char * const *) b);
+}
+
+/* Adds the contents of dir, in name order so that archives are
+ * reproducible.  Errors are reported where they happen. */
+static int
+add_directory (NksWriter *writer, const char *dir, const char *prefix)
+{
+  GPtrArray *names;
+  const char *name;
+  char *source;
+  char *path;
+  struct stat st;
+  GError *error = NULL;
+  GDir *gdir;
+  bool link, reported;
+  guint n;
+  int r = 0;
+
+  gdir = g_dir_open (dir, 0, &error);
+  if (gdir == NULL)
+    {
+      fprintf_utf8 (stderr, "%s\n", error->message);
+      g_error_free (error);
+      return -EIO;
+    }
+
+  names = g_ptr_array_new_with_free_func (g_free);
+
+  while ((name = g_dir_read_name (gdir)) != NULL)
+    g_ptr_array_add (names, g_strdup (name));
+
+  g_dir_close (gdir);
+  g_ptr_array_sort (names, &compare_names);
+
+  for (n = 0; n < names->len && r == 0; n++)
+    {
+      name   = g_ptr_array_index (names, n);
+      source = g_build_filename (dir, name, NULL);
+      path   = (prefix[0] == '\0' ? g_strdup (name)
+				  : g_strconcat (prefix, "/", name, NULL));
+
+      /* Linked files are packed, but linked directories could lead back up
+       * the tree. */
+      link = false;
+      reported = false;
+#ifndef _WIN32
+      if (lstat (source, &st) == 0 && S_ISLNK (st.st_mode))
+	link = true;
+#endif
+
+      if (stat (source, &st) != 0)
+	r = -errno;
+      else if (S_ISDIR (st.st_mode) && link)
+	fprintf_utf8 (stderr, "%s: Link to a directory, skipped\n", source);
+      else if (S_ISDIR (st.st_mode))
+	{
+	  r = nks_writer_add_directory (writer, path);
+	  if (r == 0)
+	    {
+	      if (verbose)
+		fprintf_utf8 (listing, "%s/\n", path);
+
+	      r = add_directory (writer, source, path);
+	      reported = true;
+	    }
+	}
+      else if (S_ISREG (st.st_mode))
+	{
+	  r = nks_writer_add_file_path (writer, path, source,
+					encrypt ? NKS_WRITE_ENCRYPTED : 0);
+	  if (r == 0 && verbose)
+	    fprintf_utf8 (listing, "%s\n", path);
+	}
+      else
+	fprintf_utf8 (stderr, "%s: Not a regular file, skipped\n", source);
+
+      /* Archive names ignore case, so such an entry could not be found. */
+      if (r == -EEXIST && !reported)
+	{
+	  fprintf_utf8 (stderr, "%s: Name differs from another only in case, "
+			"skipped\n", source);
+	  r = 0;
+	}
+
+      if (r != 0 && !reported)
+	fprintf_utf8 (stderr, "%s: %s\n", source, strerror (-r));
+
+      g_free (source);
+      g_free (path);
+    }
+
+  g_ptr_array_free (names, true);
+
+  return r;
+}
+
+int
+main (int argc, char **argv)
+{
+  NksGeneratedFile *files = NULL;
+  NksWriter *writer;
+  int ret = EXIT_FAILURE;
+  int r;
+
+  setlocale (LC_ALL, "");
+
+  parse_arguments (argc, argv);
+
+  if (file_name == NULL)
+    {
+      fprintf_utf8 (stderr, "%s: No file name given.\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+
+  /* The listing must not end up in an archive written to stdout. */
+  listing = stdout;
+
+  if (strcmp (file_name, "-") == 0)
+    {
+      listing = stderr;
+#ifdef _WIN32
+      _setmode (STDOUT_FILENO, O_BINARY);
+#endif
+      r = nks_create_fd (STDOUT_FILENO, version, set_id, &writer);
+    }
+  else
+    r = nks_create (file_name, version, set_id, &writer);
+
+  if (r != 0)
+    {
+      fprintf_utf8 (stderr, "%s: %s\n", file_name, strerror (-r));
+      return EXIT_FAILURE;
+    }
+
+  if (generate)
+    {
+      files = g_new0 (NksGeneratedFile, MAX (gen.files, 1));
+      r = nks_generate_files (writer, &gen, files, &report_generated, NULL);
+    }
+  else
+    r = add_directory (writer, source_dir, "");
+
+  if (r != 0)
+    {
+      nks_writer_discard (writer);
+      goto end;
+    }
+
+  r = nks_writer_close (writer);
+  if (r != 0)
+    {
+      fprintf_utf8 (stderr, "%s: %s\n", file_name, strerror (-r));
+      goto end;
+    }
+
+  ret = EXIT_SUCCESS;
+
+end:
+  g_free (files);
+
+  return ret;
+}
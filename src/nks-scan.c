@@ -418,6 +418,7 @@ scan_file (int fd, const char *name, int indent)
 static bool
 scan_chunk (int fd, const char *name, int indent)
 {
+  uint8_t data[4];
   uint32_t magic;
   off_t off;
 
@@ -425,9 +426,12 @@ scan_chunk (int fd, const char *name, int indent)
   if (off < 0)
     return false;
 
-  if (!read_u32_le (fd, &magic))
+  if (read (fd, data, sizeof (data)) != sizeof (data))
     return false;
 
+  magic = ((uint32_t) data[0] | (uint32_t) data[1] << 8
+	   | (uint32_t) data[2] << 16 | (uint32_t) data[3] << 24);
+
   if (lseek (fd, -0x04, SEEK_CUR) < 0)
     return false;
 
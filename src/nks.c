@@ -2,37 +2,69 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <glib.h>
+#include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <unistd.h>
+#ifdef HAVE_SYS_SENDFILE_H
+# include <sys/sendfile.h>
+#endif
 
+#include "buffer_pool.h"
+#include "key_cache.h"
 #include "keys.h"
 #include "libs.h"
 #include "nks.h"
+#include "nks_index.h"
 #include "nks_io.h"
+#include "nks_reader.h"
+#include "nks_spill.h"
+#include "nks_stats.h"
+#include "nks_uring.h"
+#include "nks_utf16.h"
+#include "nks_xor.h"
 #include "util.h"
 
-typedef struct
-{
-  uint32_t set_id;
-  uint8_t  data[0x10000];
-} NksSetKey;
+/* off_t is a signed type of unknown width. */
+#define OFF_T_MAX ((off_t) (((uintmax_t) 1 << (sizeof (off_t) * 8 - 1)) - 1))
 
 struct Nks
 {
-  int	   fd;
-  NksEntry root_entry;
+  int	    fd;
+  NksEntry  root_entry;
   GTree	   *set_keys;
+  GMutex    set_keys_lock;
+  NksReader reader;
+  NksIndex *index;
+  NksBufferPool *buffers;
+  NksStats *stats;	/* NULL unless opened with NKS_OPEN_STATS */
+  bool	    reentrant;
 };
 
 static int
-compare_pu32 (uint32_t *a, uint32_t *b)
+compare_uint_keys (gconstpointer a, gconstpointer b, gpointer user_data)
 {
-  return (*a - *b);
+  guint x = GPOINTER_TO_UINT (a);
+  guint y = GPOINTER_TO_UINT (b);
+
+  return (x < y ? -1 : x > y);
 }
 
-int
-nks_open (const char *file_name, Nks **ret)
+static char *
+index_cache_dir (void)
+{
+  const char *dir;
+
+  dir = g_getenv ("NKS_INDEX_CACHE_DIR");
+  if (dir != NULL && dir[0] != '\0')
+    return g_strdup (dir);
+
+  return g_build_filename (g_get_user_cache_dir (), "libnks", NULL);
+}
+
+static int
+open_file (const char *file_name, unsigned int flags, Nks **ret)
 {
   int fd;
   int r;
@@ -41,7 +73,7 @@ nks_open (const char *file_name, Nks **ret)
   if (fd < 0)
     return -errno;
 
-  r = nks_open_fd (fd, ret);
+  r = nks_open_fd_flags (fd, flags, ret);
   if (r != 0)
     {
       close (fd);
@@ -51,9 +83,34 @@ nks_open (const char *file_name, Nks **ret)
   return 0;
 }
 
+int
+nks_open (const char *file_name, Nks **ret)
+{
+  return open_file (file_name, 0, ret);
+}
+
+int
+nks_open_mmap (const char *file_name, Nks **ret)
+{
+  return open_file (file_name, NKS_OPEN_MMAP, ret);
+}
+
+int
+nks_open_flags (const char *file_name, unsigned int flags, Nks **ret)
+{
+  return open_file (file_name, flags, ret);
+}
+
 int
 nks_open_fd (int fd, Nks **ret)
 {
+  return nks_open_fd_flags (fd, 0, ret);
+}
+
+int
+nks_open_fd_flags (int fd, unsigned int flags, Nks **ret)
+{
+  bool count_stats = ((flags & NKS_OPEN_STATS) != 0);
   Nks *nks;
 
   assert (ret != NULL);
@@ -66,8 +123,67 @@ nks_open_fd (int fd, Nks **ret)
   nks->root_entry.type   = NKS_ENT_DIRECTORY;
   nks->root_entry.offset = 0;
   nks->fd		 = fd;
-  nks->set_keys		 = g_tree_new_full ((GCompareDataFunc) &compare_pu32,
-					    NULL, NULL, &g_free);
+  nks->set_keys		 = g_tree_new_full (&compare_uint_keys, NULL, NULL,
+					    (GDestroyNotify) &nks_key_cache_release);
+  nks->reentrant	 = ((flags & NKS_OPEN_REENTRANT) != 0);
+  g_mutex_init (&nks->set_keys_lock);
+
+  /* A stream can only be walked once, front to back. */
+  if (flags & NKS_OPEN_STREAM)
+    {
+      flags = NKS_OPEN_STREAM;
+      nks->reentrant = false;
+      nks_reader_init_stream (&nks->reader, fd);
+    }
+  else if (!(flags & NKS_OPEN_MMAP)
+	   || !nks_reader_init_mmap (&nks->reader, fd))
+    nks_reader_init (&nks->reader, fd);
+
+#ifndef HAVE_PREAD
+  /* Cursors would fight over the file position of the shared descriptor. */
+  if (nks->reentrant && !nks_reader_is_mapped (&nks->reader))
+    {
+      nks_reader_clear (&nks->reader);
+      g_tree_destroy (nks->set_keys);
+      g_mutex_clear (&nks->set_keys_lock);
+      g_free (nks);
+      return -ENOTSUP;
+    }
+#endif
+
+  nks->buffers = nks_buffer_pool_new ();
+
+  if (count_stats)
+    {
+      nks->stats	= g_malloc0 (sizeof (*nks->stats));
+      nks->reader.stats = nks->stats;
+    }
+
+  /* The index is an optimisation only; without it every lookup reads the
+   * directory tables as before. */
+  if (flags & NKS_OPEN_INDEX_CACHE)
+    {
+      char *cache_dir = index_cache_dir ();
+
+      if (nks_index_load (&nks->reader, cache_dir, &nks->index) == 0)
+	NKS_STATS_ADD (nks->stats, index_cache_hits, 1);
+      else
+	{
+	  NKS_STATS_ADD (nks->stats, index_cache_misses, 1);
+
+	  if (nks_index_build (nks, &nks->index) == 0)
+	    nks_index_save (nks->index, &nks->reader, cache_dir);
+	  else
+	    nks->index = NULL;
+	}
+
+      g_free (cache_dir);
+    }
+  else if (flags & NKS_OPEN_INDEX)
+    {
+      if (nks_index_build (nks, &nks->index) != 0)
+	nks->index = NULL;
+    }
 
   *ret = nks;
 
@@ -81,6 +197,11 @@ nks_close (Nks *nks)
   assert (nks->fd >= 0);
 
   g_tree_destroy (nks->set_keys);
+  g_mutex_clear (&nks->set_keys_lock);
+  nks_index_free (nks->index);
+  nks_buffer_pool_free (nks->buffers);
+  nks_reader_clear (&nks->reader);
+  g_free (nks->stats);
 
   close (nks->fd);
 
@@ -90,6 +211,42 @@ nks_close (Nks *nks)
   g_free (nks);
 }
 
+/*
+ * Returns the reader to use for one operation.  Reentrant archives get a
+ * private cursor each time, so that no state is shared between threads.
+ * Unless the archive is mapped, its buffer comes from the pool of the
+ * archive, so that operations do not allocate one each.
+ */
+static NksReader *
+open_cursor (Nks *nks, NksReader *cursor)
+{
+  void *buffer = NULL;
+
+  if (!nks->reentrant)
+    return &nks->reader;
+
+  if (!nks_reader_is_mapped (&nks->reader))
+    buffer = nks_buffer_pool_alloc (nks->buffers, NKS_READER_BUFFER_SIZE);
+
+  nks_reader_init_cursor (cursor, &nks->reader, buffer);
+  return cursor;
+}
+
+static void
+close_cursor (Nks *nks, NksReader *reader)
+{
+  void *buffer;
+
+  if (reader == &nks->reader)
+    return;
+
+  buffer = (nks_reader_is_mapped (reader) ? NULL : reader->buffer);
+  nks_reader_clear (reader);
+
+  if (buffer != NULL)
+    nks_buffer_pool_release (nks->buffers, buffer);
+}
+
 typedef struct
 {
   char	   *name;
@@ -98,7 +255,7 @@ typedef struct
 } FindEntryContext;
 
 static bool
-nks_find_sub_entry (const NksEntry *ent, FindEntryContext *ctx)
+nks_find_sub_entry (Nks *nks, const NksEntry *ent, FindEntryContext *ctx)
 {
   char *folded;
 
@@ -123,6 +280,9 @@ nks_get_entry (Nks *nks, const NksEntry *entry, const char *name,
   FindEntryContext context;
   int r;
 
+  if (nks->index != NULL)
+    return nks_index_get_entry (nks->index, entry, name, ret);
+
   context.name  = g_utf8_casefold (name, -1);
   context.entry = ret;
   context.found = false;
@@ -151,6 +311,9 @@ nks_find_entry (Nks *nks, const char *name, NksEntry *ret)
   if (name == NULL || name[0] == '/')
     return -EINVAL;
 
+  if (nks->index != NULL)
+    return nks_index_find_entry (nks->index, name, ret);
+
   nks_entry_copy (&nks->root_entry, &entry);
 
   while (name != NULL)
@@ -186,340 +349,1970 @@ err:
   return r;
 }
 
-int
-nks_list_dir (Nks *nks, const char *dir, NksTraverseFunc func, void *user_data)
+/*
+ * Batched lookups.  The paths are normalised, case-folded and sorted, so that
+ * all the paths below one directory form a contiguous range, and each range
+ * is resolved with a single scan of its directory.
+ */
+typedef struct
 {
-  NksEntry ent;
-  int r;
-
-  r = nks_find_entry (nks, dir, &ent);
-  if (r != 0)
-    return r;
-
-  if (ent.type != NKS_ENT_DIRECTORY)
-    return -ENOTDIR;
+  char		*folded;	/* Normalised and case-folded path */
+  const char	*rest;		/* Segments of folded not yet resolved */
+  NksFindResult *result;
+} BatchLookup;
 
-  r = nks_list_dir_entry (nks, &ent, func, user_data);
-  nks_entry_free (&ent);
+typedef struct
+{
+  char	  *name;	/* Case-folded segment */
+  size_t   first;	/* Range of the lookups continuing with it */
+  size_t   count;
+  NksEntry entry;
+  bool	   found;
+} BatchGroup;
 
-  return r;
-}
+typedef struct
+{
+  GHashTable *groups;	/* Segment -> BatchGroup */
+  size_t      missing;
+  int	      error;	/* For the groups not found when the scan ended */
+} BatchScan;
 
 static int
-list_directory (Nks *nks, NksDirectoryHeader *header,
-		NksTraverseFunc func, void *user_data)
+normalise_path (const char *path, GString *ret)
 {
-  off_t offset;
-  NksEntry ent;
-  uint32_t n;
+  char buffer[FILENAME_MAX];
+  char *folded;
   int r;
 
-  offset = lseek (nks->fd, 0, SEEK_CUR);
-  if (offset < 0)
-    return -EIO;
+  if (path == NULL || path[0] == '/')
+    return -EINVAL;
 
-  for (n = 0; n < header->entry_count; n++)
+  while (path != NULL)
     {
-      if (lseek (nks->fd, offset, SEEK_SET) < 0)
-	return -EIO;
+      r = extract_path_segment (path, buffer, sizeof (buffer), &path);
+      if (r != 0)
+	return r;
 
-      switch (header->version)
-	{
-	case 0x0100:
-	  r = nks_read_0100_nks_entry (nks->fd, header, &ent);
-	  break;
+      if (buffer[0] == 0)
+	break;
 
-	case 0x0110:
-	  r = nks_read_0110_nks_entry (nks->fd, header, &ent);
-	  break;
+      if (ret->len != 0)
+	g_string_append_c (ret, '/');
+      g_string_append (ret, buffer);
+    }
 
-	default:
-	  r = -ENOTSUP;
-	  break;
-	}
+  folded = nks_index_fold_path (ret->str);
+  g_string_assign (ret, folded);
+  g_free (folded);
 
-      if (r != 0)
-	return r;
+  return 0;
+}
 
-      offset = lseek (nks->fd, 0, SEEK_CUR);
-      if (offset < 0)
-	{
-	  nks_entry_free (&ent);
-	  return -EIO;
-	}
+static int
+path_byte_rank (uint8_t c)
+{
+  /* A path sorts right before everything below it. */
+  if (c == '/')
+    return 1;
 
-      if (!func ((Nks *) nks, &ent, user_data))
-	{
-	  nks_entry_free (&ent);
-	  break;
-	}
+  return (c == 0 ? 0 : c + 1);
+}
+
+static int
+compare_lookups (const void *a, const void *b)
+{
+  const uint8_t *p = (const uint8_t *) ((const BatchLookup *) a)->folded;
+  const uint8_t *q = (const uint8_t *) ((const BatchLookup *) b)->folded;
 
-      nks_entry_free (&ent);
+  while (*p == *q && *p != 0)
+    {
+      p++;
+      q++;
     }
-  
-  return 0;
+
+  return path_byte_rank (*p) - path_byte_rank (*q);
 }
 
-int
-nks_list_dir_entry (Nks *nks, const NksEntry *entry, NksTraverseFunc func,
-		    void *user_data)
+static size_t
+segment_length (const char *path)
 {
-  NksDirectoryHeader header;
+  const char *sl = strchr (path, '/');
+
+  return (sl != NULL ? (size_t) (sl - path) : strlen (path));
+}
+
+static bool
+match_view (Nks *nks, NksEntryView *view, BatchScan *scan)
+{
+  BatchGroup *group;
+  const char *name;
+  char *folded;
   int r;
 
-  if (entry->type != NKS_ENT_DIRECTORY)
-    return -ENOTDIR;
+  /* A name which cannot be decoded ends the scan, as it does for
+   * nks_get_entry. */
+  name = nks_entry_view_name (view);
+  if (name == NULL)
+    {
+      scan->error = -EIO;
+      return false;
+    }
 
-  if (lseek (nks->fd, entry->offset, SEEK_SET) < 0)
-    return -EIO;
+  folded = nks_index_fold_path (name);
+  group = g_hash_table_lookup (scan->groups, folded);
+  g_free (folded);
 
-  r = nks_read_directory_header (nks->fd, &header);
+  /* The first of several entries with the same name wins. */
+  if (group == NULL || group->found)
+    return true;
+
+  r = nks_entry_view_copy (view, &group->entry);
   if (r != 0)
-    return r;
+    {
+      scan->error = r;
+      return false;
+    }
 
-  return list_directory (nks, &header, func, user_data);
+  group->found = true;
+  return (--scan->missing > 0);
 }
 
 static void
-allocate_file_space (int fd, off_t size)
+fail_lookups (BatchLookup *lookups, size_t count, int error)
 {
-#ifdef HAVE_POSIX_FALLOCATE
-  posix_fallocate (fd, 0, size);
-#endif
+  size_t n;
+
+  for (n = 0; n < count; n++)
+    lookups[n].result->error = error;
 }
 
-static int
-extract_encrypted_file_entry_to_fd
-  (Nks *nks, const NksEncryptedFileHeader *header, int out_fd)
+/* Resolves the next segment of each of the lookups in dir, and then the
+ * lookups which continue below them. */
+static void
+resolve_lookups (Nks *nks, const NksEntry *dir, BatchLookup *lookups,
+		 size_t count)
 {
-  char buffer[16384];
-  const uint8_t *key;
-  size_t count;
-  size_t size;
-  size_t to_read;
-  size_t key_length;
-  off_t key_pos;
-  size_t x;
+  BatchGroup *group;
+  BatchScan scan;
+  GArray *groups;
+  size_t len;
+  size_t i, n, m;
   int r;
 
-  if (header->key_index < 0xff)
-    {
-      if (nks_get_0100_key (header->key_index, &key, &key_length) != 0)
-	return -ENOKEY;
-
-      assert (key_length == 0x10);
+  groups = g_array_new (false, false, sizeof (BatchGroup));
 
-      key_pos = lseek (nks->fd, 0, SEEK_CUR);
-      if (key_pos < 0)
-	return -EIO;
-    }
-  else if (header->key_index == 0x100)
+  for (n = 0; n < count; n = m)
     {
-      const NksLibraryDesc *lib;
-      NksSetKey *set_key;
+      BatchGroup g;
 
-      set_key = g_tree_lookup (nks->set_keys, &header->set_id);
-      if (set_key == NULL)
+      len = segment_length (lookups[n].rest);
+      for (m = n + 1; m < count; m++)
 	{
-	  lib = nks_get_library_desc (header->set_id);
-	  if (lib == NULL)
-	    return -ENOKEY;
-
-	  set_key = g_malloc (sizeof (*set_key));
-	  set_key->set_id = header->set_id;
-	  r = nks_create_0110_key (&lib->gen_key, set_key->data,
-				   sizeof (set_key->data));
-	  if (r != 0)
-	    {
-	      g_free (set_key);
-	      return r;
-	    }
-
-	  g_tree_insert (nks->set_keys, &set_key->set_id, set_key);
+	  if (segment_length (lookups[m].rest) != len
+	      || memcmp (lookups[m].rest, lookups[n].rest, len) != 0)
+	    break;
 	}
 
-      key = set_key->data;
-      key_length = 0x10000;
+      memset (&g, 0, sizeof (g));
+      g.name  = g_strndup (lookups[n].rest, len);
+      g.first = n;
+      g.count = m - n;
+      g_array_append_val (groups, g);
+    }
 
-      key_pos = 0;
+  scan.groups  = g_hash_table_new (&g_str_hash, &g_str_equal);
+  scan.missing = groups->len;
+  scan.error   = -ENOENT;
+  for (n = 0; n < groups->len; n++)
+    {
+      group = &g_array_index (groups, BatchGroup, n);
+      g_hash_table_insert (scan.groups, group->name, group);
     }
-  else
-    return -ENOKEY;
 
-  size = header->size;
+  /* Whatever was found before an error still stands. */
+  r = nks_iterate_dir_entry (nks, dir, (NksViewFunc) &match_view, &scan);
+  if (r != 0)
+    scan.error = r;
 
-  allocate_file_space (out_fd, size);
+  g_hash_table_destroy (scan.groups);
 
-  while (size > 0)
+  for (i = 0; i < groups->len; i++)
     {
-      to_read = MIN (sizeof (buffer), size);
-      count = read (nks->fd, buffer, to_read);
-      if (count != to_read)
-	return -EIO;
+      group = &g_array_index (groups, BatchGroup, i);
+      len = strlen (group->name);
 
-      for (x = 0; x < to_read; x++)
+      if (!group->found)
+	fail_lookups (lookups + group->first, group->count, scan.error);
+      else
 	{
-	  key_pos %= key_length;
-	  buffer[x] ^= key[key_pos];
-	  key_pos++;
-	}
+	  /* Paths ending here sort before those which continue. */
+	  for (m = group->first; m < group->first + group->count; m++)
+	    {
+	      if (lookups[m].rest[len] != 0)
+		break;
 
-      count = write (out_fd, buffer, to_read);
-      if (count != to_read)
-	return -EIO;
+	      lookups[m].rest = NULL;
+	      lookups[m].result->error = 0;
+	      nks_entry_copy (&group->entry, &lookups[m].result->entry);
+	    }
 
-      size -= to_read;
+	  for (n = m; m < group->first + group->count; m++)
+	    lookups[m].rest += len + 1;
+
+	  if (n < m)
+	    resolve_lookups (nks, &group->entry, lookups + n, m - n);
+
+	  nks_entry_free (&group->entry);
+	}
+
+      g_free (group->name);
     }
 
-  return 0;
+  g_array_free (groups, true);
 }
 
-static int
-extract_file_entry_to_fd (Nks *nks, const NksFileHeader *header, int out_fd)
+int
+nks_find_entries (Nks *nks, const char * const *paths, size_t count,
+		  NksFindResult *results)
 {
-  char buffer[16384];
-  size_t to_read;
-  size_t size;
-  size_t count;
+  BatchLookup *lookups;
+  GString *path;
+  size_t n, m;
 
-  size = header->size;
-  allocate_file_space (out_fd, size);
+  if (nks->index != NULL)
+    {
+      for (n = 0; n < count; n++)
+	{
+	  if (paths[n] == NULL || paths[n][0] == '/')
+	    results[n].error = -EINVAL;
+	  else
+	    results[n].error = nks_index_find_entry (nks->index, paths[n],
+						     &results[n].entry);
+	}
 
-  while (size > 0)
+      return 0;
+    }
+
+  lookups = g_new (BatchLookup, count);
+  path = g_string_new (NULL);
+
+  /* The root and invalid paths need no directory scan. */
+  for (n = 0, m = 0; n < count; n++)
     {
-      to_read = MIN (sizeof (buffer), size);
-      count = read (nks->fd, buffer, to_read);
-      if (count != to_read)
-	return -EIO;
+      g_string_truncate (path, 0);
 
-      count = write (out_fd, buffer, to_read);
-      if (count != to_read)
-	return -EIO;
+      results[n].error = normalise_path (paths[n], path);
+      if (results[n].error != 0)
+	continue;
 
-      size -= to_read;
+      if (path->len == 0)
+	{
+	  nks_entry_copy (&nks->root_entry, &results[n].entry);
+	  continue;
+	}
+
+      lookups[m].folded = g_strdup (path->str);
+      lookups[m].rest	= lookups[m].folded;
+      lookups[m].result = &results[n];
+      m++;
     }
 
+  g_string_free (path, true);
+
+  qsort (lookups, m, sizeof (*lookups), &compare_lookups);
+
+  if (m > 0)
+    resolve_lookups (nks, &nks->root_entry, lookups, m);
+
+  for (n = 0; n < m; n++)
+    g_free (lookups[n].folded);
+  g_free (lookups);
+
   return 0;
 }
 
 int
-nks_extract_file_entry_to_fd (Nks *nks, const NksEntry *entry, int out_fd)
+nks_list_dir (Nks *nks, const char *dir, NksTraverseFunc func, void *user_data)
 {
-  NksEncryptedFileHeader enc_header;
-  NksFileHeader file_header;
-  uint32_t magic;
+  NksEntry ent;
   int r;
 
-  if (lseek (nks->fd, entry->offset, SEEK_SET) < 0)
-    return -EIO;
+  r = nks_find_entry (nks, dir, &ent);
+  if (r != 0)
+    return r;
 
-  if (!read_u32_le (nks->fd, &magic))
-    return -EIO;
+  if (ent.type != NKS_ENT_DIRECTORY)
+    return -ENOTDIR;
 
-  switch (magic)
-    {
-    case NKS_MAGIC_ENCRYPTED_FILE:
-    case NKS_MAGIC_FILE:
-      break;
+  r = nks_list_dir_entry (nks, &ent, func, user_data);
+  nks_entry_free (&ent);
 
-    case NKS_MAGIC_DIRECTORY:
-      return -EISDIR;
+  return r;
+}
 
-    default:
-      return -ENOTSUP;
-    }
+struct NksEntryView
+{
+  NksRawEntry raw;
+  const char *name;	    /* Decoded name, or NULL */
+  bool	      decoded;	    /* Whether name has been decoded yet */
+  GByteArray *name_buffer;  /* Where 0x0110 names are decoded to */
+};
 
-  if (lseek (nks->fd, entry->offset, SEEK_SET) < 0)
-    return -EIO;
+NksEntryType
+nks_entry_view_type (const NksEntryView *view)
+{
+  return view->raw.type;
+}
 
-  if (magic == NKS_MAGIC_ENCRYPTED_FILE)
-    {
-      r = nks_read_encrypted_file_header (nks->fd, &enc_header);
-      if (r != 0)
+off_t
+nks_entry_view_offset (const NksEntryView *view)
+{
+  return view->raw.offset;
+}
+
+const char *
+nks_entry_view_name (NksEntryView *view)
+{
+  size_t count;
+  char *name;
+
+  if (view->decoded)
+    return view->name;
+
+  view->decoded = true;
+
+  count = view->raw.units->len / 2;
+  g_byte_array_set_size (view->name_buffer, NKS_UTF16_UTF8_SIZE (count));
+  name = (char *) view->name_buffer->data;
+
+  if (nks_utf16_le_to_utf8 (view->raw.units->data, count, name) >= 0)
+    view->name = name;
+
+  return view->name;
+}
+
+int
+nks_entry_view_copy (NksEntryView *view, NksEntry *ret)
+{
+  const char *name;
+
+  name = nks_entry_view_name (view);
+  if (name == NULL)
+    return -EILSEQ;
+
+  ret->name   = g_strdup (name);
+  ret->type   = view->raw.type;
+  ret->offset = view->raw.offset;
+
+  return 0;
+}
+
+/* Calls func for each entry of the directory whose header was just read.
+ * The buffers of the view are shared by all entries. */
+static int
+iterate_directory (Nks *nks, NksReader *reader, NksDirectoryHeader *header,
+		   NksViewFunc func, void *user_data)
+{
+  NksStats *stats = reader->stats;
+  NksEntryView view;
+  uint64_t start = 0;
+  off_t offset;
+  uint32_t n;
+  int r = 0;
+
+  NKS_STATS_ADD (stats, directories_parsed, 1);
+
+  view.raw.units   = g_byte_array_new ();
+  view.name_buffer = g_byte_array_new ();
+
+  offset = nks_reader_tell (reader);
+
+  for (n = 0; n < header->entry_count; n++)
+    {
+      /* Only the reading is timed, not func.  Looking at the clock for
+       * every entry is not free, so only do it when counting. */
+      if (stats != NULL)
+	start = nks_stats_clock (stats);
+
+      /* func may have moved the reader. */
+      if (!nks_reader_seek (reader, offset))
+	{
+	  r = -EIO;
+	  break;
+	}
+
+      g_byte_array_set_size (view.raw.units, 0);
+
+      r = nks_reader_read_raw_entry (reader, header, &view.raw);
+      if (r != 0)
+	break;
+
+      /* 0x0100 names need no decoding. */
+      view.decoded = (header->version == 0x0100);
+      view.name	   = (view.decoded ? view.raw.name : NULL);
+
+      NKS_STATS_ADD (stats, entries_decoded, 1);
+      NKS_STATS_ADD_TIME (stats, parse_ns, start);
+
+      offset = nks_reader_tell (reader);
+
+      if (!func (nks, &view, user_data))
+	break;
+    }
+
+  g_byte_array_free (view.raw.units, true);
+  g_byte_array_free (view.name_buffer, true);
+
+  return r;
+}
+
+typedef struct
+{
+  NksTraverseFunc func;
+  NksViewFunc	  view_func;
+  void		 *user_data;
+  int		  r;
+} ViewAdapter;
+
+/* Passes a view on as an entry with a borrowed name. */
+static bool
+traverse_view (Nks *nks, NksEntryView *view, ViewAdapter *adapter)
+{
+  NksEntry ent;
+
+  ent.name = (char *) nks_entry_view_name (view);
+  if (ent.name == NULL)
+    {
+      adapter->r = -EIO;
+      return false;
+    }
+
+  ent.type   = view->raw.type;
+  ent.offset = view->raw.offset;
+
+  return adapter->func (nks, &ent, adapter->user_data);
+}
+
+/* Passes an entry of the index on as an already decoded view. */
+static bool
+view_entry (Nks *nks, const NksEntry *ent, ViewAdapter *adapter)
+{
+  NksEntryView view;
+
+  view.raw.type	   = ent->type;
+  view.raw.offset  = ent->offset;
+  view.raw.units   = NULL;
+  view.name	   = ent->name;
+  view.decoded	   = true;
+  view.name_buffer = NULL;
+
+  return adapter->view_func (nks, &view, adapter->user_data);
+}
+
+static int
+list_directory (Nks *nks, NksReader *reader, NksDirectoryHeader *header,
+		NksTraverseFunc func, void *user_data)
+{
+  ViewAdapter adapter;
+  int r;
+
+  adapter.func	    = func;
+  adapter.user_data = user_data;
+  adapter.r	    = 0;
+
+  r = iterate_directory (nks, reader, header, (NksViewFunc) &traverse_view,
+			 &adapter);
+
+  return (r != 0 ? r : adapter.r);
+}
+
+int
+nks_iterate_dir_entry (Nks *nks, const NksEntry *entry, NksViewFunc func,
+		       void *user_data)
+{
+  NksDirectoryHeader header;
+  ViewAdapter adapter;
+  NksReader cursor;
+  NksReader *reader;
+  uint64_t start;
+  int r;
+
+  if (entry->type != NKS_ENT_DIRECTORY)
+    return -ENOTDIR;
+
+  if (nks->index != NULL)
+    {
+      adapter.view_func = func;
+      adapter.user_data = user_data;
+
+      return nks_index_list_dir (nks->index, nks, entry,
+				 (NksTraverseFunc) &view_entry, &adapter);
+    }
+
+  reader = open_cursor (nks, &cursor);
+  start = nks_stats_clock (nks->stats);
+
+  if (!nks_reader_seek (reader, entry->offset))
+    {
+      r = -EIO;
+      goto out;
+    }
+
+  r = nks_reader_read_directory_header (reader, &header);
+  if (r != 0)
+    goto out;
+
+  NKS_STATS_ADD_TIME (nks->stats, parse_ns, start);
+
+  r = iterate_directory (nks, reader, &header, func, user_data);
+
+out:
+  close_cursor (nks, reader);
+  return r;
+}
+
+int
+nks_list_dir_entry (Nks *nks, const NksEntry *entry, NksTraverseFunc func,
+		    void *user_data)
+{
+  ViewAdapter adapter;
+  int r;
+
+  if (entry->type != NKS_ENT_DIRECTORY)
+    return -ENOTDIR;
+
+  if (nks->index != NULL)
+    return nks_index_list_dir (nks->index, nks, entry, func, user_data);
+
+  adapter.func	    = func;
+  adapter.user_data = user_data;
+  adapter.r	    = 0;
+
+  r = nks_iterate_dir_entry (nks, entry, (NksViewFunc) &traverse_view,
+			     &adapter);
+
+  return (r != 0 ? r : adapter.r);
+}
+
+static void
+allocate_file_space (int fd, off_t size)
+{
+#ifdef HAVE_POSIX_FALLOCATE
+  posix_fallocate (fd, 0, size);
+#endif
+}
+
+static int
+get_set_key (Nks *nks, uint32_t set_id, const uint8_t **ret)
+{
+  NksSetKey *set_key;
+  bool cached, generated;
+  uint64_t start;
+  int r = 0;
+
+  g_mutex_lock (&nks->set_keys_lock);
+
+  set_key = g_tree_lookup (nks->set_keys, GUINT_TO_POINTER (set_id));
+  if (set_key == NULL)
+    {
+      start = nks_stats_clock (nks->stats);
+
+      r = nks_key_cache_acquire (set_id, &set_key, &cached, &generated);
+
+      /* Only lookups in the shared cache count, not those in set_keys. */
+      if (cached)
+	NKS_STATS_ADD (nks->stats, key_cache_hits, 1);
+      else
+	NKS_STATS_ADD (nks->stats, key_cache_misses, 1);
+
+      if (r != 0)
+	goto out;
+
+      g_tree_insert (nks->set_keys, GUINT_TO_POINTER (set_id), set_key);
+
+      if (generated)
+	{
+	  NKS_STATS_ADD (nks->stats, keystreams_generated, 1);
+	  NKS_STATS_ADD_TIME (nks->stats, decrypt_ns, start);
+	}
+    }
+
+  /* Keys are only released when the archive is closed. */
+  *ret = nks_set_key_data (set_key);
+
+out:
+  g_mutex_unlock (&nks->set_keys_lock);
+  return r;
+}
+
+/* Finds the key of an encrypted entry whose data starts at data_offset, and
+ * the position in the key of the first byte of data. */
+static int
+get_file_key (Nks *nks, const NksEncryptedFileHeader *header,
+	      off_t data_offset, const uint8_t **key, size_t *key_length,
+	      size_t *key_pos)
+{
+  int r;
+
+  if (header->key_index < 0xff)
+    {
+      if (nks_get_0100_key (header->key_index, key, key_length) != 0)
+	return -ENOKEY;
+
+      assert (*key_length == 0x10);
+
+      /* 0x0100 keys are aligned with the archive, not the entry. */
+      *key_pos = data_offset % *key_length;
+    }
+  else if (header->key_index == 0x100)
+    {
+      r = get_set_key (nks, header->set_id, key);
+      if (r != 0)
+	return r;
+
+      *key_length = 0x10000;
+      *key_pos	  = 0;
+    }
+  else
+    return -ENOKEY;
+
+  return 0;
+}
+
+/* Like nks_xor_key, but counted as decryption. */
+static size_t
+decrypt (NksStats *stats, uint8_t *dst, const uint8_t *src, size_t size,
+	 const uint8_t *key, size_t key_length, size_t key_pos)
+{
+  uint64_t start = nks_stats_clock (stats);
+
+  key_pos = nks_xor_key (dst, src, size, key, key_length, key_pos);
+
+  NKS_STATS_ADD (stats, bytes_decrypted, size);
+  NKS_STATS_ADD_TIME (stats, decrypt_ns, start);
+
+  return key_pos;
+}
+
+/* Writes size bytes of extracted data to out_fd. */
+static bool
+write_data (NksStats *stats, int out_fd, const void *data, size_t size)
+{
+  uint64_t start = nks_stats_clock (stats);
+  ssize_t count;
+
+  count = write (out_fd, data, size);
+
+  NKS_STATS_ADD (stats, write_calls, 1);
+  if (count > 0)
+    NKS_STATS_ADD (stats, bytes_written, count);
+  NKS_STATS_ADD_TIME (stats, write_ns, start);
+
+  return (count >= 0 && (size_t) count == size);
+}
+
+/* Counts size bytes copied from the archive to out_fd without going through
+ * user space, in the time since start. */
+static void
+count_copy (NksStats *stats, size_t size, uint64_t start)
+{
+  NKS_STATS_ADD (stats, bytes_read, size);
+  NKS_STATS_ADD (stats, bytes_written, size);
+  NKS_STATS_ADD_TIME (stats, write_ns, start);
+}
+
+static int
+extract_encrypted_file_entry_to_fd
+  (Nks *nks, NksReader *reader, const NksEncryptedFileHeader *header,
+   int out_fd)
+{
+  NksStats *stats = reader->stats;
+  uint8_t buffer[16384];
+  const uint8_t *data;
+  const uint8_t *key;
+  uint64_t start;
+  size_t size;
+  size_t to_read;
+  size_t key_length;
+  size_t key_pos;
+  int r;
+
+  r = get_file_key (nks, header, nks_reader_tell (reader), &key, &key_length,
+		    &key_pos);
+  if (r != 0)
+    return r;
+
+  size = header->size;
+
+  allocate_file_space (out_fd, size);
+
+  if (size >= NKS_URING_MIN_SIZE && !nks_reader_is_stream (reader))
+    {
+      start = nks_stats_clock (stats);
+
+      r = nks_uring_copy (reader->fd, nks_reader_tell (reader), out_fd, size,
+			  key, key_length, key_pos);
+      if (r == 0)
+	{
+	  NKS_STATS_ADD (stats, bytes_decrypted, size);
+	  count_copy (stats, size, start);
+	}
+
+      if (r != -ENOSYS)
+	return r;
+    }
+
+  while (size > 0)
+    {
+      to_read = MIN (sizeof (buffer), size);
+
+      data = nks_reader_borrow (reader, to_read);
+      if (data == NULL)
+	{
+	  if (!nks_reader_read (reader, buffer, to_read))
+	    return -EIO;
+
+	  data = buffer;
+	}
+
+      key_pos = decrypt (stats, buffer, data, to_read, key, key_length,
+			 key_pos);
+
+      if (!write_data (stats, out_fd, buffer, to_read))
+	return -EIO;
+
+      size -= to_read;
+    }
+
+  return 0;
+}
+
+/* Copies size bytes at offset of in_fd to the current position of out_fd
+ * without passing them through user space, for as long as the kernel agrees
+ * to.  Returns the number of bytes copied, which may be anything from zero
+ * to size.  Neither file position of in_fd is used nor changed. */
+static size_t
+copy_in_kernel (int in_fd, off_t offset, int out_fd, size_t size)
+{
+  size_t done = 0;
+  ssize_t count;
+
+#ifdef HAVE_COPY_FILE_RANGE
+  /* Lets file systems share extents or copy on the server side. */
+  while (done < size)
+    {
+      count = copy_file_range (in_fd, &offset, out_fd, NULL, size - done, 0);
+      if (count <= 0)
+	break;
+
+      done += count;
+    }
+#endif
+
+#if defined HAVE_SENDFILE && defined HAVE_SYS_SENDFILE_H
+  /* Covers pipes, sockets and older kernels. */
+  while (done < size)
+    {
+      count = sendfile (out_fd, in_fd, &offset, size - done);
+      if (count <= 0)
+	break;
+
+      done += count;
+    }
+#endif
+
+#ifdef HAVE_SPLICE
+  /* Covers pipes where sendfile() is refused. */
+  while (done < size)
+    {
+      count = splice (in_fd, &offset, out_fd, NULL, size - done, 0);
+      if (count <= 0)
+	break;
+
+      done += count;
+    }
+#endif
+
+  return done;
+}
+
+static int
+extract_file_entry_to_fd (NksReader *reader, const NksFileHeader *header,
+			  int out_fd)
+{
+  NksStats *stats = reader->stats;
+  char buffer[16384];
+  const void *data;
+  uint64_t start;
+  size_t to_read;
+  size_t size;
+  size_t count;
+  off_t offset;
+
+  size = header->size;
+  allocate_file_space (out_fd, size);
+
+  offset = nks_reader_tell (reader);
+  count = 0;
+
+  if (!nks_reader_is_stream (reader))
+    {
+      start = nks_stats_clock (stats);
+      count = copy_in_kernel (reader->fd, offset, out_fd, size);
+      count_copy (stats, count, start);
+    }
+
+  /* Whatever the kernel refused to copy goes through the buffer. */
+  if (count > 0 && !nks_reader_seek (reader, offset + count))
+    return -EIO;
+
+  size -= count;
+
+  if (size >= NKS_URING_MIN_SIZE && !nks_reader_is_stream (reader))
+    {
+      start = nks_stats_clock (stats);
+
+      if (nks_uring_copy (reader->fd, offset + count, out_fd, size,
+			  NULL, 0, 0) == 0)
+	{
+	  count_copy (stats, size, start);
+	  return 0;
+	}
+    }
+
+  while (size > 0)
+    {
+      to_read = MIN (sizeof (buffer), size);
+
+      /* Write straight out of the window (or mapping) when possible. */
+      data = nks_reader_borrow (reader, to_read);
+      if (data == NULL)
+	{
+	  if (!nks_reader_read (reader, buffer, to_read))
+	    return -EIO;
+
+	  data = buffer;
+	}
+
+      if (!write_data (stats, out_fd, data, to_read))
+	return -EIO;
+
+      size -= to_read;
+    }
+
+  return 0;
+}
+
+static int
+extract_file_entry (Nks *nks, NksReader *reader, const NksEntry *entry,
+		    int out_fd)
+{
+  NksEncryptedFileHeader enc_header;
+  NksFileHeader file_header;
+  uint32_t magic;
+  int r;
+
+  if (!nks_reader_seek (reader, entry->offset))
+    return -EIO;
+
+  if (!nks_reader_read_u32_le (reader, &magic))
+    return -EIO;
+
+  switch (magic)
+    {
+    case NKS_MAGIC_ENCRYPTED_FILE:
+    case NKS_MAGIC_FILE:
+      break;
+
+    case NKS_MAGIC_DIRECTORY:
+      return -EISDIR;
+
+    default:
+      return -ENOTSUP;
+    }
+
+  if (!nks_reader_seek (reader, entry->offset))
+    return -EIO;
+
+  if (magic == NKS_MAGIC_ENCRYPTED_FILE)
+    {
+      r = nks_reader_read_encrypted_file_header (reader, &enc_header);
+      if (r != 0)
+	return r;
+
+      switch (enc_header.version)
+	{
+	case 0x0100:
+	case 0x0110:
+	  return extract_encrypted_file_entry_to_fd (nks, reader, &enc_header,
+						     out_fd);
+
+	default:
+	  return -ENOTSUP;
+	}
+    }
+  else
+    {
+      r = nks_reader_read_file_header (reader, &file_header);
+      if (r != 0)
+	return r;
+
+      switch (file_header.version)
+	{
+	case 0x0100:
+	case 0x0110:
+	  return extract_file_entry_to_fd (reader, &file_header, out_fd);
+
+	default:
+	  return -ENOTSUP;
+	}
+    }
+}
+
+int
+nks_extract_file_entry_to_fd (Nks *nks, const NksEntry *entry, int out_fd)
+{
+  NksReader cursor;
+  NksReader *reader;
+  int r;
+
+  reader = open_cursor (nks, &cursor);
+  r = extract_file_entry (nks, reader, entry, out_fd);
+  close_cursor (nks, reader);
+
+  return r;
+}
+
+typedef struct
+{
+  off_t		 offset;	/* Offset of the data in the archive */
+  off_t		 size;
+  const uint8_t *key;		/* NULL if the entry is not encrypted */
+  size_t	 key_length;
+  size_t	 key_pos;	/* Key position of the first byte of data */
+} FileData;
+
+/* Reads the header of a file entry.  The key is only looked up if nks is
+ * not NULL. */
+static int
+locate_file_data (Nks *nks, NksReader *reader, const NksEntry *entry,
+		  FileData *ret)
+{
+  NksEncryptedFileHeader enc_header;
+  NksFileHeader file_header;
+  uint32_t magic;
+  int r;
+
+  if (!nks_reader_seek (reader, entry->offset))
+    return -EIO;
+
+  if (!nks_reader_read_u32_le (reader, &magic))
+    return -EIO;
+
+  if (!nks_reader_seek (reader, entry->offset))
+    return -EIO;
+
+  memset (ret, 0, sizeof (*ret));
+
+  switch (magic)
+    {
+    case NKS_MAGIC_ENCRYPTED_FILE:
+      r = nks_reader_read_encrypted_file_header (reader, &enc_header);
+      if (r != 0)
+	return r;
+
+      if (enc_header.version != 0x0100 && enc_header.version != 0x0110)
+	return -ENOTSUP;
+
+      ret->offset = nks_reader_tell (reader);
+      ret->size	  = enc_header.size;
+
+      if (nks != NULL)
+	return get_file_key (nks, &enc_header, ret->offset, &ret->key,
+			     &ret->key_length, &ret->key_pos);
+
+      return 0;
+
+    case NKS_MAGIC_FILE:
+      r = nks_reader_read_file_header (reader, &file_header);
+      if (r != 0)
+	return r;
+
+      if (file_header.version != 0x0100 && file_header.version != 0x0110)
+	return -ENOTSUP;
+
+      ret->offset = nks_reader_tell (reader);
+      ret->size	  = file_header.size;
+      return 0;
+
+    case NKS_MAGIC_DIRECTORY:
+      return -EISDIR;
+
+    default:
+      return -ENOTSUP;
+    }
+}
+
+static off_t
+file_size (NksReader *reader, const NksEntry *entry)
+{
+  FileData data;
+  int r;
+
+  r = locate_file_data (NULL, reader, entry, &data);
+  if (r != 0)
+    return r;
+
+  return data.size;
+}
+
+off_t
+nks_file_size (Nks *nks, const NksEntry *entry)
+{
+  NksReader cursor;
+  NksReader *reader;
+  off_t r;
+
+  reader = open_cursor (nks, &cursor);
+  r = file_size (reader, entry);
+  close_cursor (nks, reader);
+
+  return r;
+}
+
+static int
+read_file_data (NksReader *reader, const FileData *data, void *buffer)
+{
+  if (!nks_reader_seek (reader, data->offset)
+      || !nks_reader_read (reader, buffer, data->size))
+    return -EIO;
+
+  if (data->key != NULL)
+    decrypt (reader->stats, buffer, buffer, data->size, data->key,
+	     data->key_length, data->key_pos);
+
+  return 0;
+}
+
+ssize_t
+nks_read_entry_into (Nks *nks, const NksEntry *entry, void *buffer,
+		     size_t size)
+{
+  NksReader cursor;
+  NksReader *reader;
+  FileData data;
+  int r;
+
+  assert (nks != NULL);
+  assert (entry != NULL);
+
+  reader = open_cursor (nks, &cursor);
+
+  r = locate_file_data (nks, reader, entry, &data);
+  if (r == 0 && (size_t) data.size > size)
+    r = -ENOBUFS;
+
+  if (r == 0)
+    r = read_file_data (reader, &data, buffer);
+
+  close_cursor (nks, reader);
+
+  return (r == 0 ? data.size : r);
+}
+
+int
+nks_read_entry (Nks *nks, const NksEntry *entry, void **ret, size_t *size)
+{
+  NksReader cursor;
+  NksReader *reader;
+  FileData data;
+  void *buffer;
+  int r;
+
+  assert (nks != NULL);
+  assert (entry != NULL);
+  assert (ret != NULL);
+
+  reader = open_cursor (nks, &cursor);
+
+  r = locate_file_data (nks, reader, entry, &data);
+  if (r != 0)
+    goto out;
+
+  buffer = nks_buffer_pool_alloc (nks->buffers, data.size);
+
+  r = read_file_data (reader, &data, buffer);
+  if (r != 0)
+    {
+      nks_buffer_pool_release (nks->buffers, buffer);
+      goto out;
+    }
+
+  *ret = buffer;
+  if (size != NULL)
+    *size = data.size;
+
+out:
+  close_cursor (nks, reader);
+  return r;
+}
+
+void
+nks_release_entry_data (Nks *nks, void *data)
+{
+  assert (nks != NULL);
+
+  nks_buffer_pool_release (nks->buffers, data);
+}
+
+int
+nks_get_stats (Nks *nks, NksStats *stats)
+{
+  assert (nks != NULL);
+  assert (stats != NULL);
+
+  if (nks->stats == NULL)
+    return -ENOTSUP;
+
+  nks_stats_copy (nks->stats, stats);
+
+  return 0;
+}
+
+struct NksFile
+{
+  Nks	    *nks;
+  NksReader *reader;	/* Either cursor or the reader of nks */
+  NksReader  cursor;
+  FileData   data;
+  off_t	     pos;
+};
+
+int
+nks_file_open (Nks *nks, const NksEntry *entry, NksFile **ret)
+{
+  NksFile *file;
+  int r;
+
+  assert (nks != NULL);
+  assert (entry != NULL);
+  assert (ret != NULL);
+
+  file = g_malloc0 (sizeof (*file));
+  file->nks    = nks;
+  file->reader = open_cursor (nks, &file->cursor);
+
+  r = locate_file_data (nks, file->reader, entry, &file->data);
+  if (r != 0)
+    {
+      nks_file_close (file);
+      return r;
+    }
+
+  *ret = file;
+
+  return 0;
+}
+
+void
+nks_file_close (NksFile *file)
+{
+  if (file == NULL)
+    return;
+
+  close_cursor (file->nks, file->reader);
+  g_free (file);
+}
+
+ssize_t
+nks_file_pread (NksFile *file, void *buffer, size_t size, off_t offset)
+{
+  assert (file != NULL);
+
+  if (offset < 0)
+    return -EINVAL;
+
+  if (offset >= file->data.size)
+    return 0;
+
+  size = MIN (size, (uintmax_t) (file->data.size - offset));
+  size = MIN (size, SSIZE_MAX);
+
+  if (!nks_reader_seek (file->reader, file->data.offset + offset)
+      || !nks_reader_read (file->reader, buffer, size))
+    return -EIO;
+
+  /* Both key kinds repeat, so the key position of any byte follows from its
+   * offset alone. */
+  if (file->data.key != NULL)
+    decrypt (file->reader->stats, buffer, buffer, size, file->data.key,
+	     file->data.key_length, file->data.key_pos + offset);
+
+  return size;
+}
+
+ssize_t
+nks_file_read (NksFile *file, void *buffer, size_t size)
+{
+  ssize_t count;
+
+  count = nks_file_pread (file, buffer, size, file->pos);
+  if (count > 0)
+    file->pos += count;
+
+  return count;
+}
+
+off_t
+nks_file_seek (NksFile *file, off_t offset, int whence)
+{
+  off_t base;
+
+  assert (file != NULL);
+
+  switch (whence)
+    {
+    case SEEK_SET: base = 0;		   break;
+    case SEEK_CUR: base = file->pos;	   break;
+    case SEEK_END: base = file->data.size; break;
+    default:	   return -EINVAL;
+    }
+
+  /* base is never negative, so only one of these can overflow. */
+  if (offset < -base || (offset > 0 && offset > OFF_T_MAX - base))
+    return -EINVAL;
+
+  file->pos = base + offset;
+
+  return file->pos;
+}
+
+int
+nks_extract_file_entry (Nks *nks, const NksEntry *entry, const char *out_file)
+{
+  int fd;
+  int r;
+
+  fd = open (out_file, O_WRONLY | O_CREAT | O_BINARY, 0666);
+  if (fd < 0)
+    return -errno;
+
+  r = nks_extract_file_entry_to_fd (nks, entry, fd);
+  close (fd);
+
+  if (r != 0)
+    unlink (out_file);
+
+  return r;
+}
+
+/* Deeper trees than this can only come from a directory containing itself. */
+#define MAX_TREE_DEPTH 256
+
+typedef struct
+{
+  char	  *dir;		/* Path of the parent directory */
+  guint	   depth;	/* Number of directories above, for streams */
+  NksEntry entry;
+} PathEntry;
+
+typedef struct
+{
+  Nks		*nks;
+  GTree		*pending;	/* offset -> GSList of PathEntry */
+  GHashTable	*tables;	/* offset -> GPtrArray of the entries of a
+				   directory table read from the stream */
+  NksSpill	*spill;
+  bool		 seekable;	/* Whether the input is a file after all */
+  NksStreamFunc	 func;
+  void		*user_data;
+} StreamWalk;
+
+static char *
+child_path (const char *dir, const char *name)
+{
+  if (dir[0] == '\0')
+    return g_strdup (name);
+
+  return g_strconcat (dir, "/", name, NULL);
+}
+
+static void
+path_entry_free (PathEntry *pe)
+{
+  g_free (pe->dir);
+  nks_entry_free (&pe->entry);
+  g_free (pe);
+}
+
+static void
+add_pending (StreamWalk *walk, const char *dir, guint depth,
+	     const NksEntry *entry)
+{
+  gpointer key = GUINT_TO_POINTER ((guint) entry->offset);
+  PathEntry *pe;
+  GSList *list;
+
+  pe = g_malloc0 (sizeof (*pe));
+  pe->dir   = g_strdup (dir);
+  pe->depth = depth;
+  nks_entry_copy (entry, &pe->entry);
+
+  /* Several directory entries may share the same data. */
+  list = g_tree_lookup (walk->pending, key);
+  g_tree_insert (walk->pending, key, g_slist_append (list, pe));
+}
+
+static gboolean
+get_first_pending (gpointer key, gpointer value, gpointer data)
+{
+  *(gpointer *) data = key;
+  return true;
+}
+
+static bool
+collect_entry (Nks *nks, const NksEntry *entry, GPtrArray *entries)
+{
+  NksEntry *copy;
+
+  copy = g_malloc (sizeof (*copy));
+  nks_entry_copy (entry, copy);
+  g_ptr_array_add (entries, copy);
+
+  return true;
+}
+
+static void
+free_entry (NksEntry *entry)
+{
+  nks_entry_free (entry);
+  g_free (entry);
+}
+
+/* Reads the table of a directory at offset and queues its entries under
+ * each of the directories in group sharing it.  Tables are read straight from
+ * the stream, not through the spill, so they are kept for entries which
+ * refer back to them later. */
+static int
+read_stream_directory (StreamWalk *walk, GSList *group, off_t offset)
+{
+  gpointer key = GUINT_TO_POINTER ((guint) offset);
+  NksDirectoryHeader header;
+  PathEntry *pe;
+  GPtrArray *entries;
+  GSList *lp;
+  uint64_t start;
+  char *dir;
+  guint n;
+  int r;
+
+  entries = g_hash_table_lookup (walk->tables, key);
+  if (entries == NULL)
+    {
+      if (!nks_reader_seek (&walk->nks->reader, offset))
+	return -EIO;
+
+      start = nks_stats_clock (walk->nks->stats);
+
+      r = nks_reader_read_directory_header (&walk->nks->reader, &header);
+      if (r != 0)
+	return r;
+
+      NKS_STATS_ADD_TIME (walk->nks->stats, parse_ns, start);
+
+      entries = g_ptr_array_new_with_free_func ((GDestroyNotify) &free_entry);
+
+      r = list_directory (walk->nks, &walk->nks->reader, &header,
+			  (NksTraverseFunc) &collect_entry, entries);
+      if (r != 0)
+	{
+	  g_ptr_array_free (entries, true);
+	  return r;
+	}
+
+      g_hash_table_insert (walk->tables, key, entries);
+    }
+
+  for (lp = group; lp != NULL; lp = lp->next)
+    {
+      pe = lp->data;
+
+      if (pe->entry.type != NKS_ENT_DIRECTORY)
+	continue;
+
+      /* Tables are kept, so a directory containing itself would be walked
+       * forever. */
+      if (pe->depth >= MAX_TREE_DEPTH)
+	return -ELOOP;
+
+      dir = (pe->dir != NULL ? child_path (pe->dir, pe->entry.name)
+			     : g_strdup (""));
+
+      for (n = 0; n < entries->len; n++)
+	add_pending (walk, dir, pe->depth + 1,
+		     g_ptr_array_index (entries, n));
+
+      g_free (dir);
+    }
+
+  return 0;
+}
+
+/* Consumes the archive up to offset, dropping what is read. */
+static int
+skip_until (NksReader *reader, off_t offset)
+{
+  uint8_t buffer[16384];
+  size_t to_read;
+  off_t pos;
+
+  while ((pos = nks_reader_tell (reader)) < offset)
+    {
+      to_read = MIN (sizeof (buffer), (uintmax_t) (offset - pos));
+
+      if (!nks_reader_read (reader, buffer, to_read))
+	return -EIO;
+    }
+
+  return 0;
+}
+
+/* Consumes the archive up to offset, keeping what is read in the spill
+ * unless the input can be read there again. */
+static int
+spill_until (StreamWalk *walk, off_t offset)
+{
+  NksReader *reader = &walk->nks->reader;
+  uint8_t buffer[16384];
+  size_t to_read;
+  off_t pos;
+  int r;
+
+  if (walk->seekable)
+    return skip_until (reader, offset);
+
+  while ((pos = nks_reader_tell (reader)) < offset)
+    {
+      to_read = MIN (sizeof (buffer), (uintmax_t) (offset - pos));
+
+      if (!nks_reader_read (reader, buffer, to_read))
+	return -EIO;
+
+      r = nks_spill_write (walk->spill, pos, buffer, to_read);
+      if (r != 0)
 	return r;
+    }
 
-      switch (enc_header.version)
+  return 0;
+}
+
+/* Reports a group of directories sharing one table and reads the table,
+ * which starts at offset of the current reader of the archive. */
+static int
+visit_directories (StreamWalk *walk, GSList *group, off_t offset, bool *stop)
+{
+  PathEntry *pe;
+  GSList *lp;
+
+  for (lp = group; lp != NULL; lp = lp->next)
+    {
+      pe = lp->data;
+
+      /* The root directory has no entry to report. */
+      if (pe->dir != NULL
+	  && !walk->func (walk->nks, pe->dir, &pe->entry, walk->user_data))
 	{
-	case 0x0100:
-	case 0x0110:
-	  return extract_encrypted_file_entry_to_fd (nks, &enc_header, out_fd);
+	  *stop = true;
+	  return 0;
+	}
+    }
 
-	default:
-	  return -ENOTSUP;
+  return read_stream_directory (walk, group, offset);
+}
+
+/* Reports a group of files sharing the data at offset of the current reader
+ * of the archive. */
+static int
+visit_files (StreamWalk *walk, GSList *group, off_t offset, bool *stop)
+{
+  PathEntry *pe;
+  GSList *lp;
+
+  for (lp = group; lp != NULL; lp = lp->next)
+    {
+      pe = lp->data;
+
+      if (!nks_reader_seek (&walk->nks->reader, offset))
+	return -EIO;
+
+      if (!walk->func (walk->nks, pe->dir, &pe->entry, walk->user_data))
+	{
+	  *stop = true;
+	  return 0;
 	}
     }
+
+  return 0;
+}
+
+/* Visits a group which lies behind the stream, reading it from the input
+ * again if it is a file, or else from the spill. */
+static int
+visit_spilled (StreamWalk *walk, GSList *group, off_t offset, bool *stop)
+{
+  PathEntry *pe = group->data;
+  NksReader saved;
+  int fd;
+  int r;
+
+  if (walk->seekable)
+    fd = walk->nks->reader.fd;
+  else
+    {
+      fd = nks_spill_get_fd (walk->spill);
+      if (fd < 0)
+	return fd;
+    }
+
+  saved = walk->nks->reader;
+  nks_reader_init (&walk->nks->reader, fd);
+  walk->nks->reader.stats = saved.stats;
+
+  if (pe->entry.type == NKS_ENT_DIRECTORY)
+    r = visit_directories (walk, group, offset, stop);
   else
+    r = visit_files (walk, group, offset, stop);
+
+  nks_reader_clear (&walk->nks->reader);
+  walk->nks->reader = saved;
+
+  return r;
+}
+
+static int
+visit_group (StreamWalk *walk, GSList *group, off_t offset, bool *stop)
+{
+  NksReader *reader = &walk->nks->reader;
+  gpointer key = GUINT_TO_POINTER ((guint) offset);
+  PathEntry *pe = group->data;
+  FileData data;
+  off_t end;
+  int r;
+
+  /* A table read before needs no reading again. */
+  if (pe->entry.type == NKS_ENT_DIRECTORY
+      && g_hash_table_contains (walk->tables, key))
+    return visit_directories (walk, group, offset, stop);
+
+  if (offset < nks_reader_tell (reader))
+    return visit_spilled (walk, group, offset, stop);
+
+  r = spill_until (walk, offset);
+  if (r != 0)
+    return r;
+
+  if (pe->entry.type == NKS_ENT_DIRECTORY)
+    return visit_directories (walk, group, offset, stop);
+
+  r = locate_file_data (NULL, reader, &pe->entry, &data);
+  if (r != 0)
+    return r;
+
+  end = data.offset + data.size;
+
+  if (!nks_reader_seek (reader, offset))
+    return -EIO;
+
+  /* Data shared by several entries has to be read more than once. */
+  if (group->next != NULL)
     {
-      r = nks_read_file_header (nks->fd, &file_header);
+      r = spill_until (walk, end);
       if (r != 0)
 	return r;
 
-      switch (file_header.version)
-	{
-	case 0x0100:
-	case 0x0110:
-	  return extract_file_entry_to_fd (nks, &file_header, out_fd);
+      return visit_spilled (walk, group, offset, stop);
+    }
 
-	default:
-	  return -ENOTSUP;
+  r = visit_files (walk, group, offset, stop);
+  if (r != 0 || *stop)
+    return r;
+
+  /* Nothing can refer to what the function did not read of the file. */
+  return skip_until (reader, end);
+}
+
+static gboolean
+free_pending (gpointer key, gpointer value, gpointer data)
+{
+  g_slist_free_full (value, (GDestroyNotify) &path_entry_free);
+  return false;
+}
+
+int
+nks_stream_walk (Nks *nks, size_t memory_limit, NksStreamFunc func,
+		 void *user_data)
+{
+  PathEntry *root;
+  StreamWalk walk;
+  GSList *group;
+  gpointer key;
+  bool stop = false;
+  int r = 0;
+
+  assert (nks != NULL);
+  assert (func != NULL);
+
+  if (!nks_reader_is_stream (&nks->reader))
+    return -EINVAL;
+
+  walk.nks	 = nks;
+  walk.pending	 = g_tree_new_full (&compare_uint_keys, NULL, NULL, NULL);
+  walk.tables	 = g_hash_table_new_full (&g_direct_hash, &g_direct_equal, NULL,
+					  (GDestroyNotify) &g_ptr_array_unref);
+  walk.spill	 = nks_spill_new (memory_limit);
+  walk.seekable	 = false;
+  walk.func	 = func;
+
+#ifdef HAVE_PREAD
+  /* Input redirected from a file can be read anywhere without moving the
+   * stream, as long as it starts at the start of the file. */
+  walk.seekable = (lseek (nks->reader.fd, 0, SEEK_CUR)
+		   == nks->reader.fd_offset);
+#endif
+  walk.user_data = user_data;
+
+  root = g_malloc0 (sizeof (*root));
+  nks_entry_copy (&nks->root_entry, &root->entry);
+  g_tree_insert (walk.pending, GUINT_TO_POINTER (0), g_slist_append (NULL, root));
+
+  /* Entries are visited in the order of their offsets, so that the stream
+   * only ever moves forward, except when one refers back to spilled data. */
+  while (r == 0 && !stop && g_tree_nnodes (walk.pending) > 0)
+    {
+      g_tree_foreach (walk.pending, &get_first_pending, &key);
+
+      group = g_tree_lookup (walk.pending, key);
+      g_tree_remove (walk.pending, key);
+
+      r = visit_group (&walk, group, GPOINTER_TO_UINT (key), &stop);
+
+      g_slist_free_full (group, (GDestroyNotify) &path_entry_free);
+    }
+
+  g_tree_foreach (walk.pending, &free_pending, NULL);
+  g_tree_destroy (walk.pending);
+  g_hash_table_destroy (walk.tables);
+  nks_spill_free (walk.spill);
+
+  return r;
+}
+
+typedef struct
+{
+  NksStreamFunc filter;
+  void		*user_data;
+  GPtrArray	*dirs;
+  GPtrArray	*files;
+  GHashTable	*seen;	/* Path -> whether its contents were collected */
+} TreeWalk;
+
+/* Adds an entry to the walk.  Walks of several paths see some entries more
+ * than once, and keep only the first. */
+static void
+add_to_walk (TreeWalk *walk, const char *dir, const NksEntry *entry)
+{
+  PathEntry *pe;
+  char *path;
+
+  if (walk->seen != NULL)
+    {
+      path = child_path (dir, entry->name);
+      if (g_hash_table_contains (walk->seen, path))
+	{
+	  g_free (path);
+	  return;
 	}
+
+      g_hash_table_insert (walk->seen, path, GINT_TO_POINTER (false));
     }
+
+  pe = g_malloc0 (sizeof (*pe));
+  pe->dir = g_strdup (dir);
+  nks_entry_copy (entry, &pe->entry);
+
+  if (entry->type == NKS_ENT_DIRECTORY)
+    g_ptr_array_add (walk->dirs, pe);
+  else
+    g_ptr_array_add (walk->files, pe);
 }
 
-off_t
-nks_file_size (Nks *nks, const NksEntry *entry)
+/* Returns whether the contents of the directory at path are still to be
+ * collected, and marks them as collected. */
+static bool
+expand_directory (TreeWalk *walk, const char *path)
 {
-  NksEncryptedFileHeader header;
-  uint32_t magic;
-  int r;
+  if (walk->seen == NULL)
+    return true;
 
-  if (lseek (nks->fd, entry->offset, SEEK_SET) < 0)
-    return -EIO;
+  if (GPOINTER_TO_INT (g_hash_table_lookup (walk->seen, path)))
+    return false;
 
-  if (!read_u32_le (nks->fd, &magic))
-    return -EIO;
+  g_hash_table_insert (walk->seen, g_strdup (path), GINT_TO_POINTER (true));
+  return true;
+}
 
-  switch (magic)
+static int
+collect_tree (Nks *nks, const NksEntry *dir_entry, const char *dir,
+	      unsigned int depth, TreeWalk *walk)
+{
+  GPtrArray *entries;
+  NksEntry *entry;
+  char *path;
+  guint n;
+  int r, sub;
+
+  if (depth > MAX_TREE_DEPTH)
+    return -ELOOP;
+
+  entries = g_ptr_array_new_with_free_func ((GDestroyNotify) &free_entry);
+
+  /* A directory which cannot be read does not stop the walk; whatever was
+   * listed and the rest of the tree are still collected, and the first
+   * error is returned. */
+  r = nks_list_dir_entry (nks, dir_entry, (NksTraverseFunc) &collect_entry,
+			  entries);
+
+  for (n = 0; n < entries->len; n++)
     {
-    case NKS_MAGIC_ENCRYPTED_FILE:
-      break;
+      entry = g_ptr_array_index (entries, n);
 
-    case NKS_MAGIC_DIRECTORY:
-      return -EISDIR;
+      /* Left out entries are never looked into. */
+      if (walk->filter != NULL
+	  && !walk->filter (nks, dir, entry, walk->user_data))
+	continue;
 
-    default:
-      return -ENOTSUP;
+      add_to_walk (walk, dir, entry);
+
+      if (entry->type != NKS_ENT_DIRECTORY)
+	continue;
+
+      path = child_path (dir, entry->name);
+      if (expand_directory (walk, path))
+	{
+	  sub = collect_tree (nks, entry, path, depth + 1, walk);
+	  if (r == 0)
+	    r = sub;
+	}
+      g_free (path);
     }
 
-  if (lseek (nks->fd, entry->offset, SEEK_SET) < 0)
-    return -EIO;
+  g_ptr_array_free (entries, true);
 
-  r = nks_read_encrypted_file_header (nks->fd, &header);
-  if (r != 0)
-    return r;
+  return r;
+}
+
+static gint
+compare_path_entry_offsets (gconstpointer a, gconstpointer b)
+{
+  const PathEntry *x = *(PathEntry * const *) a;
+  const PathEntry *y = *(PathEntry * const *) b;
+
+  return (x->entry.offset < y->entry.offset ? -1
+	  : x->entry.offset > y->entry.offset);
+}
+
+static void
+init_tree_walk (TreeWalk *walk, NksStreamFunc filter, void *user_data,
+		bool several)
+{
+  walk->filter	  = filter;
+  walk->user_data = user_data;
+  walk->dirs	  = g_ptr_array_new_with_free_func ((GDestroyNotify)
+						    &path_entry_free);
+  walk->files	  = g_ptr_array_new_with_free_func ((GDestroyNotify)
+						    &path_entry_free);
+  walk->seen	  = NULL;
+
+  if (several)
+    walk->seen = g_hash_table_new_full (&g_str_hash, &g_str_equal, &g_free,
+					NULL);
+}
+
+/* Calls func for the collected directories in tree order, and then for the
+ * files in the order of their data. */
+static void
+finish_tree_walk (Nks *nks, TreeWalk *walk, NksStreamFunc func,
+		  void *user_data)
+{
+  PathEntry *pe;
+  guint n;
+
+  /* Reading file data in the order it is stored turns the seeks of a tree
+   * walk into one sequential pass over the archive. */
+  g_ptr_array_sort (walk->files, &compare_path_entry_offsets);
+
+  for (n = 0; n < walk->dirs->len; n++)
+    {
+      pe = g_ptr_array_index (walk->dirs, n);
+      if (!func (nks, pe->dir, &pe->entry, user_data))
+	return;
+    }
+
+  for (n = 0; n < walk->files->len; n++)
+    {
+      pe = g_ptr_array_index (walk->files, n);
+      if (!func (nks, pe->dir, &pe->entry, user_data))
+	return;
+    }
+}
+
+static void
+clear_tree_walk (TreeWalk *walk)
+{
+  g_ptr_array_free (walk->dirs, true);
+  g_ptr_array_free (walk->files, true);
 
-  return header.size;
+  if (walk->seen != NULL)
+    g_hash_table_destroy (walk->seen);
 }
 
 int
-nks_extract_file_entry (Nks *nks, const NksEntry *entry, const char *out_file)
+nks_walk_sorted (Nks *nks, NksStreamFunc func, void *user_data)
 {
-  int fd;
+  return nks_walk_sorted_filter (nks, NULL, func, user_data);
+}
+
+int
+nks_walk_sorted_filter (Nks *nks, NksStreamFunc filter, NksStreamFunc func,
+			void *user_data)
+{
+  TreeWalk walk;
   int r;
 
-  fd = open (out_file, O_WRONLY | O_CREAT | O_BINARY, 0666);
-  if (fd < 0)
-    return -errno;
+  assert (nks != NULL);
+  assert (func != NULL);
 
-  r = nks_extract_file_entry_to_fd (nks, entry, fd);
-  close (fd);
+  init_tree_walk (&walk, filter, user_data, false);
 
-  if (r != 0)
-    unlink (out_file);
+  r = collect_tree (nks, &nks->root_entry, "", 0, &walk);
+  finish_tree_walk (nks, &walk, func, user_data);
+
+  clear_tree_walk (&walk);
 
   return r;
 }
 
+int
+nks_walk_paths (Nks *nks, const char * const *paths, size_t count,
+		NksStreamFunc func, void *user_data, int *results)
+{
+  char buffer[FILENAME_MAX];
+  GPtrArray *lookups;
+  NksFindResult *found;
+  const NksEntry *entry;
+  const char *rest;
+  TreeWalk walk;
+  GString *path;
+  size_t *ends;
+  size_t first, n, k;
+
+  assert (nks != NULL);
+  assert (func != NULL);
+
+  /* Each path is looked up together with the directories above it, which
+   * have to be reported first.  The batch reads each directory once. */
+  lookups = g_ptr_array_new_with_free_func (&g_free);
+  ends	  = g_new (size_t, count);
+  path	  = g_string_new (NULL);
+
+  for (n = 0; n < count; n++)
+    {
+      rest = paths[n];
+      results[n] = (rest == NULL || rest[0] == '/' ? -EINVAL : 0);
+      g_string_truncate (path, 0);
+
+      while (results[n] == 0 && rest != NULL)
+	{
+	  results[n] = extract_path_segment (rest, buffer, sizeof (buffer),
+					     &rest);
+	  if (results[n] != 0 || buffer[0] == 0)
+	    break;
+
+	  if (path->len != 0)
+	    g_string_append_c (path, '/');
+	  g_string_append (path, buffer);
+
+	  g_ptr_array_add (lookups, g_strdup (path->str));
+	}
+
+      ends[n] = lookups->len;
+    }
+
+  found = g_new0 (NksFindResult, lookups->len);
+  nks_find_entries (nks, (const char * const *) lookups->pdata, lookups->len,
+		    found);
+
+  init_tree_walk (&walk, NULL, NULL, true);
+
+  for (n = 0, first = 0; n < count; first = ends[n], n++)
+    {
+      if (results[n] != 0)
+	continue;
+
+      /* The directories above a path exist if the path itself does. */
+      if (first < ends[n] && found[ends[n] - 1].error != 0)
+	{
+	  results[n] = found[ends[n] - 1].error;
+	  continue;
+	}
+
+      g_string_truncate (path, 0);
+      for (k = first; k < ends[n]; k++)
+	{
+	  add_to_walk (&walk, path->str, &found[k].entry);
+
+	  if (k + 1 < ends[n])
+	    {
+	      if (path->len != 0)
+		g_string_append_c (path, '/');
+	      g_string_append (path, found[k].entry.name);
+	    }
+	}
+
+      /* An empty path names the root. */
+      entry = (first < ends[n] ? &found[ends[n] - 1].entry : &nks->root_entry);
+      if (entry->type != NKS_ENT_DIRECTORY)
+	continue;
+
+      if (first < ends[n])
+	{
+	  if (path->len != 0)
+	    g_string_append_c (path, '/');
+	  g_string_append (path, entry->name);
+	}
+
+      if (expand_directory (&walk, path->str))
+	results[n] = collect_tree (nks, entry, path->str, ends[n] - first,
+				   &walk);
+    }
+
+  finish_tree_walk (nks, &walk, func, user_data);
+  clear_tree_walk (&walk);
+
+  for (k = 0; k < lookups->len; k++)
+    {
+      if (found[k].error == 0)
+	nks_entry_free (&found[k].entry);
+    }
+
+  g_free (found);
+  g_free (ends);
+  g_ptr_array_free (lookups, true);
+  g_string_free (path, true);
+
+  return 0;
+}
+
 void
 nks_entry_copy (const NksEntry *src, NksEntry *dst)
 {
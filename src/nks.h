@@ -43,10 +43,90 @@ struct NksEntry
 
 typedef struct NksEntry NksEntry;
 typedef struct Nks Nks;
+typedef struct NksEntryView NksEntryView;
+typedef struct NksFile NksFile;
+typedef struct NksWriter NksWriter;
+
+/**
+ * Flags accepted by nks_open_fd_flags.
+ */
+typedef enum
+{
+  NKS_OPEN_MMAP	       = 1 << 0,	/* Map the archive if possible */
+  NKS_OPEN_INDEX       = 1 << 1,	/* Keep the directory tree in memory */
+  NKS_OPEN_INDEX_CACHE = 1 << 2,	/* Also cache the index on disk */
+  NKS_OPEN_REENTRANT   = 1 << 3,	/* Allow use from several threads */
+  NKS_OPEN_STREAM      = 1 << 4,	/* Read a non-seekable stream once */
+  NKS_OPEN_STATS       = 1 << 5,	/* Count I/O and time, see nks_get_stats */
+} NksOpenFlags;
+
+/**
+ * Flags accepted by the nks_writer_add_file functions.
+ */
+typedef enum
+{
+  NKS_WRITE_ENCRYPTED = 1 << 0,	/* Encrypt the contents of the file */
+} NksWriteFlags;
+
+/**
+ * Statistics of the process-wide 0x0110 keystream cache.
+ */
+typedef struct
+{
+  uint64_t hits;	/* Keystreams found in the cache */
+  uint64_t misses;	/* Keystreams which had to be generated */
+  uint64_t evictions;	/* Keystreams dropped to respect the limit */
+  size_t   count;	/* Keystreams currently cached */
+  size_t   size;	/* Bytes currently cached */
+  size_t   limit;	/* Maximum number of bytes cached */
+} NksKeyCacheStats;
+
+/**
+ * Counters of the work done on one archive, see nks_get_stats.  Bytes copied
+ * inside the kernel or through io_uring count as read and written without
+ * adding system calls; mapped archives are read without system calls at all,
+ * but the bytes taken from the mapping still count as read.
+ */
+typedef struct
+{
+  uint64_t bytes_read;		 /* Bytes read from the archive */
+  uint64_t bytes_written;	 /* Bytes of extracted files written out */
+  uint64_t read_calls;		 /* read() and pread() calls on the archive */
+  uint64_t seek_calls;		 /* lseek() calls on the archive */
+  uint64_t write_calls;		 /* write() calls for extracted files */
+  uint64_t directories_parsed;	 /* Directory tables read */
+  uint64_t entries_decoded;	 /* Directory entries read */
+  uint64_t bytes_decrypted;
+  uint64_t keystreams_generated; /* 0x0110 keystreams computed */
+  uint64_t key_cache_hits;	 /* Keystreams found in the shared key cache */
+  uint64_t key_cache_misses;	 /* Keystreams not found there */
+  uint64_t index_cache_hits;	 /* Indexes loaded from the cache */
+  uint64_t index_cache_misses;	 /* Indexes which had to be built */
+  uint64_t parse_ns;		 /* Time spent reading directory tables */
+  uint64_t decrypt_ns;		 /* Time spent decrypting and computing keys */
+  uint64_t write_ns;		 /* Time spent writing extracted files */
+} NksStats;
+
+/**
+ * The outcome of looking up one path with nks_find_entries.
+ */
+typedef struct
+{
+  int	   error;	/* 0, or a negative errno value as from nks_find_entry */
+  NksEntry entry;	/* Only filled in if error is 0 */
+} NksFindResult;
 
 typedef bool (*NksTraverseFunc) (Nks *nks, const NksEntry *entry,
 				 void *user_data);
 
+typedef bool (*NksViewFunc) (Nks *nks, NksEntryView *view, void *user_data);
+
+typedef bool (*NksStreamFunc) (Nks *nks, const char *dir,
+			       const NksEntry *entry, void *user_data);
+
+typedef ssize_t (*NksFillFunc) (void *buffer, size_t size, off_t offset,
+				void *user_data);
+
 /**
  * Opens an archive.  This must be called first, before anything else can be done
  * with archives.
@@ -68,6 +148,46 @@ int nks_open (const char *file_name, Nks **ret);
  */
 int nks_open_fd (int fd, Nks **ret);
 
+/**
+ * Similar to nks_open, but maps the whole archive into memory, so that headers
+ * are decoded directly from the mapped bytes and unencrypted data is written
+ * out straight from the page cache.  If the archive cannot be mapped, the
+ * regular read()-based access is used instead.
+ */
+int nks_open_mmap (const char *file_name, Nks **ret);
+
+/**
+ * Similar to nks_open, but accepts a combination of NksOpenFlags.
+ *
+ * With NKS_OPEN_INDEX, the whole directory tree is read once while opening
+ * and kept in memory.  nks_find_entry and nks_get_entry then cost a single
+ * hash table lookup, and nks_list_dir_entry does no I/O.  If the tree cannot
+ * be read, the archive is opened without an index.
+ *
+ * NKS_OPEN_INDEX_CACHE additionally saves the index to a cache directory
+ * ($NKS_INDEX_CACHE_DIR, or "libnks" in the user cache directory) and, on
+ * later opens of the same unmodified archive, maps it back in instead of
+ * reading the directory tree.
+ *
+ * With NKS_OPEN_REENTRANT, every operation reads the archive through its own
+ * cursor using positional reads, so that one Nks handle may be used to list
+ * and extract from several threads at the same time.  Opening fails with
+ * -ENOTSUP if the platform has no pread() and the archive cannot be mapped.
+ *
+ * NKS_OPEN_STREAM opens an archive which can only be read once from the
+ * front, such as a pipe; see nks_stream_walk.  All other flags except
+ * NKS_OPEN_STATS are then ignored.
+ *
+ * NKS_OPEN_STATS makes the archive count the work done on it, which
+ * nks_get_stats reports.  Without it, no counting is done at all.
+ */
+int nks_open_flags (const char *file_name, unsigned int flags, Nks **ret);
+
+/**
+ * Similar to nks_open_fd, but accepts a combination of NksOpenFlags.
+ */
+int nks_open_fd_flags (int fd, unsigned int flags, Nks **ret);
+
 /**
  * Closes an archive.
  */
@@ -99,6 +219,139 @@ int nks_list_dir (Nks *nks, const char *dir, NksTraverseFunc func,
 int nks_list_dir_entry (Nks *nks, const NksEntry *entry,
 			NksTraverseFunc function, void *user_data);
 
+/**
+ * Lists the contents of a directory like nks_list_dir_entry, but hands func
+ * a borrowed view of each entry instead of a decoded copy.  The name of an
+ * entry is only decoded if nks_entry_view_name is called, so that walks which
+ * only look at types and offsets allocate nothing per entry.  A view is only
+ * valid until func returns.
+ *
+ * @return 0 on success
+ */
+int nks_iterate_dir_entry (Nks *nks, const NksEntry *entry, NksViewFunc func,
+			   void *user_data);
+
+/**
+ * Returns the type of the entry of a view.
+ */
+NksEntryType nks_entry_view_type (const NksEntryView *view);
+
+/**
+ * Returns the offset of the entry of a view in the archive.
+ */
+off_t nks_entry_view_offset (const NksEntryView *view);
+
+/**
+ * Returns the name of the entry of a view, encoded in UTF-8.  It is decoded
+ * the first time it is asked for and belongs to the view.
+ *
+ * @return the name, or NULL if the archive stores an invalid one
+ */
+const char *nks_entry_view_name (NksEntryView *view);
+
+/**
+ * Copies the entry of a view, so that it can be kept after the view is gone.
+ *
+ * @param view the view
+ * @param ret  pointer to a NksEntry structure to be filled in.  Must be
+ *             disposed of with nks_entry_free.
+ *
+ * @return 0 on success, or -EILSEQ if the name is invalid
+ */
+int nks_entry_view_copy (NksEntryView *view, NksEntry *ret);
+
+/**
+ * Walks an archive opened with NKS_OPEN_STREAM, reading it strictly forward.
+ * It calls func for each entry as soon as the stream reaches it, so entries
+ * come in the order they are stored in, rather than directory by directory;
+ * a directory is always reported before its contents.  If func returns false,
+ * the walk stops.
+ *
+ * When func is called for a file, it may extract it with
+ * nks_extract_file_entry or nks_extract_file_entry_to_fd.  Files it leaves
+ * alone are skipped.  No other functions may be called on the archive
+ * during the walk.
+ *
+ * Parts of the archive that are read past before any entry is known to refer
+ * to them are kept, up to memory_limit bytes in memory and then in a
+ * temporary file, in case an entry seen later does.  Archives which store
+ * directories before their contents need to keep almost nothing.  Directory
+ * tables are always kept once read.  If the stream is in fact a file, such
+ * as redirected standard input, nothing is kept and parts behind the stream
+ * are read from the file again.  Only the file data which was read by func
+ * itself cannot be read again from a pipe.
+ *
+ * @param nks          the archive
+ * @param memory_limit the number of bytes to keep in memory
+ * @param func         the function to call for each entry.  dir is the path
+ *                     of the directory containing the entry, with slashes
+ *                     ('/') as separators, and is empty for the top level.
+ * @param user_data    an optional argument passed to func
+ *
+ * @return 0 on success
+ */
+int nks_stream_walk (Nks *nks, size_t memory_limit, NksStreamFunc func,
+		     void *user_data);
+
+/**
+ * Walks a whole archive, calling func for every directory and then for every
+ * file.  Directories come in tree order, parents before their contents, and
+ * files in the order their data is stored in the archive, so that reading or
+ * extracting each file as it is reported reads the archive sequentially.  If
+ * func returns false, the walk stops.
+ *
+ * The whole tree is read before func is first called.  func may use any
+ * function on the archive.  Directories which cannot be read are left out,
+ * but everything else is still walked.
+ *
+ * @param nks       the archive
+ * @param func      the function to call for each entry.  dir is as for
+ *                  nks_stream_walk.
+ * @param user_data an optional argument passed to func
+ *
+ * @return 0 on success, or the first error reading the tree
+ */
+int nks_walk_sorted (Nks *nks, NksStreamFunc func, void *user_data);
+
+/**
+ * Similar to nks_walk_sorted, but calls filter for each entry as the tree is
+ * read.  Entries for which it returns false are left out of the walk, and
+ * the contents of such directories are not read at all.
+ *
+ * @param nks       the archive
+ * @param filter    the function deciding which entries to walk.  dir is as
+ *                  for nks_stream_walk.
+ * @param func      the function to call for each entry walked
+ * @param user_data an optional argument passed to filter and func
+ *
+ * @return 0 on success
+ */
+int nks_walk_sorted_filter (Nks *nks, NksStreamFunc filter, NksStreamFunc func,
+			    void *user_data);
+
+/**
+ * Similar to nks_walk_sorted, but only walks the entries named by paths,
+ * which are found as with nks_find_entries instead of by reading the whole
+ * tree.  A directory is walked with everything below it, and an empty path
+ * stands for the whole archive.  The directories above each named entry are
+ * reported too, so that extracting in walk order can create them first.  An
+ * entry named more than once is reported once.
+ *
+ * @param nks       the archive
+ * @param paths     array of count paths
+ * @param count     number of paths
+ * @param func      the function to call for each entry.  dir is as for
+ *                  nks_stream_walk, spelled as in the archive.
+ * @param user_data an optional argument passed to func
+ * @param results   array of count error codes, set to 0 for each path which
+ *                  was walked, or to the error from looking it up or reading
+ *                  the directories below it
+ *
+ * @return 0 on success
+ */
+int nks_walk_paths (Nks *nks, const char * const *paths, size_t count,
+		    NksStreamFunc func, void *user_data, int *results);
+
 /**
  * Returns the size of a file in an archive.
  *
@@ -109,6 +362,93 @@ int nks_list_dir_entry (Nks *nks, const NksEntry *entry,
  */
 off_t nks_file_size (Nks *nks, const NksEntry *entry);
 
+/**
+ * Reads a whole file from an archive into memory.
+ *
+ * @param nks    the archive
+ * @param entry  the entry corresponding to a file in the archive
+ * @param buffer where to store the contents of the file
+ * @param size   the size of buffer.  If it is smaller than the file,
+ *               -ENOBUFS is returned; nks_file_size tells how much is needed.
+ *
+ * @return the size of the file, or a negative value on error
+ */
+ssize_t nks_read_entry_into (Nks *nks, const NksEntry *entry, void *buffer,
+			     size_t size);
+
+/**
+ * Reads a whole file from an archive into a buffer taken from a pool owned by
+ * the archive.  Buffers are grouped in power-of-two size classes and reused
+ * once released, so reading many files does not allocate each time.
+ *
+ * @param nks   the archive
+ * @param entry the entry corresponding to a file in the archive
+ * @param ret   where to store the buffer.  It must be given back with
+ *              nks_release_entry_data before the archive is closed.
+ * @param size  where to store the size of the file, or NULL
+ *
+ * @return 0 on success
+ */
+int nks_read_entry (Nks *nks, const NksEntry *entry, void **ret,
+		    size_t *size);
+
+/**
+ * Gives a buffer returned by nks_read_entry back to the pool of the archive.
+ */
+void nks_release_entry_data (Nks *nks, void *data);
+
+/**
+ * Opens a file in an archive for reading at arbitrary offsets.  Encrypted files
+ * are decrypted on the fly, and only the requested bytes are read.
+ *
+ * A NksFile must only be used by one thread at a time.  Several files of the
+ * same archive may be read from different threads if the archive was opened
+ * with NKS_OPEN_REENTRANT.  The archive must stay open until the file is
+ * closed.
+ *
+ * @param nks   the archive
+ * @param entry the entry corresponding to a file in the archive
+ * @param ret   pointer to a NksFile * pointer, which will be initialised upon
+ *              success.  It has to be closed with nks_file_close.
+ *
+ * @return 0 on success
+ */
+int nks_file_open (Nks *nks, const NksEntry *entry, NksFile **ret);
+
+/**
+ * Closes a file opened with nks_file_open.
+ */
+void nks_file_close (NksFile *file);
+
+/**
+ * Reads up to size bytes of a file, starting offset bytes into it.  The
+ * position used by nks_file_read is not changed.
+ *
+ * @return the number of bytes read, which is only less than size at the end
+ *         of the file, or a negative value on error
+ */
+ssize_t nks_file_pread (NksFile *file, void *buffer, size_t size,
+			off_t offset);
+
+/**
+ * Reads up to size bytes of a file from its current position, and advances
+ * the position by the number of bytes read.
+ *
+ * @return the number of bytes read, 0 at the end of the file, or a negative
+ *         value on error
+ */
+ssize_t nks_file_read (NksFile *file, void *buffer, size_t size);
+
+/**
+ * Sets the position of a file, like lseek.  whence is one of SEEK_SET,
+ * SEEK_CUR and SEEK_END.  Seeking past the end is allowed; reads there
+ * return 0.
+ *
+ * @return the new position, or -EINVAL if it would be negative or does not
+ *         fit in off_t
+ */
+off_t nks_file_seek (NksFile *file, off_t offset, int whence);
+
 /**
  * Extracts a file from an archive.
  *
@@ -141,6 +481,25 @@ int nks_extract_file_entry_to_fd (Nks *nks, const NksEntry *entry, int out_fd);
  */
 int nks_find_entry (Nks *nks, const char *path, NksEntry *ret);
 
+/**
+ * Finds the entries corresponding to several paths at once.  Each result is
+ * what nks_find_entry would give for its path, but the paths are grouped by
+ * the directories they share, so that each directory table is read at most
+ * once per call.  With an index, most paths which are not in the archive are
+ * rejected by a filter before any hash table is probed.
+ *
+ * @param nks     archive handle
+ * @param paths   array of count paths
+ * @param count   number of paths
+ * @param results array of count results, filled in in the order of paths.
+ *                The entries of successful results must be disposed of with
+ *                nks_entry_free.
+ *
+ * @return 0 on success, once every result is filled in
+ */
+int nks_find_entries (Nks *nks, const char * const *paths, size_t count,
+		      NksFindResult *results);
+
 /**
  * Gets an immediate sub-entry of the given directory entry.
  *
@@ -170,6 +529,115 @@ void nks_entry_free (NksEntry *entry);
  */
 void nks_entry_copy (const NksEntry *src, NksEntry *dst);
 
+/**
+ * Starts creating an archive.  Entries are added with nks_writer_add_directory
+ * and the nks_writer_add_file functions, and nothing is written until
+ * nks_writer_close lays out and stores the whole archive.
+ *
+ * @param file_name name of the file to create or truncate
+ * @param version   archive format: 0x0100 (nks) or 0x0110 (nkx)
+ * @param set_id    library whose keystream encrypts files of a 0x0110
+ * 		    archive; ignored for 0x0100 archives, which use the fixed
+ * 		    keys
+ * @param ret	    pointer to a NksWriter * pointer, which will be initialised
+ * 		    upon success
+ *
+ * @return 0 on success, or -ENOTSUP for an unknown version
+ */
+int nks_create (const char *file_name, unsigned int version, uint32_t set_id,
+		NksWriter **ret);
+
+/**
+ * Like nks_create, but writes to an already open file descriptor, which does
+ * not need to be seekable.  The archive is written from the current position
+ * of fd.  fd is not closed by nks_writer_close.
+ */
+int nks_create_fd (int fd, unsigned int version, uint32_t set_id,
+		   NksWriter **ret);
+
+/**
+ * Adds a directory.  path is relative to the root of the archive and uses /
+ * as separator; missing parent directories are added as well.
+ *
+ * @return 0 on success, or -EEXIST if a file of that name exists, or an
+ *         entry whose name only differs in case, which readers could not
+ *         tell apart
+ */
+int nks_writer_add_directory (NksWriter *writer, const char *path);
+
+/**
+ * Adds a file with the given contents, which are copied.
+ *
+ * @param writer writer handle
+ * @param path   path of the file in the archive
+ * @param data   contents of the file
+ * @param size   size of data; at most 4 GiB - 1
+ * @param flags  NksWriteFlags
+ *
+ * @return 0 on success.  -ENOKEY means that encrypted files cannot be written
+ * 	   for the set id of a 0x0110 archive, and -EEXIST that an entry of
+ * 	   the same name, ignoring case, exists.
+ */
+int nks_writer_add_file (NksWriter *writer, const char *path, const void *data,
+			 size_t size, unsigned int flags);
+
+/**
+ * Adds a file whose contents are read from the file source when the archive
+ * is written.  The size of source is taken now.
+ */
+int nks_writer_add_file_path (NksWriter *writer, const char *path,
+			      const char *source, unsigned int flags);
+
+/**
+ * Adds a file of the given size whose contents are produced by func when the
+ * archive is written.  func is called with consecutive pieces of the file and
+ * must fill the whole buffer, returning size, or return a negative errno
+ * value.  user_data must stay valid until nks_writer_close.
+ */
+int nks_writer_add_file_func (NksWriter *writer, const char *path,
+			      uint64_t size, unsigned int flags,
+			      NksFillFunc func, void *user_data);
+
+/**
+ * Writes the archive and frees the writer.  Archives are limited to entries
+ * starting below 4 GiB.  If writing fails, a file created by nks_create is
+ * removed.
+ *
+ * @return 0 on success, or -EFBIG if the archive is too large
+ */
+int nks_writer_close (NksWriter *writer);
+
+/**
+ * Frees the writer without writing anything.  A file created by nks_create is
+ * removed.
+ */
+void nks_writer_discard (NksWriter *writer);
+
+/**
+ * Fills in stats with the counters of an archive opened with NKS_OPEN_STATS,
+ * covering everything done since it was opened.  It may be called while other
+ * threads use the archive.
+ *
+ * @return 0 on success, or -ENOTSUP if the archive does not count
+ */
+int nks_get_stats (Nks *nks, NksStats *stats);
+
+/**
+ * Sets the maximum amount of memory, in bytes, used by the keystream cache
+ * shared by all archives in the process.  Each keystream of a 0x0110 library
+ * takes 64 KiB; the default limit holds 64 of them.  Least recently used
+ * keystreams are dropped to stay within the limit.  A limit below 64 KiB
+ * disables caching, so that keystreams are only kept while an archive using
+ * them is open.
+ */
+void nks_set_key_cache_limit (size_t size);
+
+/**
+ * Fills in stats with the hit and miss counters and current size of the
+ * keystream cache.
+ */
+void nks_get_key_cache_stats (NksKeyCacheStats *stats);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif
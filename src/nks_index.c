@@ -0,0 +1,957 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+
+#include "nks.h"
+#include "nks_index.h"
+#include "nks_reader.h"
+#include "util.h"
+
+#define NKS_INDEX_MAGIC	     "NKSINDEX"
+#define NKS_INDEX_VERSION    4
+#define NKS_INDEX_BYTE_ORDER UINT32_C (0x01020304)
+#define NKS_INDEX_HEAD_SIZE  4096
+
+/*
+ * Layout of an index cache file.  The header is followed by the entry table,
+ * the path and directory hash slots, the path filter, and the name and path
+ * blobs, all in native byte order.  The archive size, modification time
+ * (to the nanosecond where the system keeps it), inode and a checksum of its
+ * first bytes tie the file to one version of one archive.
+ */
+typedef struct
+{
+  char	   magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t entry_size;
+  uint32_t head_checksum;
+  uint64_t archive_size;
+  int64_t  archive_mtime;
+  uint64_t archive_inode;
+  uint32_t archive_mtime_nsec;
+  uint32_t entry_count;
+  uint32_t names_size;
+  uint32_t paths_size;
+  uint32_t path_slot_count;
+  uint32_t dir_slot_count;
+  uint32_t filter_word_count;
+  uint32_t header_checksum;	/* Of all the preceding fields */
+} NksIndexFileHeader;
+
+struct NksIndex
+{
+  const NksIndexEntry *entries;
+  uint32_t	       entry_count;
+  const char	      *names;
+  uint32_t	       names_size;
+  const char	      *paths;
+  uint32_t	       paths_size;
+  const uint32_t      *path_slots;	/* Entry index + 1, hashed by path */
+  uint32_t	       path_slot_count;
+  const uint32_t      *dir_slots;	/* Entry index + 1, hashed by offset */
+  uint32_t	       dir_slot_count;
+  const uint32_t      *filter;	/* Bloom filter of all paths */
+  uint32_t	       filter_word_count;
+
+  /* Either a mapped or loaded cache file, or NULL if built in memory. */
+  void		      *storage;
+  size_t	       storage_size;
+  bool		       storage_mapped;
+};
+
+typedef struct
+{
+  GArray  *entries;
+  GArray  *names;
+  GArray  *paths;
+  uint32_t parent;
+  GString *scratch;
+} BuildContext;
+
+static uint32_t
+hash_bytes (uint32_t h, const void *data, size_t len)
+{
+  const uint8_t *p = data;
+  size_t n;
+
+  /* FNV-1a, which unlike g_str_hash is fixed for the cache file format. */
+  for (n = 0; n < len; n++)
+    h = (h ^ p[n]) * UINT32_C (0x01000193);
+
+  return h;
+}
+
+static uint32_t
+hash_path (const char *path)
+{
+  return hash_bytes (UINT32_C (0x811c9dc5), path, strlen (path));
+}
+
+static uint32_t
+hash_offset (uint32_t offset)
+{
+  return offset * UINT32_C (0x9e3779b1);
+}
+
+static uint32_t
+slot_count_for (uint32_t count)
+{
+  uint32_t n = 16;
+
+  while (n < 2 * (uint64_t) count)
+    n *= 2;
+
+  return n;
+}
+
+/*
+ * The path filter is a blocked Bloom filter: each path sets
+ * NKS_INDEX_FILTER_BITS bits of a single 32-bit word, so that a lookup costs
+ * one memory access.  With four to eight words for every eight entries, at
+ * most about one path in a hundred that is not in the archive gets past it.
+ */
+#define NKS_INDEX_FILTER_BITS 4
+
+static uint32_t
+filter_word_count_for (uint32_t count)
+{
+  return slot_count_for (count) / 4;
+}
+
+static uint32_t
+filter_mix (uint32_t h)
+{
+  /* The finaliser of MurmurHash3, to spread the path hash over the word
+   * index and the bit positions. */
+  h ^= h >> 16;
+  h *= UINT32_C (0x85ebca6b);
+  h ^= h >> 13;
+  h *= UINT32_C (0xc2b2ae35);
+  h ^= h >> 16;
+
+  return h;
+}
+
+static uint32_t
+filter_mask (uint32_t h, uint32_t *word, uint32_t word_count)
+{
+  uint32_t mask = 0;
+  uint32_t bits;
+  int n;
+
+  *word = h & (word_count - 1);
+  bits = filter_mix (h);
+
+  for (n = 0; n < NKS_INDEX_FILTER_BITS; n++)
+    mask |= UINT32_C (1) << ((bits >> (5 * n)) & 31);
+
+  return mask;
+}
+
+static bool
+filter_may_contain (const NksIndex *index, uint32_t h)
+{
+  uint32_t word, mask;
+
+  mask = filter_mask (h, &word, index->filter_word_count);
+
+  return ((index->filter[word] & mask) == mask);
+}
+
+static const char *
+entry_path (const NksIndex *index, uint32_t n)
+{
+  if (index->entries[n].path >= index->paths_size)
+    return "";
+
+  return index->paths + index->entries[n].path;
+}
+
+static const char *
+entry_name (const NksIndex *index, uint32_t n)
+{
+  if (index->entries[n].name >= index->names_size)
+    return "";
+
+  return index->names + index->entries[n].name;
+}
+
+static bool
+find_path (const NksIndex *index, const char *folded, uint32_t *ret)
+{
+  uint32_t mask = index->path_slot_count - 1;
+  uint32_t h, n, probes;
+
+  h = hash_path (folded);
+  if (!filter_may_contain (index, h))
+    return false;
+
+  h &= mask;
+
+  for (probes = 0; probes < index->path_slot_count; probes++)
+    {
+      n = index->path_slots[h];
+      if (n == 0)
+	break;
+
+      if (n <= index->entry_count && strcmp (entry_path (index, n - 1),
+					       folded) == 0)
+	{
+	  *ret = n - 1;
+	  return true;
+	}
+
+      h = (h + 1) & mask;
+    }
+
+  return false;
+}
+
+static bool
+find_directory (const NksIndex *index, uint32_t offset, uint32_t *ret)
+{
+  uint32_t mask = index->dir_slot_count - 1;
+  uint32_t h, n, probes;
+
+  h = hash_offset (offset) & mask;
+
+  for (probes = 0; probes < index->dir_slot_count; probes++)
+    {
+      n = index->dir_slots[h];
+      if (n == 0)
+	break;
+
+      if (n <= index->entry_count && index->entries[n - 1].offset == offset
+	  && index->entries[n - 1].type == NKS_ENT_DIRECTORY)
+	{
+	  *ret = n - 1;
+	  return true;
+	}
+
+      h = (h + 1) & mask;
+    }
+
+  return false;
+}
+
+static void
+build_slots (NksIndex *index)
+{
+  uint32_t *path_slots;
+  uint32_t *dir_slots;
+  uint32_t *filter;
+  uint32_t mask;
+  uint32_t h, n, word;
+
+  index->path_slot_count   = slot_count_for (index->entry_count);
+  index->dir_slot_count	   = slot_count_for (index->entry_count);
+  index->filter_word_count = filter_word_count_for (index->entry_count);
+  path_slots = g_malloc0 (index->path_slot_count * sizeof (uint32_t));
+  dir_slots  = g_malloc0 (index->dir_slot_count * sizeof (uint32_t));
+  filter     = g_malloc0 (index->filter_word_count * sizeof (uint32_t));
+  index->path_slots = path_slots;
+  index->dir_slots  = dir_slots;
+  index->filter	    = filter;
+
+  /* Filled in first, since find_path below consults it. */
+  for (n = 0; n < index->entry_count; n++)
+    {
+      mask = filter_mask (hash_path (entry_path (index, n)), &word,
+			  index->filter_word_count);
+      filter[word] |= mask;
+    }
+
+  /* The first of several entries with the same folded path or directory
+   * offset wins, as it would in a directory scan. */
+  for (n = 0; n < index->entry_count; n++)
+    {
+      if (!find_path (index, entry_path (index, n), &h))
+	{
+	  mask = index->path_slot_count - 1;
+	  for (h = hash_path (entry_path (index, n)) & mask;
+	       path_slots[h] != 0; h = (h + 1) & mask)
+	    ;
+	  path_slots[h] = n + 1;
+	}
+
+      if (index->entries[n].type == NKS_ENT_DIRECTORY
+	  && !find_directory (index, index->entries[n].offset, &h))
+	{
+	  mask = index->dir_slot_count - 1;
+	  for (h = hash_offset (index->entries[n].offset) & mask;
+	       dir_slots[h] != 0; h = (h + 1) & mask)
+	    ;
+	  dir_slots[h] = n + 1;
+	}
+    }
+}
+
+/* Paths are folded and normalised the way g_utf8_collate compares names in a
+ * directory scan, so that lookups find the same entries with or without an
+ * index. */
+char *
+nks_index_fold_path (const char *path)
+{
+  char *folded;
+  char *normal;
+
+  folded = g_utf8_casefold (path, -1);
+  normal = g_utf8_normalize (folded, -1, G_NORMALIZE_ALL_COMPOSE);
+  if (normal == NULL)
+    return folded;
+
+  g_free (folded);
+  return normal;
+}
+
+static uint32_t
+append_string (GArray *blob, const char *str)
+{
+  uint32_t offset = blob->len;
+
+  g_array_append_vals (blob, str, strlen (str) + 1);
+
+  return offset;
+}
+
+static bool
+add_child (Nks *nks, const NksEntry *ent, BuildContext *ctx)
+{
+  NksIndexEntry ie;
+  const char *parent_path;
+  char *folded;
+
+  parent_path = &g_array_index (ctx->paths, char,
+				g_array_index (ctx->entries, NksIndexEntry,
+					       ctx->parent).path);
+
+  folded = nks_index_fold_path (ent->name);
+
+  g_string_truncate (ctx->scratch, 0);
+  if (ctx->parent != 0)
+    {
+      g_string_append (ctx->scratch, parent_path);
+      g_string_append_c (ctx->scratch, '/');
+    }
+  g_string_append (ctx->scratch, folded);
+  g_free (folded);
+
+  memset (&ie, 0, sizeof (ie));
+  ie.name   = append_string (ctx->names, ent->name);
+  ie.path   = append_string (ctx->paths, ctx->scratch->str);
+  ie.parent = ctx->parent;
+  ie.offset = ent->offset;
+  ie.type   = ent->type;
+
+  g_array_append_val (ctx->entries, ie);
+
+  return true;
+}
+
+int
+nks_index_build (Nks *nks, NksIndex **ret)
+{
+  BuildContext ctx;
+  NksIndexEntry *ie;
+  NksIndexEntry root;
+  NksEntry dir;
+  NksIndex *index;
+  GHashTable *seen_dirs;
+  gpointer seen;
+  uint32_t n;
+  int r = 0;
+
+  ctx.entries = g_array_new (false, false, sizeof (NksIndexEntry));
+  ctx.names   = g_array_new (false, false, 1);
+  ctx.paths   = g_array_new (false, false, 1);
+  ctx.scratch = g_string_new (NULL);
+  seen_dirs   = g_hash_table_new (&g_direct_hash, &g_direct_equal);
+
+  memset (&root, 0, sizeof (root));
+  root.name = append_string (ctx.names, "/");
+  root.path = append_string (ctx.paths, "");
+  root.type = NKS_ENT_DIRECTORY;
+  g_array_append_val (ctx.entries, root);
+
+  /* Breadth-first, so that the children of each directory are contiguous. */
+  for (n = 0; n < ctx.entries->len; n++)
+    {
+      ie = &g_array_index (ctx.entries, NksIndexEntry, n);
+      if (ie->type != NKS_ENT_DIRECTORY)
+	continue;
+
+      seen = g_hash_table_lookup (seen_dirs, GUINT_TO_POINTER (ie->offset));
+      if (seen != NULL)
+	{
+	  /* Several names for one directory; share its children. */
+	  NksIndexEntry *orig = &g_array_index (ctx.entries, NksIndexEntry,
+						GPOINTER_TO_UINT (seen) - 1);
+	  ie->first_child = orig->first_child;
+	  ie->child_count = orig->child_count;
+	  continue;
+	}
+
+      g_hash_table_insert (seen_dirs, GUINT_TO_POINTER (ie->offset),
+			   GUINT_TO_POINTER (n + 1));
+
+      dir.name   = NULL;
+      dir.type   = NKS_ENT_DIRECTORY;
+      dir.offset = ie->offset;
+
+      ie->first_child = ctx.entries->len;
+      ctx.parent = n;
+
+      r = nks_list_dir_entry (nks, &dir, (NksTraverseFunc) add_child, &ctx);
+      if (r != 0)
+	goto err;
+
+      ie = &g_array_index (ctx.entries, NksIndexEntry, n);
+      ie->child_count = ctx.entries->len - ie->first_child;
+    }
+
+  g_hash_table_destroy (seen_dirs);
+
+  index = g_malloc0 (sizeof (*index));
+  index->entry_count = ctx.entries->len;
+  index->names_size  = ctx.names->len;
+  index->paths_size  = ctx.paths->len;
+  index->entries = (NksIndexEntry *) g_array_free (ctx.entries, false);
+  index->names	 = g_array_free (ctx.names, false);
+  index->paths	 = g_array_free (ctx.paths, false);
+  g_string_free (ctx.scratch, true);
+
+  build_slots (index);
+
+  *ret = index;
+  return 0;
+
+err:
+  g_hash_table_destroy (seen_dirs);
+  g_array_free (ctx.entries, true);
+  g_array_free (ctx.names, true);
+  g_array_free (ctx.paths, true);
+  g_string_free (ctx.scratch, true);
+  return r;
+}
+
+void
+nks_index_free (NksIndex *index)
+{
+  if (index == NULL)
+    return;
+
+  if (index->storage == NULL)
+    {
+      g_free ((void *) index->entries);
+      g_free ((void *) index->names);
+      g_free ((void *) index->paths);
+      g_free ((void *) index->path_slots);
+      g_free ((void *) index->dir_slots);
+      g_free ((void *) index->filter);
+    }
+#if defined HAVE_MMAP && defined HAVE_SYS_MMAN_H
+  else if (index->storage_mapped)
+    munmap (index->storage, index->storage_size);
+#endif
+  else
+    g_free (index->storage);
+
+  g_free (index);
+}
+
+static void
+fill_entry (const NksIndex *index, uint32_t n, NksEntry *ret)
+{
+  ret->name   = g_strdup (entry_name (index, n));
+  ret->type   = index->entries[n].type;
+  ret->offset = index->entries[n].offset;
+}
+
+static int
+lookup_folded (const NksIndex *index, const char *path, NksEntry *ret)
+{
+  char *folded;
+  uint32_t n;
+  bool found;
+
+  folded = nks_index_fold_path (path);
+  found = find_path (index, folded, &n);
+  g_free (folded);
+
+  if (!found)
+    return -ENOENT;
+
+  fill_entry (index, n, ret);
+  return 0;
+}
+
+static int
+lookup_directory (const NksIndex *index, const NksEntry *dir, uint32_t *ret)
+{
+  if (dir->type != NKS_ENT_DIRECTORY)
+    return -ENOTDIR;
+
+  if (!find_directory (index, dir->offset, ret))
+    return -ENOENT;
+
+  return 0;
+}
+
+/* Looks up a path which is not indexed as a whole.  The entries below an
+ * alias of a directory are only indexed under the first path to it, so the
+ * rest of the path is looked up one name at a time from the deepest entry on
+ * it which is indexed.  A file in the middle of the path is reported like the
+ * directory walk does.  prefix starts out as the whole path, full. */
+static int
+lookup_below (const NksIndex *index, GString *prefix, const char *full,
+	      NksEntry *ret)
+{
+  NksEntry dir, child;
+  char **names;
+  char *sl;
+  guint n;
+  int r;
+
+  for (;;)
+    {
+      sl = strrchr (prefix->str, '/');
+      if (sl == NULL)
+	return -ENOENT;
+
+      g_string_truncate (prefix, sl - prefix->str);
+
+      if (lookup_folded (index, prefix->str, &dir) == 0)
+	break;
+    }
+
+  names = g_strsplit (full + prefix->len + 1, "/", -1);
+  r = 0;
+
+  for (n = 0; names[n] != NULL; n++)
+    {
+      r = nks_index_get_entry (index, &dir, names[n], &child);
+      nks_entry_free (&dir);
+      if (r != 0)
+	break;
+
+      dir = child;
+    }
+
+  g_strfreev (names);
+
+  if (r == 0)
+    *ret = dir;
+
+  return r;
+}
+
+int
+nks_index_find_entry (const NksIndex *index, const char *path, NksEntry *ret)
+{
+  char buffer[FILENAME_MAX];
+  GString *normalised;
+  char *full;
+  int r = 0;
+
+  normalised = g_string_new (NULL);
+
+  /* Collapse repeated and trailing slashes the same way the directory
+   * walk in nks_find_entry does. */
+  while (path != NULL)
+    {
+      r = extract_path_segment (path, buffer, sizeof (buffer), &path);
+      if (r != 0)
+	goto out;
+
+      if (buffer[0] == 0)
+	break;
+
+      if (normalised->len != 0)
+	g_string_append_c (normalised, '/');
+      g_string_append (normalised, buffer);
+    }
+
+  r = lookup_folded (index, normalised->str, ret);
+  if (r == -ENOENT)
+    {
+      full = g_strdup (normalised->str);
+      r = lookup_below (index, normalised, full, ret);
+      g_free (full);
+    }
+
+out:
+  g_string_free (normalised, true);
+  return r;
+}
+
+int
+nks_index_get_entry (const NksIndex *index, const NksEntry *dir,
+		     const char *name, NksEntry *ret)
+{
+  GString *path;
+  uint32_t n;
+  int r;
+
+  r = lookup_directory (index, dir, &n);
+  if (r != 0)
+    return r;
+
+  path = g_string_new (entry_path (index, n));
+  if (n != 0)
+    g_string_append_c (path, '/');
+  g_string_append (path, name);
+
+  r = lookup_folded (index, path->str, ret);
+  g_string_free (path, true);
+
+  return r;
+}
+
+int
+nks_index_list_dir (const NksIndex *index, Nks *nks, const NksEntry *dir,
+		    NksTraverseFunc func, void *user_data)
+{
+  const NksIndexEntry *ie;
+  NksEntry ent;
+  uint32_t n, end;
+  int r;
+
+  r = lookup_directory (index, dir, &n);
+  if (r != 0)
+    return r;
+
+  if ((uint64_t) index->entries[n].first_child
+      + index->entries[n].child_count > index->entry_count)
+    return -EILSEQ;
+
+  end = index->entries[n].first_child + index->entries[n].child_count;
+
+  for (n = index->entries[n].first_child; n < end; n++)
+    {
+      ie = &index->entries[n];
+
+      /* The name is borrowed from the blob; callers may not free it. */
+      ent.name   = (char *) entry_name (index, n);
+      ent.type   = ie->type;
+      ent.offset = ie->offset;
+
+      if (!func (nks, &ent, user_data))
+	break;
+    }
+
+  return 0;
+}
+
+static bool
+read_archive_key (NksReader *reader, NksIndexFileHeader *hdr, dev_t *dev)
+{
+  uint8_t head[NKS_INDEX_HEAD_SIZE];
+  struct stat st;
+  size_t len;
+
+  /* Without inode numbers, archives cannot be told apart reliably. */
+  if (fstat (reader->fd, &st) != 0 || st.st_ino == 0)
+    return false;
+
+  len = MIN ((uintmax_t) st.st_size, sizeof (head));
+  if (!nks_reader_seek (reader, 0) || !nks_reader_read (reader, head, len))
+    return false;
+
+  hdr->archive_size  = st.st_size;
+  hdr->archive_mtime = st.st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+  hdr->archive_mtime_nsec = st.st_mtim.tv_nsec;
+#else
+  hdr->archive_mtime_nsec = 0;
+#endif
+  hdr->archive_inode = st.st_ino;
+  hdr->head_checksum = hash_bytes (UINT32_C (0x811c9dc5), head, len);
+  *dev = st.st_dev;
+
+  return true;
+}
+
+static char *
+cache_file_name (const char *cache_dir, const NksIndexFileHeader *hdr,
+		 dev_t dev)
+{
+  char name[64];
+
+  snprintf (name, sizeof (name), "%016" PRIx64 "-%016" PRIx64 ".idx",
+	    (uint64_t) dev, hdr->archive_inode);
+
+  return g_build_filename (cache_dir, name, NULL);
+}
+
+static uint32_t
+header_checksum (const NksIndexFileHeader *hdr)
+{
+  return hash_bytes (UINT32_C (0x811c9dc5), hdr,
+		     offsetof (NksIndexFileHeader, header_checksum));
+}
+
+static uint64_t
+file_size_for (const NksIndexFileHeader *hdr)
+{
+  return sizeof (*hdr)
+	 + (uint64_t) hdr->entry_count * sizeof (NksIndexEntry)
+	 + (uint64_t) hdr->path_slot_count * sizeof (uint32_t)
+	 + (uint64_t) hdr->dir_slot_count * sizeof (uint32_t)
+	 + (uint64_t) hdr->filter_word_count * sizeof (uint32_t)
+	 + hdr->names_size + hdr->paths_size;
+}
+
+static bool
+valid_header (const NksIndexFileHeader *hdr, const NksIndexFileHeader *key,
+	      size_t size)
+{
+  if (memcmp (hdr->magic, NKS_INDEX_MAGIC, sizeof (hdr->magic)) != 0
+      || hdr->version != NKS_INDEX_VERSION
+      || hdr->byte_order != NKS_INDEX_BYTE_ORDER
+      || hdr->entry_size != sizeof (NksIndexEntry)
+      || hdr->header_checksum != header_checksum (hdr))
+    return false;
+
+  if (hdr->archive_size != key->archive_size
+      || hdr->archive_mtime != key->archive_mtime
+      || hdr->archive_mtime_nsec != key->archive_mtime_nsec
+      || hdr->archive_inode != key->archive_inode
+      || hdr->head_checksum != key->head_checksum)
+    return false;
+
+  if (hdr->entry_count == 0 || hdr->names_size == 0 || hdr->paths_size == 0)
+    return false;
+
+  if (hdr->path_slot_count == 0
+      || (hdr->path_slot_count & (hdr->path_slot_count - 1)) != 0
+      || hdr->dir_slot_count == 0
+      || (hdr->dir_slot_count & (hdr->dir_slot_count - 1)) != 0
+      || hdr->filter_word_count == 0
+      || (hdr->filter_word_count & (hdr->filter_word_count - 1)) != 0)
+    return false;
+
+  return (file_size_for (hdr) == size);
+}
+
+static bool
+read_all (int fd, void *buffer, size_t size)
+{
+  uint8_t *bp = buffer;
+  ssize_t count;
+
+  while (size > 0)
+    {
+      count = read (fd, bp, size);
+      if (count <= 0)
+	return false;
+
+      bp   += count;
+      size -= count;
+    }
+
+  return true;
+}
+
+static bool
+write_all (int fd, const void *buffer, size_t size)
+{
+  const uint8_t *bp = buffer;
+  ssize_t count;
+
+  while (size > 0)
+    {
+      count = write (fd, bp, size);
+      if (count <= 0)
+	return false;
+
+      bp   += count;
+      size -= count;
+    }
+
+  return true;
+}
+
+int
+nks_index_load (NksReader *reader, const char *cache_dir, NksIndex **ret)
+{
+  NksIndexFileHeader key;
+  const NksIndexFileHeader *hdr;
+  const uint8_t *p;
+  NksIndex *index;
+  struct stat st;
+  char *file_name;
+  void *data = NULL;
+  bool mapped = false;
+  size_t size;
+  dev_t dev;
+  int fd;
+
+  if (!read_archive_key (reader, &key, &dev))
+    return -ENOTSUP;
+
+  file_name = cache_file_name (cache_dir, &key, dev);
+  fd = open (file_name, O_RDONLY | O_BINARY);
+  g_free (file_name);
+
+  if (fd < 0)
+    return -errno;
+
+  if (fstat (fd, &st) != 0 || st.st_size < (off_t) sizeof (*hdr)
+      || (uintmax_t) st.st_size > SIZE_MAX)
+    {
+      close (fd);
+      return -EILSEQ;
+    }
+
+  size = st.st_size;
+
+#if defined HAVE_MMAP && defined HAVE_SYS_MMAN_H
+  data = mmap (NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data != MAP_FAILED)
+    mapped = true;
+  else
+    data = NULL;
+#endif
+
+  if (!mapped)
+    {
+      data = g_malloc (size);
+      if (!read_all (fd, data, size))
+	{
+	  close (fd);
+	  g_free (data);
+	  return -EIO;
+	}
+    }
+
+  close (fd);
+
+  hdr = data;
+  if (!valid_header (hdr, &key, size))
+    goto invalid;
+
+  index = g_malloc0 (sizeof (*index));
+  index->storage	 = data;
+  index->storage_size	 = size;
+  index->storage_mapped	 = mapped;
+  index->entry_count	 = hdr->entry_count;
+  index->names_size	 = hdr->names_size;
+  index->paths_size	 = hdr->paths_size;
+  index->path_slot_count = hdr->path_slot_count;
+  index->dir_slot_count	 = hdr->dir_slot_count;
+  index->filter_word_count = hdr->filter_word_count;
+
+  p = (const uint8_t *) (hdr + 1);
+  index->entries    = (const NksIndexEntry *) p;
+  p += hdr->entry_count * sizeof (NksIndexEntry);
+  index->path_slots = (const uint32_t *) p;
+  p += hdr->path_slot_count * sizeof (uint32_t);
+  index->dir_slots  = (const uint32_t *) p;
+  p += hdr->dir_slot_count * sizeof (uint32_t);
+  index->filter	    = (const uint32_t *) p;
+  p += hdr->filter_word_count * sizeof (uint32_t);
+  index->names	    = (const char *) p;
+  p += hdr->names_size;
+  index->paths	    = (const char *) p;
+
+  /* Keep lookups in bounds even if the file is damaged. */
+  if (index->names[index->names_size - 1] != 0
+      || index->paths[index->paths_size - 1] != 0)
+    {
+      index->storage = NULL;
+      g_free (index);
+      goto invalid;
+    }
+
+  *ret = index;
+  return 0;
+
+invalid:
+#if defined HAVE_MMAP && defined HAVE_SYS_MMAN_H
+  if (mapped)
+    munmap (data, size);
+  else
+#endif
+    g_free (data);
+
+  return -EILSEQ;
+}
+
+int
+nks_index_save (const NksIndex *index, NksReader *reader,
+		const char *cache_dir)
+{
+  NksIndexFileHeader hdr;
+  char *file_name;
+  char *tmp_name;
+  dev_t dev;
+  bool ok;
+  int fd;
+  int r = 0;
+
+  memset (&hdr, 0, sizeof (hdr));
+
+  if (!read_archive_key (reader, &hdr, &dev))
+    return -ENOTSUP;
+
+  memcpy (hdr.magic, NKS_INDEX_MAGIC, sizeof (hdr.magic));
+  hdr.version	      = NKS_INDEX_VERSION;
+  hdr.byte_order      = NKS_INDEX_BYTE_ORDER;
+  hdr.entry_size      = sizeof (NksIndexEntry);
+  hdr.entry_count     = index->entry_count;
+  hdr.names_size      = index->names_size;
+  hdr.paths_size      = index->paths_size;
+  hdr.path_slot_count = index->path_slot_count;
+  hdr.dir_slot_count  = index->dir_slot_count;
+  hdr.filter_word_count = index->filter_word_count;
+  hdr.header_checksum = header_checksum (&hdr);
+
+  if (g_mkdir_with_parents (cache_dir, 0700) != 0)
+    return -errno;
+
+  file_name = cache_file_name (cache_dir, &hdr, dev);
+  tmp_name = g_strconcat (file_name, ".XXXXXX", NULL);
+
+  fd = g_mkstemp (tmp_name);
+  if (fd < 0)
+    {
+      r = -errno;
+      goto out;
+    }
+
+  ok = (write_all (fd, &hdr, sizeof (hdr))
+	&& write_all (fd, index->entries,
+		      index->entry_count * sizeof (NksIndexEntry))
+	&& write_all (fd, index->path_slots,
+		      index->path_slot_count * sizeof (uint32_t))
+	&& write_all (fd, index->dir_slots,
+		      index->dir_slot_count * sizeof (uint32_t))
+	&& write_all (fd, index->filter,
+		      index->filter_word_count * sizeof (uint32_t))
+	&& write_all (fd, index->names, index->names_size)
+	&& write_all (fd, index->paths, index->paths_size));
+
+  if (close (fd) != 0)
+    ok = false;
+
+  /* Readers only ever see a complete file. */
+  if (!ok || g_rename (tmp_name, file_name) != 0)
+    {
+      g_unlink (tmp_name);
+      r = -EIO;
+    }
+
+out:
+  g_free (tmp_name);
+  g_free (file_name);
+  return r;
+}
@@ -0,0 +1,50 @@
+#ifndef NKS_INDEX_H
+#define NKS_INDEX_H
+
+#include <stdint.h>
+
+#include "nks.h"
+#include "nks_reader.h"
+
+/*
+ * An in-memory copy of the whole directory tree of an archive.  Entries are
+ * stored breadth-first, so the children of every directory occupy a
+ * contiguous range of the entry table, and names live in a single packed
+ * blob.  Full paths are case-folded and hashed, so that looking up a path is
+ * a single hash table probe.
+ *
+ * An index can be saved to a cache directory and later mapped back in, so
+ * that opening a large archive again does not walk its directory tree.
+ */
+typedef struct
+{
+  uint32_t name;	/* Offset of the name in the name blob */
+  uint32_t path;	/* Offset of the case-folded full path in the path blob */
+  uint32_t parent;	/* Index of the parent directory */
+  uint32_t first_child;	/* Index of the first child, for directories */
+  uint32_t child_count;
+  uint32_t offset;	/* Offset of the entry in the archive */
+  uint8_t  type;	/* NksEntryType */
+} NksIndexEntry;
+
+typedef struct NksIndex NksIndex;
+
+int nks_index_build (Nks *nks, NksIndex **ret);
+void nks_index_free (NksIndex *index);
+
+int nks_index_load (NksReader *reader, const char *cache_dir, NksIndex **ret);
+int nks_index_save (const NksIndex *index, NksReader *reader,
+		    const char *cache_dir);
+
+int nks_index_find_entry (const NksIndex *index, const char *path,
+			  NksEntry *ret);
+int nks_index_get_entry (const NksIndex *index, const NksEntry *dir,
+			 const char *name, NksEntry *ret);
+int nks_index_list_dir (const NksIndex *index, Nks *nks, const NksEntry *dir,
+			NksTraverseFunc func, void *user_data);
+
+/* Folds a name or path the way the index compares them, so that other
+ * lookups can agree with it.  The result has to be freed. */
+char *nks_index_fold_path (const char *path);
+
+#endif
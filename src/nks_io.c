@@ -3,32 +3,34 @@
 
 #include "nks.h"
 #include "nks_io.h"
+#include "nks_reader.h"
 #include "util.h"
 
 int
-nks_read_directory_header (int fd, NksDirectoryHeader *header)
+nks_reader_read_directory_header (NksReader *reader,
+				  NksDirectoryHeader *header)
 {
   uint32_t magic;
 
-  if (!read_u32_le (fd, &magic))
+  if (!nks_reader_read_u32_le (reader, &magic))
     return -EIO;
 
   if (magic != NKS_MAGIC_DIRECTORY)
     return -EILSEQ;
 
-  if (!read_u16_le (fd, &header->version))
+  if (!nks_reader_read_u16_le (reader, &header->version))
     return -EIO;
 
-  if (!read_u32_le (fd, &header->set_id))
+  if (!nks_reader_read_u32_le (reader, &header->set_id))
     return -EIO;
 
-  if (read (fd, header->unknown_0, 0x04) != 0x04)
+  if (!nks_reader_read (reader, header->unknown_0, 0x04))
     return -EIO;
 
-  if (!read_u32_le (fd, &header->entry_count))
+  if (!nks_reader_read_u32_le (reader, &header->entry_count))
     return -EIO;
 
-  if (read (fd, header->unknown_1, 0x04) != 0x04)
+  if (!nks_reader_read (reader, header->unknown_1, 0x04))
     return -EIO;
 
   switch (header->version)
@@ -44,6 +46,7 @@ nks_read_directory_header (int fd, NksDirectoryHeader *header)
   return 0;
 }
 
+/* The obfuscation is its own inverse, so this also encodes offsets. */
 static uint32_t
 decode_offset (uint32_t offset)
 {
@@ -51,18 +54,19 @@ decode_offset (uint32_t offset)
 }
 
 int
-nks_read_0100_entry_header (int fd, Nks0100EntryHeader *header)
+nks_reader_read_0100_entry_header (NksReader *reader,
+				   Nks0100EntryHeader *header)
 {
-  if (!read_string (fd, header->name, 129))
+  if (!nks_reader_read_string (reader, header->name, 129))
     return -EIO;
 
-  if (read (fd, header->unknown, 0x01) != 0x01)
+  if (!nks_reader_read (reader, header->unknown, 0x01))
     return -EIO;
 
-  if (!read_u32_le (fd, &header->offset))
+  if (!nks_reader_read_u32_le (reader, &header->offset))
     return -EIO;
 
-  if (!read_u16_le (fd, &header->type))
+  if (!nks_reader_read_u16_le (reader, &header->type))
     return -EIO;
 
   if (header->type == NKS_TH_ENCRYPTED_FILE)
@@ -71,24 +75,40 @@ nks_read_0100_entry_header (int fd, Nks0100EntryHeader *header)
   return 0;
 }
 
-int
-nks_read_0110_entry_header (int fd, Nks0110EntryHeader *header)
+/* Reads everything but the name. */
+static int
+read_0110_entry_fields (NksReader *reader, Nks0110EntryHeader *header)
 {
-  if (read (fd, header->unknown, 0x02) != 0x02)
+  if (!nks_reader_read (reader, header->unknown, 0x02))
     return -EIO;
 
-  if (!read_u32_le (fd, &header->offset))
+  if (!nks_reader_read_u32_le (reader, &header->offset))
     return -EIO;
 
-  if (!read_u16_le (fd, &header->type))
-    return -EIO;
-
-  if (!read_utf16_le_string (fd, &header->name))
+  if (!nks_reader_read_u16_le (reader, &header->type))
     return -EIO;
 
   if (header->type == NKS_TH_ENCRYPTED_FILE)
     header->offset = decode_offset (header->offset);
 
+  header->name = NULL;
+
+  return 0;
+}
+
+int
+nks_reader_read_0110_entry_header (NksReader *reader,
+				   Nks0110EntryHeader *header)
+{
+  int r;
+
+  r = read_0110_entry_fields (reader, header);
+  if (r != 0)
+    return r;
+
+  if (!nks_reader_read_utf16_le_string (reader, &header->name))
+    return -EIO;
+
   return 0;
 }
 
@@ -154,59 +174,100 @@ nks_read_0110_nks_entry (int fd, NksDirectoryHeader *dir, NksEntry *ent)
   return 0;
 }
 
+/* The name of a 0x0110 entry is appended to ent->units, which must be empty,
+ * as is; it is only converted when needed. */
 int
-nks_read_file_header (int fd, NksFileHeader *ret)
+nks_reader_read_raw_entry (NksReader *reader, const NksDirectoryHeader *dir,
+			   NksRawEntry *ent)
+{
+  Nks0100EntryHeader hdr_0100;
+  Nks0110EntryHeader hdr_0110;
+  int r;
+
+  switch (dir->version)
+    {
+    case 0x0100:
+      r = nks_reader_read_0100_entry_header (reader, &hdr_0100);
+      if (r != 0)
+	return r;
+
+      memcpy (ent->name, hdr_0100.name, sizeof (ent->name));
+      ent->offset = hdr_0100.offset;
+      ent->type	  = type_hint_to_entry_type (hdr_0100.type);
+      return 0;
+
+    case 0x0110:
+      r = read_0110_entry_fields (reader, &hdr_0110);
+      if (r != 0)
+	return r;
+
+      if (!nks_reader_read_utf16_le_units (reader, ent->units))
+	return -EIO;
+
+      ent->name[0] = 0;
+      ent->offset  = hdr_0110.offset;
+      ent->type	   = type_hint_to_entry_type (hdr_0110.type);
+      return 0;
+
+    default:
+      return -ENOTSUP;
+    }
+}
+
+int
+nks_reader_read_file_header (NksReader *reader, NksFileHeader *ret)
 {
   uint32_t magic;
 
-  if (!read_u32_le (fd, &magic))
+  if (!nks_reader_read_u32_le (reader, &magic))
     return -EIO;
 
   if (magic != NKS_MAGIC_FILE)
     return -EILSEQ;
 
-  if (!read_u16_le (fd, &ret->version))
+  if (!nks_reader_read_u16_le (reader, &ret->version))
     return -EIO;
 
-  if (read (fd, ret->unknown_1, 13) != 13)
+  if (!nks_reader_read (reader, ret->unknown_1, 13))
     return -EIO;
 
-  if (!read_u32_le (fd, &ret->size))
+  if (!nks_reader_read_u32_le (reader, &ret->size))
     return -EIO;
 
-  if (read (fd, ret->unknown_2, 4) != 4)
+  if (!nks_reader_read (reader, ret->unknown_2, 4))
     return -EIO;
 
   return 0;
 }
 
 int
-nks_read_encrypted_file_header (int fd, NksEncryptedFileHeader *ret)
+nks_reader_read_encrypted_file_header (NksReader *reader,
+				       NksEncryptedFileHeader *ret)
 {
   uint32_t magic;
 
-  if (!read_u32_le (fd, &magic))
+  if (!nks_reader_read_u32_le (reader, &magic))
     return -EIO;
   
   if (magic != NKS_MAGIC_ENCRYPTED_FILE)
     return -EILSEQ;
 
-  if (!read_u16_le (fd, &ret->version))
+  if (!nks_reader_read_u16_le (reader, &ret->version))
     return -EIO;
 
-  if (!read_u32_le (fd, &ret->set_id))
+  if (!nks_reader_read_u32_le (reader, &ret->set_id))
     return -EIO;
 
-  if (!read_u32_le (fd, &ret->key_index))
+  if (!nks_reader_read_u32_le (reader, &ret->key_index))
     return -EIO;
 
-  if (read (fd, ret->unknown_1, 0x05) != 0x05)
+  if (!nks_reader_read (reader, ret->unknown_1, 0x05))
     return -EIO;
 
-  if (!read_u32_le (fd, &ret->size))
+  if (!nks_reader_read_u32_le (reader, &ret->size))
     return -EIO;
 
-  if (read (fd, ret->unknown_2, 0x08) != 0x08)
+  if (!nks_reader_read (reader, ret->unknown_2, 0x08))
     return -EIO;
 
   switch (ret->version)
@@ -221,3 +282,212 @@ nks_read_encrypted_file_header (int fd, NksEncryptedFileHeader *ret)
 
   return 0;
 }
+
+/* The file descriptor versions read through a reader of their own, starting
+ * at the current position of fd and leaving it just after what was read. */
+static bool
+fd_reader_init (NksReader *reader, int fd)
+{
+  off_t offset;
+
+  offset = lseek (fd, 0, SEEK_CUR);
+  if (offset < 0)
+    return false;
+
+  nks_reader_init (reader, fd);
+  nks_reader_seek (reader, offset);
+
+  return true;
+}
+
+static int
+fd_reader_finish (NksReader *reader, int r)
+{
+  if (lseek (reader->fd, nks_reader_tell (reader), SEEK_SET) < 0 && r == 0)
+    r = -errno;
+
+  nks_reader_clear (reader);
+
+  return r;
+}
+
+int
+nks_read_directory_header (int fd, NksDirectoryHeader *header)
+{
+  NksReader reader;
+
+  if (!fd_reader_init (&reader, fd))
+    return -errno;
+
+  return fd_reader_finish (&reader,
+			   nks_reader_read_directory_header (&reader, header));
+}
+
+int
+nks_read_0100_entry_header (int fd, Nks0100EntryHeader *header)
+{
+  NksReader reader;
+
+  if (!fd_reader_init (&reader, fd))
+    return -errno;
+
+  return fd_reader_finish (&reader,
+			   nks_reader_read_0100_entry_header (&reader, header));
+}
+
+int
+nks_read_0110_entry_header (int fd, Nks0110EntryHeader *header)
+{
+  NksReader reader;
+  int r, s;
+
+  if (!fd_reader_init (&reader, fd))
+    return -errno;
+
+  r = nks_reader_read_0110_entry_header (&reader, header);
+  s = fd_reader_finish (&reader, r);
+  if (s != r)
+    nks_0110_entry_header_free (header);
+
+  return s;
+}
+
+int
+nks_read_file_header (int fd, NksFileHeader *ret)
+{
+  NksReader reader;
+
+  if (!fd_reader_init (&reader, fd))
+    return -errno;
+
+  return fd_reader_finish (&reader,
+			   nks_reader_read_file_header (&reader, ret));
+}
+
+int
+nks_read_encrypted_file_header (int fd, NksEncryptedFileHeader *ret)
+{
+  NksReader reader;
+
+  if (!fd_reader_init (&reader, fd))
+    return -errno;
+
+  return fd_reader_finish (&reader,
+			   nks_reader_read_encrypted_file_header (&reader, ret));
+}
+
+static void
+put_u16_le (GByteArray *out, uint16_t value)
+{
+  uint8_t tmp[2] = { value & 0xff, value >> 8 };
+
+  g_byte_array_append (out, tmp, sizeof (tmp));
+}
+
+static void
+put_u32_le (GByteArray *out, uint32_t value)
+{
+  uint8_t tmp[4] = { value & 0xff, (value >> 8) & 0xff,
+		     (value >> 16) & 0xff, value >> 24 };
+
+  g_byte_array_append (out, tmp, sizeof (tmp));
+}
+
+void
+nks_write_directory_header (GByteArray *out, const NksDirectoryHeader *header)
+{
+  put_u32_le (out, NKS_MAGIC_DIRECTORY);
+  put_u16_le (out, header->version);
+  put_u32_le (out, header->set_id);
+  g_byte_array_append (out, header->unknown_0, 0x04);
+  put_u32_le (out, header->entry_count);
+  g_byte_array_append (out, header->unknown_1, 0x04);
+}
+
+void
+nks_write_0100_entry_header (GByteArray *out, const Nks0100EntryHeader *header)
+{
+  uint8_t name[128];
+
+  /* Longer names would lose their terminator. */
+  g_assert (strlen (header->name) < sizeof (name));
+
+  memset (name, 0, sizeof (name));
+  memcpy (name, header->name, strlen (header->name));
+
+  g_byte_array_append (out, name, sizeof (name));
+  g_byte_array_append (out, header->unknown, 0x01);
+
+  if (header->type == NKS_TH_ENCRYPTED_FILE)
+    put_u32_le (out, decode_offset (header->offset));
+  else
+    put_u32_le (out, header->offset);
+
+  put_u16_le (out, header->type);
+}
+
+int
+nks_write_0110_entry_header (GByteArray *out, const Nks0110EntryHeader *header)
+{
+  gunichar2 *name;
+  glong len;
+  glong n;
+
+  name = g_utf8_to_utf16 (header->name, -1, NULL, &len, NULL);
+  if (name == NULL)
+    return -EILSEQ;
+
+  g_byte_array_append (out, header->unknown, 0x02);
+
+  if (header->type == NKS_TH_ENCRYPTED_FILE)
+    put_u32_le (out, decode_offset (header->offset));
+  else
+    put_u32_le (out, header->offset);
+
+  put_u16_le (out, header->type);
+
+  for (n = 0; n <= len; n++)
+    put_u16_le (out, name[n]);
+
+  g_free (name);
+
+  return 0;
+}
+
+size_t
+nks_0110_entry_header_size (const char *name)
+{
+  gunichar2 *utf16;
+  glong len;
+
+  utf16 = g_utf8_to_utf16 (name, -1, NULL, &len, NULL);
+  if (utf16 == NULL)
+    return 0;
+
+  g_free (utf16);
+
+  return 8 + 2 * (len + 1);
+}
+
+void
+nks_write_file_header (GByteArray *out, const NksFileHeader *header)
+{
+  put_u32_le (out, NKS_MAGIC_FILE);
+  put_u16_le (out, header->version);
+  g_byte_array_append (out, header->unknown_1, 13);
+  put_u32_le (out, header->size);
+  g_byte_array_append (out, header->unknown_2, 4);
+}
+
+void
+nks_write_encrypted_file_header (GByteArray *out,
+				 const NksEncryptedFileHeader *header)
+{
+  put_u32_le (out, NKS_MAGIC_ENCRYPTED_FILE);
+  put_u16_le (out, header->version);
+  put_u32_le (out, header->set_id);
+  put_u32_le (out, header->key_index);
+  g_byte_array_append (out, header->unknown_1, 0x05);
+  put_u32_le (out, header->size);
+  g_byte_array_append (out, header->unknown_2, 0x08);
+}
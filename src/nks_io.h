@@ -1,14 +1,22 @@
 #ifndef NKS_IO_H
 #define NKS_IO_H
 
+#include <glib.h>
 #include <stdint.h>
 
 #include "nks.h"
+#include "nks_reader.h"
 
 #define NKS_MAGIC_DIRECTORY	 UINT32_C (0x5e70ac54)
 #define NKS_MAGIC_ENCRYPTED_FILE UINT32_C (0x16ccf80a)
 #define NKS_MAGIC_FILE		 UINT32_C (0x4916e63c)
 
+/* Sizes of the headers as stored in archives */
+#define NKS_DIRECTORY_HEADER_SIZE      22
+#define NKS_0100_ENTRY_HEADER_SIZE     135
+#define NKS_FILE_HEADER_SIZE	       27
+#define NKS_ENCRYPTED_FILE_HEADER_SIZE 31
+
 typedef struct
 {
   uint16_t version;
@@ -41,6 +49,15 @@ typedef struct
   char 	  *name;
 } Nks0110EntryHeader;
 
+/* A directory entry whose name has not been decoded yet. */
+typedef struct
+{
+  NksEntryType type;
+  off_t	       offset;
+  char	       name[129];	/* Name of 0x0100 entries */
+  GByteArray  *units;		/* UTF-16LE name of 0x0110 entries */
+} NksRawEntry;
+
 typedef struct
 {
   uint16_t version;
@@ -69,4 +86,29 @@ int nks_read_0110_nks_entry (int fd, NksDirectoryHeader *dir, NksEntry *ent);
 int nks_read_encrypted_file_header (int fd, NksEncryptedFileHeader *ret);
 int nks_read_file_header (int fd, NksFileHeader *ret);
 
+/* The same, reading through a reader; these are not exported. */
+int nks_reader_read_directory_header (NksReader *reader,
+				      NksDirectoryHeader *header);
+int nks_reader_read_0100_entry_header (NksReader *reader,
+				       Nks0100EntryHeader *header);
+int nks_reader_read_0110_entry_header (NksReader *reader,
+				       Nks0110EntryHeader *header);
+int nks_reader_read_raw_entry (NksReader *reader,
+			       const NksDirectoryHeader *dir,
+			       NksRawEntry *ent);
+int nks_reader_read_encrypted_file_header (NksReader *reader,
+					   NksEncryptedFileHeader *ret);
+int nks_reader_read_file_header (NksReader *reader, NksFileHeader *ret);
+
+void nks_write_directory_header (GByteArray *out,
+				 const NksDirectoryHeader *header);
+void nks_write_0100_entry_header (GByteArray *out,
+				  const Nks0100EntryHeader *header);
+int nks_write_0110_entry_header (GByteArray *out,
+				 const Nks0110EntryHeader *header);
+size_t nks_0110_entry_header_size (const char *name);
+void nks_write_file_header (GByteArray *out, const NksFileHeader *header);
+void nks_write_encrypted_file_header (GByteArray *out,
+				      const NksEncryptedFileHeader *header);
+
 #endif
@@ -0,0 +1,480 @@
+#include <glib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+# include <sys/mman.h>
+#endif
+
+#include "nks_reader.h"
+#include "nks_stats.h"
+#include "nks_utf16.h"
+#include "util.h"
+
+static void
+init_buffered (NksReader *reader, int fd, uint8_t *buffer, bool owns_buffer)
+{
+  reader->fd	      = fd;
+  reader->fd_offset   = -1;
+  reader->buffer      = buffer;
+  reader->owns_buffer = owns_buffer;
+  reader->window      = reader->buffer;
+  reader->buf_offset  = 0;
+  reader->buf_len     = 0;
+  reader->buf_pos     = 0;
+  reader->map	      = NULL;
+  reader->map_size    = 0;
+  reader->owns_map    = false;
+  reader->stream      = false;
+  reader->stats	      = NULL;
+}
+
+void
+nks_reader_init (NksReader *reader, int fd)
+{
+  init_buffered (reader, fd, g_malloc (NKS_READER_BUFFER_SIZE), true);
+}
+
+bool
+nks_reader_init_mmap (NksReader *reader, int fd)
+{
+#if defined HAVE_MMAP && defined HAVE_SYS_MMAN_H
+  struct stat st;
+  void *map;
+
+  if (fstat (fd, &st) != 0 || !S_ISREG (st.st_mode) || st.st_size <= 0)
+    return false;
+
+  if ((uintmax_t) st.st_size > SIZE_MAX)
+    return false;
+
+  map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+    return false;
+
+  reader->fd	      = fd;
+  reader->fd_offset   = -1;
+  reader->buffer      = NULL;
+  reader->owns_buffer = false;
+  reader->window      = map;
+  reader->buf_offset  = 0;
+  reader->buf_len     = st.st_size;
+  reader->buf_pos     = 0;
+  reader->map	      = map;
+  reader->map_size    = st.st_size;
+  reader->owns_map    = true;
+  reader->stream      = false;
+  reader->stats	      = NULL;
+
+  return true;
+#else
+  return false;
+#endif
+}
+
+void
+nks_reader_init_stream (NksReader *reader, int fd)
+{
+  nks_reader_init (reader, fd);
+
+  /* The archive starts wherever the stream is now. */
+  reader->fd_offset = 0;
+  reader->stream    = true;
+}
+
+void
+nks_reader_init_cursor (NksReader *cursor, const NksReader *source,
+			void *buffer)
+{
+  if (source->map == NULL)
+    {
+      if (buffer != NULL)
+	init_buffered (cursor, source->fd, buffer, false);
+      else
+	nks_reader_init (cursor, source->fd);
+
+      cursor->stats = source->stats;
+      return;
+    }
+
+  *cursor = *source;
+  cursor->buf_pos  = 0;
+  cursor->owns_map = false;
+}
+
+void
+nks_reader_clear (NksReader *reader)
+{
+#if defined HAVE_MMAP && defined HAVE_SYS_MMAN_H
+  if (reader->map != NULL && reader->owns_map)
+    munmap (reader->map, reader->map_size);
+#endif
+
+  if (reader->owns_buffer)
+    g_free (reader->buffer);
+
+  memset (reader, 0, sizeof (*reader));
+  reader->fd = -1;
+}
+
+bool
+nks_reader_is_mapped (const NksReader *reader)
+{
+  return (reader->map != NULL);
+}
+
+bool
+nks_reader_is_stream (const NksReader *reader)
+{
+  return reader->stream;
+}
+
+static ssize_t
+count_read (NksReader *reader, ssize_t count)
+{
+  NKS_STATS_ADD (reader->stats, read_calls, 1);
+  if (count > 0)
+    NKS_STATS_ADD (reader->stats, bytes_read, count);
+
+  return count;
+}
+
+/* Moves the cursor forward within the window.  Reads from a mapping make no
+ * system calls, so they are counted here instead. */
+static void
+consume (NksReader *reader, size_t count)
+{
+  reader->buf_pos += count;
+
+  if (reader->map != NULL)
+    NKS_STATS_ADD (reader->stats, bytes_read, count);
+}
+
+static ssize_t
+read_at (NksReader *reader, void *buffer, size_t size, off_t offset)
+{
+  if (reader->stream)
+    {
+      ssize_t count;
+
+      if (offset != reader->fd_offset)
+	{
+	  errno = ESPIPE;
+	  return -1;
+	}
+
+      do
+	count = count_read (reader, read (reader->fd, buffer, size));
+      while (count < 0 && errno == EINTR);
+
+      if (count > 0)
+	reader->fd_offset += count;
+
+      return count;
+    }
+
+#ifdef HAVE_PREAD
+  return count_read (reader, pread (reader->fd, buffer, size, offset));
+#else
+  ssize_t count;
+
+  if (reader->fd_offset != offset)
+    {
+      NKS_STATS_ADD (reader->stats, seek_calls, 1);
+
+      if (lseek (reader->fd, offset, SEEK_SET) < 0)
+	{
+	  reader->fd_offset = -1;
+	  return -1;
+	}
+
+      reader->fd_offset = offset;
+    }
+
+  count = count_read (reader, read (reader->fd, buffer, size));
+  if (count <= 0)
+    reader->fd_offset = -1;
+  else
+    reader->fd_offset += count;
+
+  return count;
+#endif
+}
+
+static bool
+refill (NksReader *reader)
+{
+  off_t offset;
+  ssize_t count;
+  size_t keep = 0;
+
+  /* A mapping already covers the whole file. */
+  if (reader->map != NULL)
+    return false;
+
+  offset = nks_reader_tell (reader);
+
+  /* A stream cannot be read again, so keep the tail of the window around
+   * for parsers which look at a few bytes and then seek back. */
+  if (reader->stream)
+    {
+      keep = MIN (reader->buf_pos, NKS_READER_LOOKBEHIND);
+      memmove (reader->buffer, reader->buffer + reader->buf_pos - keep, keep);
+
+      reader->buf_offset = offset - keep;
+      reader->buf_len    = keep;
+      reader->buf_pos    = keep;
+    }
+
+  count = read_at (reader, reader->buffer + keep,
+		   NKS_READER_BUFFER_SIZE - keep, offset);
+  if (count <= 0)
+    return false;
+
+  reader->buf_offset = offset - keep;
+  reader->buf_len    = keep + count;
+  reader->buf_pos    = keep;
+
+  return true;
+}
+
+bool
+nks_reader_seek (NksReader *reader, off_t offset)
+{
+  if (offset < 0)
+    return false;
+
+  if (offset >= reader->buf_offset
+      && offset <= reader->buf_offset + (off_t) reader->buf_len)
+    {
+      reader->buf_pos = offset - reader->buf_offset;
+      return true;
+    }
+
+  if (reader->map != NULL)
+    return false;
+
+  reader->buf_offset = offset;
+  reader->buf_len    = 0;
+  reader->buf_pos    = 0;
+
+  return true;
+}
+
+off_t
+nks_reader_tell (const NksReader *reader)
+{
+  return reader->buf_offset + reader->buf_pos;
+}
+
+/* Makes the window of a stream hold the tail of what it consumed, ending
+ * with the count bytes of data just read past the window. */
+static void
+keep_lookbehind (NksReader *reader, const uint8_t *data, size_t count)
+{
+  size_t new_keep = MIN (count, NKS_READER_LOOKBEHIND);
+  size_t old_keep = MIN (reader->buf_pos, NKS_READER_LOOKBEHIND - new_keep);
+  off_t end = nks_reader_tell (reader) + count;
+
+  memmove (reader->buffer, reader->buffer + reader->buf_pos - old_keep,
+	   old_keep);
+  memcpy (reader->buffer + old_keep, data + count - new_keep, new_keep);
+
+  reader->buf_len    = old_keep + new_keep;
+  reader->buf_pos    = reader->buf_len;
+  reader->buf_offset = end - reader->buf_len;
+}
+
+bool
+nks_reader_read (NksReader *reader, void *buffer, size_t size)
+{
+  uint8_t *bp = buffer;
+  size_t avail;
+  ssize_t count;
+  off_t offset;
+
+  while (size > 0)
+    {
+      avail = reader->buf_len - reader->buf_pos;
+
+      if (avail == 0 && reader->map == NULL
+	  && size >= NKS_READER_BUFFER_SIZE)
+	{
+	  /* Large reads bypass the window entirely. */
+	  offset = nks_reader_tell (reader);
+
+	  count = read_at (reader, bp, size, offset);
+	  if (count <= 0)
+	    return false;
+
+	  if (reader->stream)
+	    keep_lookbehind (reader, bp, count);
+	  else
+	    {
+	      reader->buf_offset = offset + count;
+	      reader->buf_len	 = 0;
+	      reader->buf_pos	 = 0;
+	    }
+
+	  bp   += count;
+	  size -= count;
+	  continue;
+	}
+
+      if (avail == 0)
+	{
+	  if (!refill (reader))
+	    return false;
+
+	  avail = reader->buf_len - reader->buf_pos;
+	}
+
+      avail = MIN (avail, size);
+      memcpy (bp, reader->window + reader->buf_pos, avail);
+
+      consume (reader, avail);
+      bp   += avail;
+      size -= avail;
+    }
+
+  return true;
+}
+
+const void *
+nks_reader_borrow (NksReader *reader, size_t size)
+{
+  const uint8_t *p;
+
+  if (reader->buf_len - reader->buf_pos < size)
+    return NULL;
+
+  p = reader->window + reader->buf_pos;
+  consume (reader, size);
+
+  return p;
+}
+
+bool
+nks_reader_read_string (NksReader *reader, char *ret, size_t size)
+{
+  if (size == 0)
+    return false;
+
+  if (!nks_reader_read (reader, ret, size - 1))
+    return false;
+
+  ret[size - 1] = 0;
+  return true;
+}
+
+bool
+nks_reader_read_utf16_le_units (NksReader *reader, GByteArray *units)
+{
+  const uint8_t *p;
+  uint8_t c[2];
+  size_t avail;
+  size_t n;
+
+  for (;;)
+    {
+      /* Look for the terminator in the window first. */
+      p = reader->window + reader->buf_pos;
+      avail = reader->buf_len - reader->buf_pos;
+
+      for (n = 0; n + 2 <= avail; n += 2)
+	{
+	  if (p[n] == 0 && p[n + 1] == 0)
+	    {
+	      g_byte_array_append (units, p, n);
+	      consume (reader, n + 2);
+	      return true;
+	    }
+	}
+
+      g_byte_array_append (units, p, n);
+      consume (reader, n);
+
+      /* The next unit crosses the end of the window. */
+      if (!nks_reader_read (reader, c, sizeof (c)))
+	return false;
+
+      if (c[0] == 0 && c[1] == 0)
+	return true;
+
+      g_byte_array_append (units, c, sizeof (c));
+    }
+}
+
+bool
+nks_reader_read_utf16_le_string (NksReader *reader, char **ret)
+{
+  GByteArray *units;
+  char *str;
+
+  units = g_byte_array_new ();
+
+  if (!nks_reader_read_utf16_le_units (reader, units))
+    goto err;
+
+  str = g_malloc (NKS_UTF16_UTF8_SIZE (units->len / 2));
+  if (nks_utf16_le_to_utf8 (units->data, units->len / 2, str) < 0)
+    {
+      g_free (str);
+      goto err;
+    }
+
+  *ret = str;
+
+  g_byte_array_free (units, true);
+  return true;
+
+err:
+  g_byte_array_free (units, true);
+  return false;
+}
+
+bool
+nks_reader_read_u32_le (NksReader *reader, uint32_t *ret)
+{
+  uint8_t tmp[4];
+  const uint8_t *p;
+
+  if (reader->buf_len - reader->buf_pos >= sizeof (tmp))
+    {
+      p = reader->window + reader->buf_pos;
+      consume (reader, sizeof (tmp));
+    }
+  else
+    {
+      if (!nks_reader_read (reader, tmp, sizeof (tmp)))
+	return false;
+
+      p = tmp;
+    }
+
+  *ret = (uint32_t) p[0] | ((uint32_t) p[1] << 8)
+	 | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+  return true;
+}
+
+bool
+nks_reader_read_u16_le (NksReader *reader, uint16_t *ret)
+{
+  uint8_t tmp[2];
+  const uint8_t *p;
+
+  if (reader->buf_len - reader->buf_pos >= sizeof (tmp))
+    {
+      p = reader->window + reader->buf_pos;
+      consume (reader, sizeof (tmp));
+    }
+  else
+    {
+      if (!nks_reader_read (reader, tmp, sizeof (tmp)))
+	return false;
+
+      p = tmp;
+    }
+
+  *ret = (uint16_t) (p[0] | (p[1] << 8));
+  return true;
+}
@@ -0,0 +1,74 @@
+#ifndef NKS_READER_H
+#define NKS_READER_H
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "nks.h"
+
+#define NKS_READER_BUFFER_SIZE 0x10000
+
+/* How much already consumed data a stream reader keeps in its window. */
+#define NKS_READER_LOOKBEHIND 0x1000
+
+/*
+ * A buffered, seekable view of an archive file descriptor.  Reads are served
+ * from a window of the file which is refilled with one large read() when the
+ * cursor leaves it, so that parsing a directory table costs a handful of
+ * system calls instead of several per entry.
+ *
+ * A reader may instead be backed by a read-only mapping of the whole file, in
+ * which case the window is the mapping itself and is never refilled.
+ *
+ * Where pread() is available, readers never use the file position of fd, so
+ * independent cursors created with nks_reader_init_cursor may read the same
+ * descriptor from several threads at once.  Cursors share the mapping of the
+ * reader they were created from; otherwise they read into the buffer given,
+ * of NKS_READER_BUFFER_SIZE bytes and still owned by the caller, or into one
+ * of their own if it is NULL.
+ *
+ * A stream reader reads a pipe or other non-seekable descriptor strictly
+ * forward.  It can seek anywhere within its window, which always still holds
+ * the last NKS_READER_LOOKBEHIND bytes consumed, but not beyond it; skipping
+ * ahead means reading.
+ */
+typedef struct
+{
+  int		 fd;
+  off_t		 fd_offset;	/* Current position of fd, or -1 if unknown */
+  const uint8_t *window;	/* Either buffer or map */
+  off_t		 buf_offset;	/* File offset of window[0] */
+  size_t	 buf_len;	/* Number of valid bytes in window */
+  size_t	 buf_pos;	/* Cursor position within window */
+  uint8_t	*buffer;
+  bool		 owns_buffer;
+  void		*map;
+  size_t	 map_size;
+  bool		 owns_map;
+  bool		 stream;
+  NksStats	*stats;		/* Counters to update, or NULL */
+} NksReader;
+
+void nks_reader_init (NksReader *reader, int fd);
+bool nks_reader_init_mmap (NksReader *reader, int fd);
+void nks_reader_init_stream (NksReader *reader, int fd);
+void nks_reader_init_cursor (NksReader *cursor, const NksReader *source,
+			     void *buffer);
+void nks_reader_clear (NksReader *reader);
+bool nks_reader_is_mapped (const NksReader *reader);
+bool nks_reader_is_stream (const NksReader *reader);
+bool nks_reader_seek (NksReader *reader, off_t offset);
+off_t nks_reader_tell (const NksReader *reader);
+bool nks_reader_read (NksReader *reader, void *buffer, size_t size);
+const void *nks_reader_borrow (NksReader *reader, size_t size);
+
+bool nks_reader_read_string (NksReader *reader, char *ret, size_t size);
+bool nks_reader_read_utf16_le_units (NksReader *reader, GByteArray *units);
+bool nks_reader_read_utf16_le_string (NksReader *reader, char **ret);
+bool nks_reader_read_u32_le (NksReader *reader, uint32_t *ret);
+bool nks_reader_read_u16_le (NksReader *reader, uint16_t *ret);
+
+#endif
@@ -0,0 +1,171 @@
+#include <glib.h>
+#include <string.h>
+
+#include "nks_spill.h"
+#include "util.h"
+
+typedef struct
+{
+  off_t	      offset;
+  GByteArray *data;
+} SpillChunk;
+
+struct NksSpill
+{
+  GArray *chunks;	/* SpillChunk, while in memory */
+  size_t  memory_size;
+  size_t  memory_limit;
+  int	  fd;		/* Temporary file, or -1 */
+  char	 *file_name;	/* Name of the file until it is unlinked */
+};
+
+NksSpill *
+nks_spill_new (size_t memory_limit)
+{
+  NksSpill *spill;
+
+  spill = g_malloc0 (sizeof (*spill));
+  spill->chunks	      = g_array_new (false, false, sizeof (SpillChunk));
+  spill->memory_limit = memory_limit;
+  spill->fd	      = -1;
+
+  return spill;
+}
+
+static void
+free_chunks (NksSpill *spill)
+{
+  guint n;
+
+  for (n = 0; n < spill->chunks->len; n++)
+    g_byte_array_free (g_array_index (spill->chunks, SpillChunk, n).data,
+		       true);
+
+  g_array_set_size (spill->chunks, 0);
+  spill->memory_size = 0;
+}
+
+void
+nks_spill_free (NksSpill *spill)
+{
+  if (spill == NULL)
+    return;
+
+  free_chunks (spill);
+  g_array_free (spill->chunks, true);
+
+  if (spill->fd >= 0)
+    close (spill->fd);
+
+  if (spill->file_name != NULL)
+    {
+      unlink (spill->file_name);
+      g_free (spill->file_name);
+    }
+
+  g_free (spill);
+}
+
+static int
+write_to_file (NksSpill *spill, off_t offset, const void *data, size_t size)
+{
+  const uint8_t *bp = data;
+  ssize_t count;
+
+  if (lseek (spill->fd, offset, SEEK_SET) < 0)
+    return -errno;
+
+  while (size > 0)
+    {
+      count = write (spill->fd, bp, size);
+      if (count < 0 && errno == EINTR)
+	continue;
+
+      if (count <= 0)
+	return -EIO;
+
+      bp   += count;
+      size -= count;
+    }
+
+  return 0;
+}
+
+int
+nks_spill_get_fd (NksSpill *spill)
+{
+  SpillChunk *chunk;
+  guint n;
+  int r;
+
+  if (spill->fd < 0)
+    {
+      spill->fd = g_file_open_tmp ("nks-spill-XXXXXX", &spill->file_name,
+				   NULL);
+      if (spill->fd < 0)
+	return -EIO;
+
+#ifdef __unix__
+      /* Nothing else needs the name, and the file then goes away on its
+       * own however the process ends. */
+      if (unlink (spill->file_name) == 0)
+	{
+	  g_free (spill->file_name);
+	  spill->file_name = NULL;
+	}
+#endif
+    }
+
+  for (n = 0; n < spill->chunks->len; n++)
+    {
+      chunk = &g_array_index (spill->chunks, SpillChunk, n);
+
+      r = write_to_file (spill, chunk->offset, chunk->data->data,
+			 chunk->data->len);
+      if (r != 0)
+	return r;
+    }
+
+  free_chunks (spill);
+
+  return spill->fd;
+}
+
+int
+nks_spill_write (NksSpill *spill, off_t offset, const void *data, size_t size)
+{
+  SpillChunk *last = NULL;
+  SpillChunk chunk;
+  int r;
+
+  if (size == 0)
+    return 0;
+
+  if (spill->fd < 0 && spill->memory_size + size > spill->memory_limit)
+    {
+      r = nks_spill_get_fd (spill);
+      if (r < 0)
+	return r;
+    }
+
+  if (spill->fd >= 0)
+    return write_to_file (spill, offset, data, size);
+
+  if (spill->chunks->len > 0)
+    last = &g_array_index (spill->chunks, SpillChunk, spill->chunks->len - 1);
+
+  /* Skipped ranges mostly follow each other directly. */
+  if (last != NULL && last->offset + (off_t) last->data->len == offset)
+    g_byte_array_append (last->data, data, size);
+  else
+    {
+      chunk.offset = offset;
+      chunk.data   = g_byte_array_sized_new (size);
+      g_byte_array_append (chunk.data, data, size);
+      g_array_append_val (spill->chunks, chunk);
+    }
+
+  spill->memory_size += size;
+
+  return 0;
+}
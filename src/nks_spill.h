@@ -0,0 +1,26 @@
+#ifndef NKS_SPILL_H
+#define NKS_SPILL_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Keeps the parts of a streamed archive which were read past before anything
+ * was known to refer to them.  Data is held in memory up to a limit, and is
+ * then moved to an unlinked temporary file where every byte sits at its
+ * offset in the archive, so that an ordinary reader on that file can parse
+ * the spilled parts as if it were the archive itself.
+ */
+typedef struct NksSpill NksSpill;
+
+NksSpill *nks_spill_new (size_t memory_limit);
+void nks_spill_free (NksSpill *spill);
+
+int nks_spill_write (NksSpill *spill, off_t offset, const void *data,
+		     size_t size);
+
+/* Moves everything to the temporary file, and returns its descriptor or a
+ * negative error code.  The descriptor belongs to the spill. */
+int nks_spill_get_fd (NksSpill *spill);
+
+#endif
@@ -0,0 +1,31 @@
+#include <glib.h>
+#include <time.h>
+
+#include "nks_stats.h"
+
+/* Returns a monotonic time in nanoseconds, or 0 without looking at the clock
+ * if nothing is counted. */
+uint64_t
+nks_stats_clock (const NksStats *stats)
+{
+  struct timespec ts;
+
+  if (stats == NULL)
+    return 0;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+nks_stats_copy (const NksStats *stats, NksStats *ret)
+{
+  const uint64_t *src = (const uint64_t *) stats;
+  uint64_t *dst = (uint64_t *) ret;
+  size_t n;
+
+  G_STATIC_ASSERT (sizeof (NksStats) % sizeof (uint64_t) == 0);
+
+  for (n = 0; n < sizeof (NksStats) / sizeof (uint64_t); n++)
+    dst[n] = __atomic_load_n (&src[n], __ATOMIC_RELAXED);
+}
@@ -0,0 +1,25 @@
+#ifndef NKS_STATS_H
+#define NKS_STATS_H
+
+#include <stdint.h>
+
+#include "nks.h"
+
+/* Counters are updated from several threads on reentrant archives.  stats
+ * is NULL unless the archive was opened with NKS_OPEN_STATS. */
+#define NKS_STATS_ADD(stats, field, n)					\
+  do									\
+    {									\
+      if ((stats) != NULL)						\
+	__atomic_fetch_add (&(stats)->field, (n), __ATOMIC_RELAXED);	\
+    }									\
+  while (0)
+
+/* Adds the time since start, taken with nks_stats_clock, to field. */
+#define NKS_STATS_ADD_TIME(stats, field, start)				\
+  NKS_STATS_ADD (stats, field, nks_stats_clock (stats) - (start))
+
+uint64_t nks_stats_clock (const NksStats *stats);
+void nks_stats_copy (const NksStats *stats, NksStats *ret);
+
+#endif
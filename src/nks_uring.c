@@ -0,0 +1,393 @@
+#include <glib.h>
+#include <string.h>
+
+#if defined HAVE_LINUX_IO_URING_H && defined HAVE_SYS_MMAN_H
+# include <linux/io_uring.h>
+# include <sys/mman.h>
+# include <sys/syscall.h>
+# include <sys/uio.h>
+#endif
+
+#include "nks_uring.h"
+#include "nks_xor.h"
+#include "util.h"
+
+#if defined HAVE_LINUX_IO_URING_H && defined HAVE_SYS_MMAN_H \
+    && defined __NR_io_uring_setup
+
+#define URING_DEPTH	 8
+#define URING_CHUNK_SIZE (256 * 1024)
+
+typedef struct
+{
+  off_t	 offset;	/* Offset of the chunk within the copied range */
+  size_t size;
+  size_t done;		/* Bytes of the chunk written so far */
+  bool	 writing;
+} UringSlot;
+
+typedef struct
+{
+  int		       fd;
+  void		      *sq_ring;
+  size_t	       sq_ring_size;
+  void		      *cq_ring;
+  size_t	       cq_ring_size;
+  struct io_uring_sqe *sqes;
+  size_t	       sqes_size;
+  unsigned int	      *sq_head;
+  unsigned int	      *sq_tail;
+  unsigned int	      *sq_mask;
+  unsigned int	      *sq_array;
+  unsigned int	      *cq_head;
+  unsigned int	      *cq_tail;
+  unsigned int	      *cq_mask;
+  struct io_uring_cqe *cqes;
+  uint8_t	      *buffers;
+  bool		       fixed;	/* Whether buffers are registered */
+  struct iovec	       iovecs[URING_DEPTH];	/* Used when they are not */
+} Uring;
+
+/* Set once a ring could not be set up, e.g. on an old kernel, under a
+ * seccomp filter or for lack of memory, so that no thread pays for trying
+ * again before every copy. */
+static gint uring_unavailable = 0;
+
+static void
+uring_free (Uring *ring)
+{
+  if (ring->sqes != NULL)
+    munmap (ring->sqes, ring->sqes_size);
+
+  if (ring->cq_ring != NULL && ring->cq_ring != ring->sq_ring)
+    munmap (ring->cq_ring, ring->cq_ring_size);
+
+  if (ring->sq_ring != NULL)
+    munmap (ring->sq_ring, ring->sq_ring_size);
+
+  if (ring->fd >= 0)
+    close (ring->fd);
+
+  g_free (ring->buffers);
+  g_free (ring);
+}
+
+static Uring *
+uring_new (void)
+{
+  struct io_uring_params params;
+  struct iovec iovecs[URING_DEPTH];
+  Uring *ring;
+  uint8_t *sq;
+  uint8_t *cq;
+  int n;
+
+  memset (&params, 0, sizeof (params));
+
+  ring = g_malloc0 (sizeof (*ring));
+  ring->fd = syscall (__NR_io_uring_setup, URING_DEPTH, &params);
+  if (ring->fd < 0)
+    goto err;
+
+  ring->sq_ring_size = params.sq_off.array
+		       + params.sq_entries * sizeof (unsigned int);
+  ring->cq_ring_size = params.cq_off.cqes
+		       + params.cq_entries * sizeof (struct io_uring_cqe);
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+      ring->sq_ring_size = MAX (ring->sq_ring_size, ring->cq_ring_size);
+      ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+  ring->sq_ring = mmap (NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd,
+			IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED)
+    {
+      ring->sq_ring = NULL;
+      goto err;
+    }
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    ring->cq_ring = ring->sq_ring;
+  else
+    {
+      ring->cq_ring = mmap (NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->fd,
+			    IORING_OFF_CQ_RING);
+      if (ring->cq_ring == MAP_FAILED)
+	{
+	  ring->cq_ring = NULL;
+	  goto err;
+	}
+    }
+
+  ring->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+  ring->sqes = mmap (NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+    {
+      ring->sqes = NULL;
+      goto err;
+    }
+
+  sq = ring->sq_ring;
+  ring->sq_head	 = (unsigned int *) (sq + params.sq_off.head);
+  ring->sq_tail	 = (unsigned int *) (sq + params.sq_off.tail);
+  ring->sq_mask	 = (unsigned int *) (sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned int *) (sq + params.sq_off.array);
+
+  cq = ring->cq_ring;
+  ring->cq_head = (unsigned int *) (cq + params.cq_off.head);
+  ring->cq_tail = (unsigned int *) (cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned int *) (cq + params.cq_off.ring_mask);
+  ring->cqes	= (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+  /* Registered buffers spare the kernel from pinning pages on every I/O.
+   * They count against RLIMIT_MEMLOCK on older kernels, though, so if they
+   * are refused the same buffers are passed with every request instead. */
+  ring->buffers = g_malloc (URING_DEPTH * URING_CHUNK_SIZE);
+
+  for (n = 0; n < URING_DEPTH; n++)
+    {
+      iovecs[n].iov_base = ring->buffers + n * URING_CHUNK_SIZE;
+      iovecs[n].iov_len	 = URING_CHUNK_SIZE;
+    }
+
+  ring->fixed = (syscall (__NR_io_uring_register, ring->fd,
+			  IORING_REGISTER_BUFFERS, iovecs, URING_DEPTH) == 0);
+
+  return ring;
+
+err:
+  g_atomic_int_set (&uring_unavailable, 1);
+  uring_free (ring);
+  return NULL;
+}
+
+static GPrivate uring_key = G_PRIVATE_INIT ((GDestroyNotify) &uring_free);
+
+static Uring *
+get_uring (void)
+{
+  Uring *ring;
+
+  if (g_atomic_int_get (&uring_unavailable))
+    return NULL;
+
+  ring = g_private_get (&uring_key);
+  if (ring == NULL)
+    {
+      ring = uring_new ();
+      if (ring != NULL)
+	g_private_set (&uring_key, ring);
+    }
+
+  return ring;
+}
+
+static void
+queue_io (Uring *ring, bool write, int fd, unsigned int slot, size_t buf_pos,
+	  size_t size, off_t offset)
+{
+  struct io_uring_sqe *sqe;
+  struct iovec *iov;
+  uint8_t *buffer;
+  unsigned int tail;
+  unsigned int index;
+
+  tail	= *ring->sq_tail;
+  index = tail & *ring->sq_mask;
+
+  buffer = ring->buffers + slot * URING_CHUNK_SIZE + buf_pos;
+
+  sqe = &ring->sqes[index];
+  memset (sqe, 0, sizeof (*sqe));
+  sqe->fd	 = fd;
+  sqe->off	 = offset;
+  sqe->user_data = slot;
+
+  if (ring->fixed)
+    {
+      sqe->opcode    = (write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED);
+      sqe->addr	     = (uintptr_t) buffer;
+      sqe->len	     = size;
+      sqe->buf_index = slot;
+    }
+  else
+    {
+      /* A slot has one request in flight at a time, so its iovec can be
+       * reused. */
+      iov = &ring->iovecs[slot];
+      iov->iov_base = buffer;
+      iov->iov_len  = size;
+
+      sqe->opcode = (write ? IORING_OP_WRITEV : IORING_OP_READV);
+      sqe->addr	  = (uintptr_t) iov;
+      sqe->len	  = 1;
+    }
+
+  ring->sq_array[index] = index;
+
+  /* The kernel must see the entry before the new tail. */
+  __atomic_store_n (ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int
+submit_and_wait (Uring *ring, unsigned int to_submit)
+{
+  int r;
+
+  do
+    r = syscall (__NR_io_uring_enter, ring->fd, to_submit, 1,
+		 IORING_ENTER_GETEVENTS, NULL, 0);
+  while (r < 0 && errno == EINTR);
+
+  return (r < 0 ? -errno : r);
+}
+
+int
+nks_uring_copy (int in_fd, off_t in_offset, int out_fd, size_t size,
+		const uint8_t *key, size_t key_length, size_t key_pos)
+{
+  UringSlot slots[URING_DEPTH];
+  struct io_uring_cqe *cqe;
+  UringSlot *slot;
+  unsigned int pending = 0;
+  unsigned int in_flight = 0;
+  unsigned int head;
+  unsigned int n;
+  off_t out_offset;
+  off_t next = 0;
+  uint8_t *data;
+  Uring *ring;
+  int submitted;
+  int result;
+  int r = 0;
+
+  ring = get_uring ();
+  if (ring == NULL)
+    return -ENOSYS;
+
+  /* Writes carry explicit offsets, so out_fd must be seekable. */
+  out_offset = lseek (out_fd, 0, SEEK_CUR);
+  if (out_offset < 0)
+    return -ENOSYS;
+
+  for (n = 0; n < URING_DEPTH && (size_t) next < size; n++)
+    {
+      slots[n].offset  = next;
+      slots[n].size    = MIN (URING_CHUNK_SIZE, size - next);
+      slots[n].done    = 0;
+      slots[n].writing = false;
+
+      queue_io (ring, false, in_fd, n, 0, slots[n].size,
+		in_offset + next);
+      next += slots[n].size;
+      pending++;
+    }
+
+  while (pending > 0 || in_flight > 0)
+    {
+      submitted = submit_and_wait (ring, pending);
+      if (submitted < 0)
+	{
+	  /* Completions can no longer be told apart from those of a later
+	   * copy, so give the ring up; closing it waits for them. */
+	  g_private_replace (&uring_key, NULL);
+	  return submitted;
+	}
+
+      in_flight += submitted;
+      pending	-= submitted;
+
+      head = *ring->cq_head;
+      while (head != __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE))
+	{
+	  cqe	 = &ring->cqes[head & *ring->cq_mask];
+	  n	 = cqe->user_data;
+	  result = cqe->res;
+	  head++;
+	  in_flight--;
+
+	  slot = &slots[n];
+	  data = ring->buffers + n * URING_CHUNK_SIZE;
+
+	  /* After an error, only drain what is still in flight. */
+	  if (r != 0)
+	    continue;
+
+	  if (result < 0)
+	    {
+	      r = result;
+	      continue;
+	    }
+
+	  if (!slot->writing)
+	    {
+	      /* Archive data ends where the entry says it does. */
+	      if ((size_t) result != slot->size)
+		{
+		  r = -EIO;
+		  continue;
+		}
+
+	      if (key != NULL)
+		nks_xor_key (data, data, slot->size, key, key_length,
+			     key_pos + slot->offset);
+
+	      slot->writing = true;
+	    }
+	  else if (result == 0)
+	    {
+	      /* A write which makes no progress would be retried forever. */
+	      r = -EIO;
+	      continue;
+	    }
+	  else
+	    slot->done += result;
+
+	  if (slot->done < slot->size)
+	    queue_io (ring, true, out_fd, n, slot->done,
+		      slot->size - slot->done,
+		      out_offset + slot->offset + slot->done);
+	  else if ((size_t) next < size)
+	    {
+	      slot->offset  = next;
+	      slot->size    = MIN (URING_CHUNK_SIZE, size - next);
+	      slot->done    = 0;
+	      slot->writing = false;
+
+	      queue_io (ring, false, in_fd, n, 0, slot->size,
+			in_offset + next);
+	      next += slot->size;
+	    }
+	  else
+	    continue;
+
+	  pending++;
+	}
+
+      __atomic_store_n (ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+  if (r != 0)
+    return r;
+
+  if (lseek (out_fd, out_offset + size, SEEK_SET) < 0)
+    return -errno;
+
+  return 0;
+}
+
+#else
+
+int
+nks_uring_copy (int in_fd, off_t in_offset, int out_fd, size_t size,
+		const uint8_t *key, size_t key_length, size_t key_pos)
+{
+  return -ENOSYS;
+}
+
+#endif
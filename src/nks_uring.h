@@ -0,0 +1,24 @@
+#ifndef NKS_URING_H
+#define NKS_URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Entries smaller than this are not worth a round trip through the ring. */
+#define NKS_URING_MIN_SIZE (1024 * 1024)
+
+/*
+ * Copies size bytes at in_offset of in_fd to the current position of out_fd
+ * using an io_uring owned by the calling thread.  Several reads are kept in
+ * flight at once; each chunk is XORed with key (see nks_xor_key) as soon as
+ * it arrives, unless key is NULL, and then written out at its own offset.
+ * On success the position of out_fd is left after the copied data.
+ *
+ * Returns -ENOSYS without having read or written anything if io_uring is not
+ * available, in which case the caller should copy synchronously.
+ */
+int nks_uring_copy (int in_fd, off_t in_offset, int out_fd, size_t size,
+		    const uint8_t *key, size_t key_length, size_t key_pos);
+
+#endif
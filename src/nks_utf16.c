@@ -0,0 +1,178 @@
+#include <errno.h>
+#include <glib.h>
+#include <string.h>
+
+#include "nks_utf16.h"
+
+#if defined HAVE_X86_CPU_DISPATCH
+# include <immintrin.h>
+#endif
+
+/* Converts the longest prefix of ASCII code units, possibly stopping a few
+ * units short of it, and returns the number of units converted. */
+typedef size_t (*AsciiFunc) (const uint8_t *src, size_t count, char *dst);
+
+static size_t
+ascii_generic (const uint8_t *src, size_t count, char *dst)
+{
+  size_t n = 0;
+
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+  uint64_t x;
+
+  /* Four units at a time: all high bytes and the top bits of the low bytes
+   * must be clear. */
+  for (; n + 4 <= count; n += 4)
+    {
+      memcpy (&x, src + 2 * n, 8);
+      if ((x & UINT64_C (0xff80ff80ff80ff80)) != 0)
+	break;
+
+      dst[n]	 = x;
+      dst[n + 1] = x >> 16;
+      dst[n + 2] = x >> 32;
+      dst[n + 3] = x >> 48;
+    }
+#endif
+
+  for (; n < count; n++)
+    {
+      if (src[2 * n] >= 0x80 || src[2 * n + 1] != 0)
+	break;
+
+      dst[n] = src[2 * n];
+    }
+
+  return n;
+}
+
+#if defined HAVE_X86_CPU_DISPATCH
+__attribute__ ((target ("sse2"))) static size_t
+ascii_sse2 (const uint8_t *src, size_t count, char *dst)
+{
+  const __m128i mask = _mm_set1_epi16 ((short) 0xff80);
+  const __m128i zero = _mm_setzero_si128 ();
+  __m128i a;
+  size_t n = 0;
+
+  for (; n + 8 <= count; n += 8)
+    {
+      a = _mm_loadu_si128 ((const __m128i *) (src + 2 * n));
+      if (_mm_movemask_epi8 (_mm_cmpeq_epi16 (_mm_and_si128 (a, mask), zero))
+	  != 0xffff)
+	break;
+
+      _mm_storel_epi64 ((__m128i *) (dst + n), _mm_packus_epi16 (a, a));
+    }
+
+  return n + ascii_generic (src + 2 * n, count - n, dst + n);
+}
+
+__attribute__ ((target ("avx2"))) static size_t
+ascii_avx2 (const uint8_t *src, size_t count, char *dst)
+{
+  const __m256i mask = _mm256_set1_epi16 ((short) 0xff80);
+  __m256i a, packed;
+  size_t n = 0;
+
+  for (; n + 16 <= count; n += 16)
+    {
+      a = _mm256_loadu_si256 ((const __m256i *) (src + 2 * n));
+      if (!_mm256_testz_si256 (a, mask))
+	break;
+
+      /* Packing works within each 128-bit lane, so gather the two halves
+       * into the low lane afterwards. */
+      packed = _mm256_permute4x64_epi64 (_mm256_packus_epi16 (a, a), 0xd8);
+      _mm_storeu_si128 ((__m128i *) (dst + n),
+			_mm256_castsi256_si128 (packed));
+    }
+
+  return n + ascii_sse2 (src + 2 * n, count - n, dst + n);
+}
+#endif
+
+static AsciiFunc
+get_ascii_func (void)
+{
+  static gsize ascii_func = 0;
+  AsciiFunc func;
+
+  if (g_once_init_enter (&ascii_func))
+    {
+      func = &ascii_generic;
+
+#if defined HAVE_X86_CPU_DISPATCH
+      __builtin_cpu_init ();
+
+      if (__builtin_cpu_supports ("avx2"))
+	func = &ascii_avx2;
+      else if (__builtin_cpu_supports ("sse2"))
+	func = &ascii_sse2;
+#endif
+
+      g_once_init_leave (&ascii_func, (gsize) func);
+    }
+
+  return (AsciiFunc) ascii_func;
+}
+
+ssize_t
+nks_utf16_le_to_utf8 (const uint8_t *src, size_t count, char *dst)
+{
+  AsciiFunc ascii = get_ascii_func ();
+  uint8_t *out = (uint8_t *) dst;
+  uint32_t c, low;
+  size_t n = 0;
+  size_t done;
+
+  while (n < count)
+    {
+      done = ascii (src + 2 * n, count - n, (char *) out);
+      n	  += done;
+      out += done;
+
+      if (n == count)
+	break;
+
+      c = src[2 * n] | (src[2 * n + 1] << 8);
+      n++;
+
+      if (c < 0x80)
+	*out++ = c;
+      else if (c < 0x800)
+	{
+	  *out++ = 0xc0 | (c >> 6);
+	  *out++ = 0x80 | (c & 0x3f);
+	}
+      else if (c >= 0xd800 && c < 0xdc00)
+	{
+	  if (n == count)
+	    return -EILSEQ;
+
+	  low = src[2 * n] | (src[2 * n + 1] << 8);
+	  if (low < 0xdc00 || low >= 0xe000)
+	    return -EILSEQ;
+
+	  n++;
+	  c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+
+	  *out++ = 0xf0 | (c >> 18);
+	  *out++ = 0x80 | ((c >> 12) & 0x3f);
+	  *out++ = 0x80 | ((c >> 6) & 0x3f);
+	  *out++ = 0x80 | (c & 0x3f);
+	}
+      else if (c >= 0xdc00 && c < 0xe000)
+	return -EILSEQ;
+      else
+	{
+	  *out++ = 0xe0 | (c >> 12);
+	  *out++ = 0x80 | ((c >> 6) & 0x3f);
+	  *out++ = 0x80 | (c & 0x3f);
+	}
+    }
+
+  *out = 0;
+
+  return out - (uint8_t *) dst;
+}
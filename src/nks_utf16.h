@@ -0,0 +1,22 @@
+#ifndef NKS_UTF16_H
+#define NKS_UTF16_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Converts count UTF-16LE code units at src to UTF-8 and stores the result,
+ * followed by a 0 byte, in dst, which must have room for
+ * NKS_UTF16_UTF8_SIZE (count) bytes.  Returns the length of the result
+ * without the 0 byte, or -EILSEQ if src contains unpaired surrogates.
+ *
+ * Runs of ASCII characters are converted by the widest vector kernel the
+ * running CPU supports.
+ */
+ssize_t nks_utf16_le_to_utf8 (const uint8_t *src, size_t count, char *dst);
+
+/* A code unit becomes at most 3 bytes; a surrogate pair becomes 4. */
+#define NKS_UTF16_UTF8_SIZE(count) (3 * (count) + 1)
+
+#endif
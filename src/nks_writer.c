@@ -0,0 +1,723 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "key_cache.h"
+#include "keys.h"
+#include "nks.h"
+#include "nks_index.h"
+#include "nks_io.h"
+#include "nks_xor.h"
+#include "util.h"
+
+/* Output is written out in pieces of about this size. */
+#define FLUSH_SIZE (256 * 1024)
+
+/* File data is filled in and encrypted in chunks of this size. */
+#define CHUNK_SIZE (64 * 1024)
+
+typedef enum
+{
+  SOURCE_MEMORY,
+  SOURCE_PATH,
+  SOURCE_FUNC,
+} SourceType;
+
+typedef struct WriterNode WriterNode;
+
+struct WriterNode
+{
+  char	       *name;
+  NksEntryType	type;
+  uint32_t	offset;		/* Assigned when the archive is laid out */
+
+  /* Directories */
+  GPtrArray    *children;
+  GHashTable   *names;		/* Folded name -> WriterNode */
+
+  /* Files */
+  uint32_t	size;
+  bool		encrypted;
+  uint32_t	key_index;	/* For 0x0100 archives */
+  SourceType	source;
+  void	       *data;		/* Copy of the contents, or source path */
+  NksFillFunc	func;
+  void	       *user_data;
+};
+
+struct NksWriter
+{
+  int	      fd;
+  char	     *file_name;	/* Removed on failure, if we created it */
+  uint16_t    version;
+  uint32_t    set_id;
+  NksSetKey  *set_key;		/* Only once an encrypted 0x0110 file is added */
+  uint32_t    next_key_index;
+  WriterNode *root;
+  GByteArray *out;
+};
+
+static WriterNode *
+new_directory (const char *name)
+{
+  WriterNode *node;
+
+  node = g_malloc0 (sizeof (*node));
+  node->name	 = g_strdup (name);
+  node->type	 = NKS_ENT_DIRECTORY;
+  node->children = g_ptr_array_new ();
+  node->names	 = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+					  NULL);
+
+  return node;
+}
+
+static void
+free_node (WriterNode *node)
+{
+  guint n;
+
+  if (node->type == NKS_ENT_DIRECTORY)
+    {
+      for (n = 0; n < node->children->len; n++)
+	free_node (g_ptr_array_index (node->children, n));
+
+      g_ptr_array_free (node->children, true);
+      g_hash_table_destroy (node->names);
+    }
+  else if (node->source != SOURCE_FUNC)
+    g_free (node->data);
+
+  g_free (node->name);
+  g_free (node);
+}
+
+static void
+add_child (WriterNode *dir, WriterNode *child)
+{
+  g_ptr_array_add (dir->children, child);
+  g_hash_table_insert (dir->names, nks_index_fold_path (child->name), child);
+}
+
+/* Readers compare names the way the index folds them, so a name which only
+ * differs from an existing one in case or composition could never be looked
+ * up; it is refused with -EEXIST. */
+static int
+find_child (WriterNode *dir, const char *name, WriterNode **ret)
+{
+  WriterNode *child;
+  char *folded;
+
+  folded = nks_index_fold_path (name);
+  child = g_hash_table_lookup (dir->names, folded);
+  g_free (folded);
+
+  if (child != NULL && strcmp (child->name, name) != 0)
+    return -EEXIST;
+
+  *ret = child;
+  return 0;
+}
+
+static int
+create_writer (int fd, char *file_name, unsigned int version, uint32_t set_id,
+	       NksWriter **ret)
+{
+  NksWriter *writer;
+
+  if (version != 0x0100 && version != 0x0110)
+    return -ENOTSUP;
+
+  writer = g_malloc0 (sizeof (*writer));
+  writer->fd	    = fd;
+  writer->file_name = file_name;
+  writer->version   = version;
+  writer->set_id    = (version == 0x0110 ? set_id : 0);
+  writer->root	    = new_directory ("");
+  writer->out	    = g_byte_array_sized_new (FLUSH_SIZE + CHUNK_SIZE);
+
+  *ret = writer;
+
+  return 0;
+}
+
+int
+nks_create (const char *file_name, unsigned int version, uint32_t set_id,
+	    NksWriter **ret)
+{
+  int fd;
+  int r;
+
+  assert (file_name != NULL);
+  assert (ret != NULL);
+
+  fd = open (file_name, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+  if (fd < 0)
+    return -errno;
+
+  r = create_writer (fd, g_strdup (file_name), version, set_id, ret);
+  if (r != 0)
+    {
+      close (fd);
+      unlink (file_name);
+    }
+
+  return r;
+}
+
+int
+nks_create_fd (int fd, unsigned int version, uint32_t set_id, NksWriter **ret)
+{
+  assert (ret != NULL);
+
+  if (fd < 0)
+    return -EINVAL;
+
+  return create_writer (fd, NULL, version, set_id, ret);
+}
+
+static int
+check_name (const NksWriter *writer, const char *name)
+{
+  if (name[0] == '\0' || strcmp (name, ".") == 0 || strcmp (name, "..") == 0)
+    return -EINVAL;
+
+  if (writer->version == 0x0100)
+    return (strlen (name) < 128 ? 0 : -ENAMETOOLONG);
+
+  return (g_utf8_validate (name, -1, NULL) ? 0 : -EILSEQ);
+}
+
+/* Finds the directory which is to contain path, creating any missing
+ * directories on the way, and returns the last segment of path in name. */
+static int
+get_parent (NksWriter *writer, const char *path, WriterNode **ret,
+	    char **name)
+{
+  WriterNode *dir = writer->root;
+  WriterNode *child;
+  char **segments;
+  char *last = NULL;
+  size_t n;
+  int r = 0;
+
+  segments = g_strsplit (path, "/", -1);
+
+  for (n = 0; segments[n] != NULL; n++)
+    {
+      if (segments[n][0] == '\0')
+	continue;
+
+      r = check_name (writer, segments[n]);
+      if (r != 0)
+	break;
+
+      if (last != NULL)
+	{
+	  r = find_child (dir, last, &child);
+	  if (r != 0)
+	    break;
+
+	  if (child == NULL)
+	    {
+	      child = new_directory (last);
+	      add_child (dir, child);
+	    }
+	  else if (child->type != NKS_ENT_DIRECTORY)
+	    {
+	      r = -ENOTDIR;
+	      break;
+	    }
+
+	  dir = child;
+	}
+
+      last = segments[n];
+    }
+
+  if (r == 0 && last == NULL)
+    r = -EINVAL;
+
+  if (r == 0)
+    {
+      *ret  = dir;
+      *name = g_strdup (last);
+    }
+
+  g_strfreev (segments);
+
+  return r;
+}
+
+int
+nks_writer_add_directory (NksWriter *writer, const char *path)
+{
+  WriterNode *dir;
+  WriterNode *child;
+  char *name;
+  int r;
+
+  assert (writer != NULL);
+  assert (path != NULL);
+
+  r = get_parent (writer, path, &dir, &name);
+  if (r != 0)
+    return r;
+
+  r = find_child (dir, name, &child);
+  if (r == 0 && child == NULL)
+    add_child (dir, new_directory (name));
+  else if (r == 0 && child->type != NKS_ENT_DIRECTORY)
+    r = -EEXIST;
+
+  g_free (name);
+
+  return r;
+}
+
+static int
+add_file (NksWriter *writer, const char *path, uint64_t size,
+	  unsigned int flags, WriterNode **ret)
+{
+  WriterNode *dir;
+  WriterNode *node;
+  bool cached, generated;
+  char *name;
+  int r;
+
+  assert (writer != NULL);
+  assert (path != NULL);
+
+  if (size > UINT32_MAX)
+    return -EFBIG;
+
+  /* Fail now rather than half way through writing the archive. */
+  if ((flags & NKS_WRITE_ENCRYPTED) && writer->version == 0x0110
+      && writer->set_key == NULL)
+    {
+      r = nks_key_cache_acquire (writer->set_id, &writer->set_key, &cached,
+				 &generated);
+      if (r != 0)
+	return r;
+    }
+
+  r = get_parent (writer, path, &dir, &name);
+  if (r != 0)
+    return r;
+
+  r = find_child (dir, name, &node);
+  if (r == 0 && node != NULL)
+    r = -EEXIST;
+
+  if (r != 0)
+    {
+      g_free (name);
+      return r;
+    }
+
+  node = g_malloc0 (sizeof (*node));
+  node->name	  = name;
+  node->type	  = NKS_ENT_FILE;
+  node->size	  = size;
+  node->encrypted = ((flags & NKS_WRITE_ENCRYPTED) != 0);
+
+  /* Spread 0x0100 files over all the fixed keys. */
+  if (node->encrypted && writer->version == 0x0100)
+    node->key_index = writer->next_key_index++ % 32;
+
+  add_child (dir, node);
+  *ret = node;
+
+  return 0;
+}
+
+int
+nks_writer_add_file (NksWriter *writer, const char *path, const void *data,
+		     size_t size, unsigned int flags)
+{
+  WriterNode *node;
+  int r;
+
+  r = add_file (writer, path, size, flags, &node);
+  if (r != 0)
+    return r;
+
+  node->source = SOURCE_MEMORY;
+  node->data   = g_malloc (size);
+
+  if (size > 0)
+    memcpy (node->data, data, size);
+
+  return 0;
+}
+
+int
+nks_writer_add_file_path (NksWriter *writer, const char *path,
+			  const char *source, unsigned int flags)
+{
+  WriterNode *node;
+  struct stat st;
+  int r;
+
+  assert (source != NULL);
+
+  if (stat (source, &st) != 0)
+    return -errno;
+
+  if (!S_ISREG (st.st_mode))
+    return -EINVAL;
+
+  r = add_file (writer, path, st.st_size, flags, &node);
+  if (r != 0)
+    return r;
+
+  node->source = SOURCE_PATH;
+  node->data   = g_strdup (source);
+
+  return 0;
+}
+
+int
+nks_writer_add_file_func (NksWriter *writer, const char *path, uint64_t size,
+			  unsigned int flags, NksFillFunc func,
+			  void *user_data)
+{
+  WriterNode *node;
+  int r;
+
+  assert (func != NULL);
+
+  r = add_file (writer, path, size, flags, &node);
+  if (r != 0)
+    return r;
+
+  node->source	  = SOURCE_FUNC;
+  node->func	  = func;
+  node->user_data = user_data;
+
+  return 0;
+}
+
+/* Entries are stored in pre-order: each directory table is followed by the
+ * contents of its entries, in order. */
+static int
+lay_out (NksWriter *writer, WriterNode *node, uint64_t *offset)
+{
+  WriterNode *child;
+  size_t size;
+  guint n;
+  int r;
+
+  if (*offset > UINT32_MAX)
+    return -EFBIG;
+
+  node->offset = *offset;
+
+  if (node->type != NKS_ENT_DIRECTORY)
+    {
+      *offset += (node->encrypted ? NKS_ENCRYPTED_FILE_HEADER_SIZE
+				  : NKS_FILE_HEADER_SIZE);
+      *offset += node->size;
+      return 0;
+    }
+
+  *offset += NKS_DIRECTORY_HEADER_SIZE;
+
+  for (n = 0; n < node->children->len; n++)
+    {
+      child = g_ptr_array_index (node->children, n);
+
+      if (writer->version == 0x0100)
+	size = NKS_0100_ENTRY_HEADER_SIZE;
+      else
+	size = nks_0110_entry_header_size (child->name);
+
+      *offset += size;
+    }
+
+  for (n = 0; n < node->children->len; n++)
+    {
+      r = lay_out (writer, g_ptr_array_index (node->children, n), offset);
+      if (r != 0)
+	return r;
+    }
+
+  return 0;
+}
+
+static int
+flush (NksWriter *writer)
+{
+  const uint8_t *bp = writer->out->data;
+  size_t size = writer->out->len;
+  ssize_t count;
+
+  while (size > 0)
+    {
+      count = write (writer->fd, bp, size);
+      if (count < 0 && errno == EINTR)
+	continue;
+      if (count <= 0)
+	return (count < 0 ? -errno : -EIO);
+
+      bp   += count;
+      size -= count;
+    }
+
+  g_byte_array_set_size (writer->out, 0);
+
+  return 0;
+}
+
+static int
+write_entry_header (NksWriter *writer, const WriterNode *node)
+{
+  uint16_t type;
+
+  if (node->type == NKS_ENT_DIRECTORY)
+    type = NKS_TH_DIRECTORY;
+  else if (node->encrypted)
+    type = NKS_TH_ENCRYPTED_FILE;
+  else
+    type = NKS_TH_FILE;
+
+  if (writer->version == 0x0100)
+    {
+      Nks0100EntryHeader header;
+
+      memset (&header, 0, sizeof (header));
+      strcpy (header.name, node->name);
+      header.offset = node->offset;
+      header.type   = type;
+
+      nks_write_0100_entry_header (writer->out, &header);
+      return 0;
+    }
+  else
+    {
+      Nks0110EntryHeader header;
+
+      memset (&header, 0, sizeof (header));
+      header.name   = node->name;
+      header.offset = node->offset;
+      header.type   = type;
+
+      return nks_write_0110_entry_header (writer->out, &header);
+    }
+}
+
+static int
+read_all (int fd, void *buffer, size_t size)
+{
+  uint8_t *bp = buffer;
+  ssize_t count;
+
+  while (size > 0)
+    {
+      count = read (fd, bp, size);
+      if (count < 0 && errno == EINTR)
+	continue;
+      if (count <= 0)
+	return (count < 0 ? -errno : -EIO);
+
+      bp   += count;
+      size -= count;
+    }
+
+  return 0;
+}
+
+static int
+write_file (NksWriter *writer, const WriterNode *node)
+{
+  const uint8_t *key = NULL;
+  size_t key_length = 0;
+  size_t key_pos = 0;
+  uint32_t done;
+  size_t chunk;
+  size_t len;
+  uint8_t *p;
+  ssize_t count;
+  int fd = -1;
+  int r = 0;
+
+  if (node->encrypted)
+    {
+      NksEncryptedFileHeader header;
+
+      memset (&header, 0, sizeof (header));
+      header.version = writer->version;
+      header.size    = node->size;
+
+      if (writer->version == 0x0100)
+	{
+	  header.key_index = node->key_index;
+
+	  r = nks_get_0100_key (node->key_index, &key, &key_length);
+	  if (r != 0)
+	    return -ENOKEY;
+
+	  /* 0x0100 keys are aligned with the archive, not the entry. */
+	  key_pos = (node->offset + NKS_ENCRYPTED_FILE_HEADER_SIZE)
+		    % key_length;
+	}
+      else
+	{
+	  header.set_id	   = writer->set_id;
+	  header.key_index = 0x100;
+
+	  key	     = nks_set_key_data (writer->set_key);
+	  key_length = NKS_SET_KEY_SIZE;
+	}
+
+      nks_write_encrypted_file_header (writer->out, &header);
+    }
+  else
+    {
+      NksFileHeader header;
+
+      memset (&header, 0, sizeof (header));
+      header.version = writer->version;
+      header.size    = node->size;
+
+      nks_write_file_header (writer->out, &header);
+    }
+
+  if (node->source == SOURCE_PATH)
+    {
+      fd = open (node->data, O_RDONLY | O_BINARY);
+      if (fd < 0)
+	return -errno;
+    }
+
+  for (done = 0; done < node->size; done += chunk)
+    {
+      chunk = MIN (node->size - done, CHUNK_SIZE);
+
+      len = writer->out->len;
+      g_byte_array_set_size (writer->out, len + chunk);
+      p = writer->out->data + len;
+
+      switch (node->source)
+	{
+	case SOURCE_MEMORY:
+	  memcpy (p, (const uint8_t *) node->data + done, chunk);
+	  break;
+
+	case SOURCE_PATH:
+	  /* A file which shrank since it was added cannot be stored. */
+	  r = read_all (fd, p, chunk);
+	  break;
+
+	case SOURCE_FUNC:
+	  count = node->func (p, chunk, done, node->user_data);
+	  if (count != (ssize_t) chunk)
+	    r = (count < 0 ? count : -EIO);
+	  break;
+	}
+
+      if (r != 0)
+	break;
+
+      if (key != NULL)
+	nks_xor_key (p, p, chunk, key, key_length, key_pos + done);
+
+      if (writer->out->len >= FLUSH_SIZE)
+	{
+	  r = flush (writer);
+	  if (r != 0)
+	    break;
+	}
+    }
+
+  if (fd >= 0)
+    close (fd);
+
+  return r;
+}
+
+static int
+write_node (NksWriter *writer, const WriterNode *node)
+{
+  NksDirectoryHeader header;
+  guint n;
+  int r;
+
+  if (node->type != NKS_ENT_DIRECTORY)
+    return write_file (writer, node);
+
+  memset (&header, 0, sizeof (header));
+  header.version     = writer->version;
+  header.set_id	     = writer->set_id;
+  header.entry_count = node->children->len;
+
+  nks_write_directory_header (writer->out, &header);
+
+  for (n = 0; n < node->children->len; n++)
+    {
+      r = write_entry_header (writer, g_ptr_array_index (node->children, n));
+      if (r != 0)
+	return r;
+    }
+
+  for (n = 0; n < node->children->len; n++)
+    {
+      r = write_node (writer, g_ptr_array_index (node->children, n));
+      if (r != 0)
+	return r;
+    }
+
+  return 0;
+}
+
+static void
+free_writer (NksWriter *writer, bool failed)
+{
+  if (writer->file_name != NULL)
+    {
+      close (writer->fd);
+
+      if (failed)
+	unlink (writer->file_name);
+    }
+
+  if (writer->set_key != NULL)
+    nks_key_cache_release (writer->set_key);
+
+  free_node (writer->root);
+  g_byte_array_free (writer->out, true);
+  g_free (writer->file_name);
+  g_free (writer);
+}
+
+int
+nks_writer_close (NksWriter *writer)
+{
+  uint64_t size = 0;
+  int r;
+
+  assert (writer != NULL);
+
+  r = lay_out (writer, writer->root, &size);
+
+  if (r == 0)
+    r = write_node (writer, writer->root);
+
+  if (r == 0)
+    r = flush (writer);
+
+  free_writer (writer, r != 0);
+
+  return r;
+}
+
+void
+nks_writer_discard (NksWriter *writer)
+{
+  if (writer != NULL)
+    free_writer (writer, true);
+}
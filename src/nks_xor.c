@@ -0,0 +1,149 @@
+#include <glib.h>
+#include <string.h>
+
+#include "nks_xor.h"
+#include "util.h"
+
+#if defined HAVE_X86_CPU_DISPATCH
+# include <immintrin.h>
+#endif
+
+/* Short keys are repeated to this length, so that the kernels always get
+ * long runs to work on. */
+#define XOR_PATTERN_SIZE 4096
+
+typedef void (*XorFunc) (uint8_t *dst, const uint8_t *src, const uint8_t *key,
+			 size_t size);
+
+static void
+xor_generic (uint8_t *dst, const uint8_t *src, const uint8_t *key, size_t size)
+{
+  uint64_t a, b;
+  size_t x = 0;
+
+  for (; x + 8 <= size; x += 8)
+    {
+      memcpy (&a, src + x, 8);
+      memcpy (&b, key + x, 8);
+      a ^= b;
+      memcpy (dst + x, &a, 8);
+    }
+
+  for (; x < size; x++)
+    dst[x] = src[x] ^ key[x];
+}
+
+#if defined HAVE_X86_CPU_DISPATCH
+__attribute__ ((target ("sse2"))) static void
+xor_sse2 (uint8_t *dst, const uint8_t *src, const uint8_t *key, size_t size)
+{
+  __m128i a, b;
+  size_t x = 0;
+
+  for (; x + 16 <= size; x += 16)
+    {
+      a = _mm_loadu_si128 ((const __m128i *) (src + x));
+      b = _mm_loadu_si128 ((const __m128i *) (key + x));
+      _mm_storeu_si128 ((__m128i *) (dst + x), _mm_xor_si128 (a, b));
+    }
+
+  xor_generic (dst + x, src + x, key + x, size - x);
+}
+
+__attribute__ ((target ("avx2"))) static void
+xor_avx2 (uint8_t *dst, const uint8_t *src, const uint8_t *key, size_t size)
+{
+  __m256i a, b;
+  size_t x = 0;
+
+  for (; x + 32 <= size; x += 32)
+    {
+      a = _mm256_loadu_si256 ((const __m256i *) (src + x));
+      b = _mm256_loadu_si256 ((const __m256i *) (key + x));
+      _mm256_storeu_si256 ((__m256i *) (dst + x), _mm256_xor_si256 (a, b));
+    }
+
+  xor_sse2 (dst + x, src + x, key + x, size - x);
+}
+
+__attribute__ ((target ("avx512f"))) static void
+xor_avx512 (uint8_t *dst, const uint8_t *src, const uint8_t *key, size_t size)
+{
+  __m512i a, b;
+  size_t x = 0;
+
+  for (; x + 64 <= size; x += 64)
+    {
+      a = _mm512_loadu_si512 ((const void *) (src + x));
+      b = _mm512_loadu_si512 ((const void *) (key + x));
+      _mm512_storeu_si512 ((void *) (dst + x), _mm512_xor_si512 (a, b));
+    }
+
+  xor_avx2 (dst + x, src + x, key + x, size - x);
+}
+#endif
+
+static XorFunc
+get_xor_func (void)
+{
+  static gsize xor_func = 0;
+  XorFunc func;
+
+  if (g_once_init_enter (&xor_func))
+    {
+      func = &xor_generic;
+
+#if defined HAVE_X86_CPU_DISPATCH
+      __builtin_cpu_init ();
+
+      if (__builtin_cpu_supports ("avx512f"))
+	func = &xor_avx512;
+      else if (__builtin_cpu_supports ("avx2"))
+	func = &xor_avx2;
+      else if (__builtin_cpu_supports ("sse2"))
+	func = &xor_sse2;
+#endif
+
+      g_once_init_leave (&xor_func, (gsize) func);
+    }
+
+  return (XorFunc) xor_func;
+}
+
+size_t
+nks_xor_key (uint8_t *dst, const uint8_t *src, size_t size,
+	     const uint8_t *key, size_t key_length, size_t key_pos)
+{
+  uint8_t pattern[XOR_PATTERN_SIZE];
+  XorFunc func = get_xor_func ();
+  size_t period = key_length;
+  size_t count;
+  size_t x;
+
+  key_pos &= key_length - 1;
+
+  if (key_length < XOR_PATTERN_SIZE && size > key_length)
+    {
+      for (x = 0; x < XOR_PATTERN_SIZE; x += key_length)
+	memcpy (pattern + x, key, key_length);
+
+      key = pattern;
+      key_length = XOR_PATTERN_SIZE;
+    }
+
+  /* Each step runs to the end of the key at most, so the key position only
+   * wraps between calls into the kernel. */
+  while (size > 0)
+    {
+      count = MIN (size, key_length - key_pos);
+      func (dst, src, key + key_pos, count);
+
+      dst  += count;
+      src  += count;
+      size -= count;
+
+      key_pos = (key_pos + count) & (key_length - 1);
+    }
+
+  return key_pos & (period - 1);
+}
@@ -0,0 +1,18 @@
+#ifndef NKS_XOR_H
+#define NKS_XOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * XORs size bytes of src with a repeating key, starting key_pos bytes into
+ * the key, and stores the result in dst.  dst may equal src.  key_length
+ * must be a power of two; the 16 byte 0x0100 keys and the 64 KiB 0x0110
+ * keystreams both are.  Returns the key position following the last byte.
+ *
+ * The work is done by the widest vector kernel the running CPU supports.
+ */
+size_t nks_xor_key (uint8_t *dst, const uint8_t *src, size_t size,
+		    const uint8_t *key, size_t key_length, size_t key_pos);
+
+#endif
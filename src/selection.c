@@ -0,0 +1,457 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "selection.h"
+#include "util.h"
+
+typedef struct SelectionNode SelectionNode;
+
+struct SelectionNode
+{
+  GHashTable *children;	/* Folded segment -> SelectionNode, or NULL */
+  const char *path;	/* The exact path ending here, if any */
+  bool	      patterns;	/* An include pattern may match below */
+};
+
+struct NksSelection
+{
+  GPtrArray	*paths;		/* Exact paths, in the order added */
+  GHashTable	*path_set;	/* Case-folded path -> exact path */
+  GHashTable	*matched;	/* Exact paths something matched */
+  SelectionNode *root;
+  GPtrArray	*includes;	/* GPatternSpec */
+  GPtrArray	*excludes;	/* GPatternSpec */
+};
+
+static void
+node_free (SelectionNode *node)
+{
+  if (node->children != NULL)
+    g_hash_table_destroy (node->children);
+
+  g_free (node);
+}
+
+static SelectionNode *
+node_child (SelectionNode *node, const char *name, size_t len)
+{
+  SelectionNode *child;
+  char *key;
+
+  if (node->children == NULL)
+    node->children = g_hash_table_new_full (&g_str_hash, &g_str_equal,
+					    &g_free,
+					    (GDestroyNotify) &node_free);
+
+  key = g_strndup (name, len);
+  child = g_hash_table_lookup (node->children, key);
+  if (child != NULL)
+    {
+      g_free (key);
+      return child;
+    }
+
+  child = g_new0 (SelectionNode, 1);
+  g_hash_table_insert (node->children, key, child);
+
+  return child;
+}
+
+static char *
+native_path (const char *path)
+{
+  char *copy = g_strdup (path);
+
+#ifdef _WIN32
+  size_t x;
+
+  for (x = 0; copy[x] != '\0'; x++)
+    {
+      if (copy[x] == '/')
+	copy[x] = SEP_CHAR;
+    }
+#endif
+
+  return copy;
+}
+
+static bool
+pattern_match (GPatternSpec *spec, const char *str)
+{
+#if GLIB_CHECK_VERSION (2, 70, 0)
+  return g_pattern_spec_match_string (spec, str);
+#else
+  return g_pattern_match_string (spec, str);
+#endif
+}
+
+NksSelection *
+nks_selection_new (void)
+{
+  NksSelection *sel;
+
+  sel = g_new0 (NksSelection, 1);
+  sel->paths	= g_ptr_array_new_with_free_func (&g_free);
+  sel->path_set = g_hash_table_new_full (&g_str_hash, &g_str_equal, &g_free,
+					 NULL);
+  sel->matched	= g_hash_table_new (&g_direct_hash, &g_direct_equal);
+  sel->root	= g_new0 (SelectionNode, 1);
+  sel->includes = g_ptr_array_new_with_free_func ((GDestroyNotify)
+						  &g_pattern_spec_free);
+  sel->excludes = g_ptr_array_new_with_free_func ((GDestroyNotify)
+						  &g_pattern_spec_free);
+
+  return sel;
+}
+
+void
+nks_selection_free (NksSelection *sel)
+{
+  if (sel == NULL)
+    return;
+
+  g_hash_table_destroy (sel->path_set);
+  g_hash_table_destroy (sel->matched);
+  g_ptr_array_free (sel->paths, true);
+  node_free (sel->root);
+  g_ptr_array_free (sel->includes, true);
+  g_ptr_array_free (sel->excludes, true);
+  g_free (sel);
+}
+
+/* Adds the directories of path to the trie, stopping at the last segment or
+ * the first one containing a wildcard, and returns the deepest node. */
+static SelectionNode *
+add_directories (NksSelection *sel, const char *path, bool pattern)
+{
+  SelectionNode *node = sel->root;
+  const char *sl;
+  size_t len;
+
+  while ((sl = strchr (path, SEP_CHAR)) != NULL)
+    {
+      len = sl - path;
+      if (pattern && strcspn (path, "*?") < len)
+	break;
+
+      node = node_child (node, path, len);
+      path = sl + 1;
+    }
+
+  return node;
+}
+
+/* Exact paths are matched without regard to case, like archive lookups. */
+static char *
+fold_path (const char *path)
+{
+  return g_utf8_casefold (path, -1);
+}
+
+void
+nks_selection_add_path (NksSelection *sel, const char *path)
+{
+  SelectionNode *node;
+  char *copy;
+  char *folded;
+  const char *name;
+
+  copy = native_path (path);
+  folded = fold_path (copy);
+
+  if (g_hash_table_contains (sel->path_set, folded))
+    {
+      g_free (folded);
+      g_free (copy);
+      return;
+    }
+
+  g_ptr_array_add (sel->paths, copy);
+  g_hash_table_insert (sel->path_set, folded, copy);
+
+  /* The last segment gets a node too, so that naming a directory selects
+   * everything below it. */
+  node = add_directories (sel, folded, false);
+  name = strrchr (folded, SEP_CHAR);
+  name = (name != NULL ? name + 1 : folded);
+  node_child (node, name, strlen (name))->path = copy;
+}
+
+int
+nks_selection_add_paths_from (NksSelection *sel, const char *file_name)
+{
+  char line[FILENAME_MAX + 2];
+  size_t len;
+  FILE *f;
+  int r = 0;
+
+  if (strcmp (file_name, "-") == 0)
+    f = stdin;
+  else
+    {
+      f = fopen (file_name, "r");
+      if (f == NULL)
+	return -errno;
+    }
+
+  /* One path per line; empty lines are ignored. */
+  while (fgets (line, sizeof (line), f) != NULL)
+    {
+      len = strcspn (line, "\r\n");
+      if (line[len] == '\0' && !feof (f))
+	{
+	  r = -ENAMETOOLONG;
+	  break;
+	}
+
+      line[len] = '\0';
+      if (len > 0)
+	nks_selection_add_path (sel, line);
+    }
+
+  if (r == 0 && ferror (f))
+    r = -EIO;
+
+  if (f != stdin)
+    fclose (f);
+
+  return r;
+}
+
+void
+nks_selection_add_include (NksSelection *sel, const char *pattern)
+{
+  char *copy = native_path (pattern);
+  char *folded = fold_path (copy);
+
+  /* The trie only narrows down where to look, so folding the pattern for
+   * it is harmless. */
+  g_ptr_array_add (sel->includes, g_pattern_spec_new (copy));
+  add_directories (sel, folded, true)->patterns = true;
+
+  g_free (folded);
+  g_free (copy);
+}
+
+void
+nks_selection_add_exclude (NksSelection *sel, const char *pattern)
+{
+  char *copy = native_path (pattern);
+
+  g_ptr_array_add (sel->excludes, g_pattern_spec_new (copy));
+
+  g_free (copy);
+}
+
+static bool
+match_any (GPtrArray *specs, const char *str)
+{
+  guint n;
+
+  for (n = 0; n < specs->len; n++)
+    {
+      if (pattern_match (g_ptr_array_index (specs, n), str))
+	return true;
+    }
+
+  return false;
+}
+
+/* Checks path and all the directories above it against the excludes. */
+static bool
+excluded (const NksSelection *sel, const char *path)
+{
+  char buffer[FILENAME_MAX + 1];
+  const char *sl;
+
+  if (sel->excludes->len == 0)
+    return false;
+
+  sl = strchr (path, SEP_CHAR);
+  while (sl != NULL && (size_t) (sl - path) < sizeof (buffer))
+    {
+      memcpy (buffer, path, sl - path);
+      buffer[sl - path] = '\0';
+
+      if (match_any (sel->excludes, buffer))
+	return true;
+
+      sl = strchr (sl + 1, SEP_CHAR);
+    }
+
+  return match_any (sel->excludes, path);
+}
+
+static bool
+selects_all (const NksSelection *sel)
+{
+  return (sel->paths->len == 0 && sel->includes->len == 0);
+}
+
+/* Follows the case-folded path down the trie, for as long as it goes.
+ * Returns the node of the first exact path above or at the end of the path,
+ * or else the last node reached.  complete tells whether the whole path was
+ * followed, and patterns whether an include pattern may match below. */
+static const SelectionNode *
+follow_path (const NksSelection *sel, const char *folded, bool *complete,
+	     bool *patterns)
+{
+  const SelectionNode *node = sel->root;
+  const SelectionNode *child;
+  char segment[FILENAME_MAX + 1];
+  const char *sl;
+  size_t len;
+
+  *complete = false;
+  *patterns = false;
+
+  for (;;)
+    {
+      if (node->patterns)
+	*patterns = true;
+
+      if (node->path != NULL)
+	return node;
+
+      sl = strchr (folded, SEP_CHAR);
+      len = (sl != NULL ? (size_t) (sl - folded) : strlen (folded));
+      if (len >= sizeof (segment) || node->children == NULL)
+	return node;
+
+      memcpy (segment, folded, len);
+      segment[len] = '\0';
+
+      child = g_hash_table_lookup (node->children, segment);
+      if (child == NULL)
+	return node;
+
+      node = child;
+      if (sl == NULL)
+	{
+	  *complete = true;
+	  return node;
+	}
+
+      folded = sl + 1;
+    }
+}
+
+bool
+nks_selection_match_file (NksSelection *sel, const char *path)
+{
+  const SelectionNode *node;
+  const char *exact;
+  char *folded;
+  bool complete, patterns;
+
+  if (excluded (sel, path))
+    return false;
+
+  if (selects_all (sel))
+    return true;
+
+  folded = fold_path (path);
+  exact = g_hash_table_lookup (sel->path_set, folded);
+
+  /* Otherwise a directory above may have been named. */
+  if (exact == NULL && sel->paths->len > 0)
+    {
+      node = follow_path (sel, folded, &complete, &patterns);
+      exact = node->path;
+    }
+
+  g_free (folded);
+
+  if (exact != NULL)
+    {
+      g_hash_table_add (sel->matched, (gpointer) exact);
+      return true;
+    }
+
+  return match_any (sel->includes, path);
+}
+
+bool
+nks_selection_match_directory (NksSelection *sel, const char *path)
+{
+  const SelectionNode *node;
+  char *folded;
+  bool complete, patterns;
+
+  if (excluded (sel, path))
+    return false;
+
+  if (selects_all (sel))
+    return true;
+
+  folded = fold_path (path);
+  node = follow_path (sel, folded, &complete, &patterns);
+  g_free (folded);
+
+  /* A named directory counts as found even if it turns out empty. */
+  if (node->path != NULL)
+    {
+      g_hash_table_add (sel->matched, (gpointer) node->path);
+      return true;
+    }
+
+  return (complete || patterns);
+}
+
+bool
+nks_selection_select_directory (NksSelection *sel, const char *path)
+{
+  const SelectionNode *node;
+  char *folded;
+  bool complete, patterns;
+
+  if (excluded (sel, path))
+    return false;
+
+  if (selects_all (sel))
+    return true;
+
+  folded = fold_path (path);
+  node = follow_path (sel, folded, &complete, &patterns);
+  g_free (folded);
+
+  if (node->path != NULL)
+    {
+      g_hash_table_add (sel->matched, (gpointer) node->path);
+      return true;
+    }
+
+  return match_any (sel->includes, path);
+}
+
+bool
+nks_selection_is_exact (const NksSelection *sel)
+{
+  return (sel->paths->len > 0 && sel->includes->len == 0);
+}
+
+const GPtrArray *
+nks_selection_get_paths (const NksSelection *sel)
+{
+  return sel->paths;
+}
+
+GPtrArray *
+nks_selection_get_unmatched (const NksSelection *sel)
+{
+  GPtrArray *unmatched;
+  const char *path;
+  guint n;
+
+  unmatched = g_ptr_array_new ();
+
+  for (n = 0; n < sel->paths->len; n++)
+    {
+      path = g_ptr_array_index (sel->paths, n);
+      if (!g_hash_table_contains (sel->matched, path))
+	g_ptr_array_add (unmatched, (gpointer) path);
+    }
+
+  return unmatched;
+}
@@ -0,0 +1,47 @@
+#ifndef NKS_SELECTION_H
+#define NKS_SELECTION_H
+
+#include <glib.h>
+#include <stdbool.h>
+
+/*
+ * The files picked out on the command line of unnks.  Exact paths are kept in
+ * a hash set.  They, together with the leading directories of include
+ * patterns up to the first wildcard, also form a trie, so that a directory
+ * with nothing selected below it can be skipped without listing it.  Paths
+ * use SEP as the separator, like the paths unnks builds.
+ *
+ * Exact paths ignore case, as lookups in archives do, and naming a directory
+ * selects everything below it.  An empty selection selects every file.
+ * Exclude patterns always win, and excluding a directory excludes everything
+ * below it.
+ */
+typedef struct NksSelection NksSelection;
+
+NksSelection *nks_selection_new (void);
+void nks_selection_free (NksSelection *sel);
+
+void nks_selection_add_path (NksSelection *sel, const char *path);
+int nks_selection_add_paths_from (NksSelection *sel, const char *file_name);
+void nks_selection_add_include (NksSelection *sel, const char *pattern);
+void nks_selection_add_exclude (NksSelection *sel, const char *pattern);
+
+bool nks_selection_match_file (NksSelection *sel, const char *path);
+
+/* Whether something below the directory may be selected, so that it has to be
+ * listed.  This says nothing about whether there actually is. */
+bool nks_selection_match_directory (NksSelection *sel, const char *path);
+
+/* Whether the directory itself is selected, by its own path or one above it,
+ * and so is to be listed or created even if nothing below it is. */
+bool nks_selection_select_directory (NksSelection *sel, const char *path);
+
+/* Whether only exact paths were given, which can be looked up directly. */
+bool nks_selection_is_exact (const NksSelection *sel);
+const GPtrArray *nks_selection_get_paths (const NksSelection *sel);
+
+/* The exact paths no file has matched yet, in the order they were added.
+ * The array has to be freed, but not the paths. */
+GPtrArray *nks_selection_get_unmatched (const NksSelection *sel);
+
+#endif
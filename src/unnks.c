@@ -6,8 +6,13 @@
 #include <locale.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef _WIN32
+# include <io.h>
+#endif
 
+#include "arena.h"
 #include "nks.h"
+#include "selection.h"
 #include "util.h"
 
 typedef enum
@@ -19,10 +24,57 @@ typedef enum
 
 static const char  *file_name  = NULL;    /* File to open */
 static const char  *directory  = NULL;    /* Directory to extract to */
-static char       **file_names = NULL;    /* Files to extract or NULL */
-static size_t       extr_count = 0;       /* Number of extracted files */
+static const char  *files_from = NULL;    /* File listing files to select */
+static NksSelection *selection = NULL;    /* Files to extract or list */
 static Operation    operation  = OP_NONE;
 static bool         verbose    = false;
+static bool         use_cache  = true;    /* Cache the directory index */
+static bool         show_stats = false;   /* Print counters when done */
+static unsigned int jobs       = 1;       /* Number of extraction threads */
+static size_t       stream_memory = 64 * 1024 * 1024; /* For -f - */
+
+/*
+ * With more than one job, files are not extracted while the tree is walked.
+ * Instead they are queued as tasks, in walk order, and extracted by a pool of
+ * threads.  Directory tasks only carry the line to print in verbose mode, so
+ * that output appears in the same order as with a single job.
+ */
+typedef struct
+{
+  char	  *path;
+  NksEntry entry;
+  int	   result;
+  bool	   done;
+} ExtractTask;
+
+typedef struct
+{
+  Nks	  *nks;
+  GArray  *tasks;
+  gint	   next;	/* Index of the next task to take */
+  GMutex   lock;
+  GCond	   cond;
+} ExtractQueue;
+
+static ExtractQueue *queue = NULL;
+
+/*
+ * Unless it is selected itself, a directory is only listed or created once
+ * something selected turns up below it, so that patterns do not leave empty
+ * directories behind.  The paths of those done already are kept here.
+ */
+static GHashTable *shown_directories = NULL;
+
+/*
+ * The directories being listed form a stack: each level appends its entries
+ * to entries and their names to names, and drops both again once its
+ * subdirectories are done.
+ */
+typedef struct
+{
+  GArray   *entries;	/* NksEntry, named from names */
+  NksArena *names;
+} Traversal;
 
 static void
 print_help (const char *argv0)
@@ -34,14 +86,30 @@ print_help (const char *argv0)
     "  -x  --extract        Extract files from archive\n"
     "  -t  --list           List files in archive\n"
     "\n"
-    "  -f  --file=ARCHIVE   Operate on ARCHIVE\n"
+    "  -f  --file=ARCHIVE   Operate on ARCHIVE, or stdin if ARCHIVE is -\n"
     "\n"
     "Options:\n"
     "  -C  --directory=DIR  Extract to DIR\n"
+    "  -T  --files-from=FILE\n"
+    "                       Select the files named in FILE, one per line\n"
+    "      --include=PATTERN\n"
+    "                       Select the files whose path matches PATTERN\n"
+    "      --exclude=PATTERN\n"
+    "                       Leave out files and directories matching PATTERN\n"
     "  -v  --verbose        Verbose operation\n"
+    "  -j  --jobs=N         Extract N files at a time\n"
+    "      --no-index-cache Do not use or store a cached directory index\n"
+    "      --stats          Print I/O and timing statistics when done\n"
+    "      --stream-memory=MIB\n"
+    "                       Keep up to MIB of a streamed archive in memory\n"
     "      --version        Print version and license information\n"
     "  -h  --help           Print out usage instructions\n"
     "\n"
+    "FILES and the paths in --files-from are matched ignoring case, and a\n"
+    "directory selects everything below it.  Only those are read when they\n"
+    "are extracted without patterns.  In patterns, * and ? also match the\n"
+    "directory separator.\n"
+    "\n"
     "e.g. to extract, use: %s -xvf archive.nks\n",
     argv0, argv0);
 }
@@ -62,13 +130,21 @@ static void
 parse_arguments (int argc, char **argv)
 {
   int op, index = 0;
+  int r;
   static struct option options[] =
   {
     {"directory", true,  NULL, 'C'},
+    {"exclude",   true,  NULL, 'E'},
     {"extract",   false, NULL, 'x'},
     {"file",      true,  NULL, 'f'},
+    {"files-from", true, NULL, 'T'},
     {"help",      false, NULL, 'h'},
+    {"include",   true,  NULL, 'N'},
+    {"jobs",      true,  NULL, 'j'},
     {"list",      false, NULL, 't'},
+    {"no-index-cache", false, NULL, 'I'},
+    {"stats",     false, NULL, 'S'},
+    {"stream-memory", true, NULL, 'M'},
     {"verbose",   false, NULL, 'v'},
     {"version",   false, NULL, 'V'},
     {NULL,        false, NULL, 0}
@@ -76,7 +152,7 @@ parse_arguments (int argc, char **argv)
 
   for (;;)
     {
-      op = getopt_long (argc, argv, "f:C:hxtvV", options, &index);
+      op = getopt_long (argc, argv, "f:C:hj:T:xtvV", options, &index);
       if (op == -1)
 	break;
 
@@ -125,6 +201,64 @@ parse_arguments (int argc, char **argv)
 	  verbose = true;
 	  break;
 
+	case 'j':
+	  {
+	    char *end;
+	    unsigned long n;
+
+	    n = strtoul (optarg, &end, 10);
+	    if (*optarg == '\0' || *end != '\0' || n < 1 || n > 1024)
+	      {
+		fprintf_utf8 (stderr, "%s: Invalid number of jobs: %s\n",
+			      argv[0], optarg);
+		exit (EXIT_FAILURE);
+	      }
+	    jobs = n;
+	  }
+	  break;
+
+	case 'T':
+	  if (files_from != NULL)
+	    {
+	      fprintf_utf8 (stderr, "%s: Only one file list may be given.\n",
+			    argv[0]);
+	      exit (EXIT_FAILURE);
+	    }
+	  files_from = optarg;
+	  break;
+
+	case 'N':
+	  nks_selection_add_include (selection, optarg);
+	  break;
+
+	case 'E':
+	  nks_selection_add_exclude (selection, optarg);
+	  break;
+
+	case 'I':
+	  use_cache = false;
+	  break;
+
+	case 'S':
+	  show_stats = true;
+	  break;
+
+	case 'M':
+	  {
+	    char *end;
+	    unsigned long n;
+
+	    n = strtoul (optarg, &end, 10);
+	    if (*optarg == '\0' || *end != '\0' || n > SIZE_MAX / (1024 * 1024))
+	      {
+		fprintf_utf8 (stderr, "%s: Invalid amount of memory: %s\n",
+			      argv[0], optarg);
+		exit (EXIT_FAILURE);
+	      }
+	    stream_memory = n * 1024 * 1024;
+	  }
+	  break;
+
 	case 'V':
 	  print_version ();
 	  exit (EXIT_SUCCESS);
@@ -142,50 +276,170 @@ parse_arguments (int argc, char **argv)
       exit (EXIT_FAILURE);
     }
 
-  if (optind < argc)
-    file_names = argv + optind;
+  for (; optind < argc; optind++)
+    nks_selection_add_path (selection, argv[optind]);
+
+  if (files_from != NULL)
+    {
+      if (strcmp (files_from, "-") == 0 && file_name != NULL
+	  && strcmp (file_name, "-") == 0)
+	{
+	  fprintf_utf8 (stderr, "%s: The archive and the file list cannot "
+			"both be read from stdin.\n", argv[0]);
+	  exit (EXIT_FAILURE);
+	}
+
+      r = nks_selection_add_paths_from (selection, files_from);
+      if (r != 0)
+	{
+	  fprintf_utf8 (stderr, "%s: %s\n", files_from, strerror (-r));
+	  exit (EXIT_FAILURE);
+	}
+    }
 }
 
 static void
-free_entry_list (GList *list)
+queue_task (const char *path, const NksEntry *entry)
 {
-  GList *lp;
+  ExtractTask task;
+
+  memset (&task, 0, sizeof (task));
+  task.path = g_strdup (path);
 
-  for (lp = list; lp != NULL; lp = lp->next)
+  if (entry != NULL)
+    nks_entry_copy (entry, &task.entry);
+  else
+    task.entry.type = NKS_ENT_DIRECTORY;
+
+  g_array_append_val (queue->tasks, task);
+}
+
+static gpointer
+extract_worker (gpointer data)
+{
+  ExtractTask *task;
+  guint n;
+  int r;
+
+  /* Tasks are taken in order from one shared counter, so no thread idles
+   * while another still has files left, whichever directory they are in. */
+  for (;;)
     {
-      nks_entry_free ((NksEntry *) lp->data);
-      g_free (lp->data);
+      n = g_atomic_int_add (&queue->next, 1);
+      if (n >= queue->tasks->len)
+	break;
+
+      task = &g_array_index (queue->tasks, ExtractTask, n);
+
+      r = 0;
+      if (task->entry.type == NKS_ENT_FILE)
+	r = nks_extract_file_entry (queue->nks, &task->entry, task->path);
+
+      g_mutex_lock (&queue->lock);
+      task->result = r;
+      task->done   = true;
+      g_cond_broadcast (&queue->cond);
+      g_mutex_unlock (&queue->lock);
     }
 
-  g_list_free (list);
+  return NULL;
+}
+
+static bool
+run_queue (void)
+{
+  GThread **threads;
+  ExtractTask *task;
+  bool ret = true;
+  guint n;
+
+  threads = g_new (GThread *, jobs);
+  for (n = 0; n < jobs; n++)
+    threads[n] = g_thread_new ("extract", &extract_worker, NULL);
+
+  /* Report results in walk order, as a single job would. */
+  for (n = 0; n < queue->tasks->len; n++)
+    {
+      task = &g_array_index (queue->tasks, ExtractTask, n);
+
+      g_mutex_lock (&queue->lock);
+      while (!task->done)
+	g_cond_wait (&queue->cond, &queue->lock);
+      g_mutex_unlock (&queue->lock);
+
+      if (verbose)
+	puts_utf8 (task->path);
+
+      if (task->entry.type != NKS_ENT_FILE)
+	continue;
+
+      if (task->result != 0)
+	{
+	  fprintf_utf8 (stderr, "%s: %s\n", task->path,
+			strerror (-task->result));
+	  ret = false;
+	}
+    }
+
+  for (n = 0; n < jobs; n++)
+    g_thread_join (threads[n]);
+
+  g_free (threads);
+
+  return ret;
+}
+
+static void
+free_queue (void)
+{
+  ExtractTask *task;
+  guint n;
+
+  for (n = 0; n < queue->tasks->len; n++)
+    {
+      task = &g_array_index (queue->tasks, ExtractTask, n);
+      g_free (task->path);
+
+      if (task->entry.type == NKS_ENT_FILE)
+	nks_entry_free (&task->entry);
+    }
+
+  g_array_free (queue->tasks, true);
+  g_mutex_clear (&queue->lock);
+  g_cond_clear (&queue->cond);
+  g_free (queue);
+  queue = NULL;
 }
 
 static bool traverse_file (Nks *nks, NksEntry *file_entry, const char *prefix);
-static bool traverse_directory (Nks *nks, NksEntry *dir_entry,
-				const char *prefix);
+static bool traverse_directory (Nks *nks, const NksEntry *dir_entry,
+				const char *prefix, Traversal *t);
 
+/* The entries of a level are those from first to the end of t->entries,
+ * which is the same again whenever a subdirectory has been traversed. */
 static bool
-traverse_directories (Nks *nks, GList *list, const char *prefix)
+traverse_directories (Nks *nks, Traversal *t, guint first, const char *prefix)
 {
   char prefix_buffer[FILENAME_MAX + 1];
-  NksEntry *entry;
-  GList *lp;
+  NksEntry entry;
   bool ret = true;
+  guint n;
 
-  if (list == NULL)
-    return true;
-
-  for (lp = list; lp != NULL; lp = lp->next)
+  for (n = first; n < t->entries->len; n++)
     {
-      entry = lp->data;
+      entry = g_array_index (t->entries, NksEntry, n);
 
-      if (entry->type != NKS_ENT_DIRECTORY)
+      if (entry.type != NKS_ENT_DIRECTORY)
 	continue;
 
-      join_path_segments (prefix, entry->name,
+      join_path_segments (prefix, entry.name,
 			  prefix_buffer, sizeof (prefix_buffer));
 
-      if (!traverse_directory (nks, entry, prefix_buffer))
+      /* Directories with nothing selected below are not even listed. */
+      if (!nks_selection_match_directory (selection, prefix_buffer))
+	continue;
+
+      if (!traverse_directory (nks, &entry, prefix_buffer, t))
 	ret = false;
     }
 
@@ -193,18 +447,15 @@ traverse_directories (Nks *nks, GList *list, const char *prefix)
 }
 
 static bool
-traverse_files (Nks *nks, GList *list, const char *prefix)
+traverse_files (Nks *nks, Traversal *t, guint first, const char *prefix)
 {
   NksEntry *entry;
   bool ret = true;
-  GList *lp;
+  guint n;
 
-  if (list == NULL)
-    return true;
-
-  for (lp = list; lp != NULL; lp = lp->next)
+  for (n = first; n < t->entries->len; n++)
     {
-      entry = lp->data;
+      entry = &g_array_index (t->entries, NksEntry, n);
 
       if (entry->type == NKS_ENT_DIRECTORY)
 	continue;
@@ -217,88 +468,110 @@ traverse_files (Nks *nks, GList *list, const char *prefix)
 }
 
 static bool
-add_entry_to_list (Nks *nks, const NksEntry *entry, GList **list)
+add_entry (Nks *nks, const NksEntry *entry, Traversal *t)
 {
-  NksEntry *new_entry;
+  NksEntry copy;
 
-  new_entry = g_malloc0 (sizeof (*new_entry));
-  nks_entry_copy (entry, new_entry);
-  *list = g_list_append (*list, new_entry);
+  copy.name   = nks_arena_strdup (t->names, entry->name);
+  copy.type   = entry->type;
+  copy.offset = entry->offset;
+  g_array_append_val (t->entries, copy);
 
   return true;
 }
 
+/* Lists or creates the directory, and before it those above it, unless that
+ * has been done already.  Returns false on error. */
 static bool
-traverse_directory (Nks *nks, NksEntry *dir_entry, const char *prefix)
+show_directory (const char *prefix)
 {
   char buffer[FILENAME_MAX + 1];
-  GList *list = NULL;
-  uint32_t n;
-  bool ret = true;
-  int r;
+  const char *sl;
 
-  assert (dir_entry->type == NKS_ENT_DIRECTORY);
-
-  snprintf (buffer, sizeof (buffer), "%s" SEP, prefix);
+  if (prefix[0] == '\0' || g_hash_table_contains (shown_directories, prefix))
+    return true;
 
-  if (operation == OP_LIST)
+  sl = strrchr (prefix, SEP_CHAR);
+  if (sl != NULL)
     {
-      if (prefix[0] != '\0')
-	puts_utf8 (buffer);
+      g_strlcpy (buffer, prefix, sl - prefix + 1);
+      if (!show_directory (buffer))
+	return false;
     }
 
-  if (operation == OP_EXTRACT && prefix[0] != '\0')
+  if ((size_t) snprintf (buffer, sizeof (buffer), "%s" SEP, prefix)
+      >= sizeof (buffer))
     {
-      if (file_names != NULL)
-	{
-	  size_t len = strlen (buffer);
+      fprintf_utf8 (stderr, "%s: %s\n", prefix, strerror (ENAMETOOLONG));
+      return false;
+    }
 
-	  for (n = 0; file_names[n] != NULL; n++)
-	    {
-	      if (strncmp (buffer, file_names[n], len) == 0)
-		break;
-	    }
+  g_hash_table_add (shown_directories, g_strdup (prefix));
 
-	  if (file_names[n] == NULL)
-	    return true;
-	}
+  if (operation == OP_LIST)
+    {
+      puts_utf8 (buffer);
+      return true;
+    }
 
-      if (!valid_file_name (prefix))
-	{
-	  fprintf_utf8 (stderr, "%s: Invalid directory name.\n", prefix);
-	  goto err;
-	}
+  if (!valid_file_name (prefix))
+    {
+      fprintf_utf8 (stderr, "%s: Invalid directory name.\n", prefix);
+      return false;
+    }
 
-      if (mkdir (prefix, 0777) != 0 && errno != EEXIST)
-	{
-	  perror (prefix);
-	  goto err;
-	}
+  if (mkdir (prefix, 0777) != 0 && errno != EEXIST)
+    {
+      perror (prefix);
+      return false;
+    }
 
-      if (verbose)
+  if (verbose)
+    {
+      if (queue != NULL)
+	queue_task (buffer, NULL);
+      else
 	puts_utf8 (buffer);
     }
 
-  r = nks_list_dir_entry (nks, dir_entry,
-			  (NksTraverseFunc) add_entry_to_list, &list);
+  return true;
+}
+
+static bool
+traverse_directory (Nks *nks, const NksEntry *dir_entry, const char *prefix,
+		    Traversal *t)
+{
+  char buffer[FILENAME_MAX + 1];
+  guint first = t->entries->len;
+  NksArenaMark mark = nks_arena_mark (t->names);
+  bool ret = true;
+  int r;
+
+  assert (dir_entry->type == NKS_ENT_DIRECTORY);
+
+  snprintf (buffer, sizeof (buffer), "%s" SEP, prefix);
+
+  if (nks_selection_select_directory (selection, prefix)
+      && !show_directory (prefix))
+    ret = false;
+
+  r = nks_list_dir_entry (nks, dir_entry, (NksTraverseFunc) add_entry, t);
   if (r != 0)
     {
       fprintf_utf8 (stderr, "%s: %s\n", buffer, strerror (-r));
       ret = false;
     }
 
-  if (!traverse_directories (nks, list, prefix))
+  if (!traverse_directories (nks, t, first, prefix))
     ret = false;
 
-  if (!traverse_files (nks, list, prefix))
+  if (!traverse_files (nks, t, first, prefix))
     ret = false;
 
-  free_entry_list (list);
-  return ret;
+  g_array_set_size (t->entries, first);
+  nks_arena_release (t->names, mark);
 
-err:
-  free_entry_list (list);
-  return false;
+  return ret;
 }
 
 static bool
@@ -313,26 +586,18 @@ traverse_file (Nks *nks, NksEntry *file_entry, const char *prefix)
 
   join_path_segments (prefix, file_entry->name, buffer, sizeof (buffer));
 
+  if (!nks_selection_match_file (selection, buffer))
+    return true;
+
+  if (!show_directory (prefix))
+    return false;
+
   if (operation == OP_LIST)
     puts_utf8 (buffer);
 
   if (operation != OP_EXTRACT)
     return true;
 
-  if (file_names != NULL)
-    {
-      size_t n;
-
-      for (n = 0; file_names[n] != NULL; n++)
-	{
-	  if (strcmp (file_names[n], buffer) == 0)
-	    break;
-	}
-
-      if (file_names[n] == NULL)
-	return true;
-    }
-
   if (!valid_file_name (buffer))
     {
       fprintf_utf8 (stderr, "%s: Invalid file name.\n", buffer);
@@ -342,6 +607,12 @@ traverse_file (Nks *nks, NksEntry *file_entry, const char *prefix)
   switch (file_entry->type)
     {
     case NKS_ENT_FILE:
+      if (queue != NULL)
+	{
+	  queue_task (buffer, file_entry);
+	  break;
+	}
+
       if (verbose)
 	puts_utf8 (buffer);
 
@@ -351,9 +622,7 @@ traverse_file (Nks *nks, NksEntry *file_entry, const char *prefix)
 
       r = nks_extract_file_entry (nks, file_entry, buffer);
 
-      if (r == 0)
-	extr_count++;
-      else
+      if (r != 0)
 	fprintf_utf8 (stderr, "%s: %s\n", buffer, strerror (-r));
 
       ret = (r == 0);
@@ -370,16 +639,161 @@ traverse_file (Nks *nks, NksEntry *file_entry, const char *prefix)
   return ret;
 }
 
+/* Converts the directory of an entry of a sorted or streamed walk to a path
+ * with SEP as separator. */
+static void
+native_dir (const char *dir, char *prefix, size_t size)
+{
+  size_t x;
+
+  g_strlcpy (prefix, dir, size);
+
+  for (x = 0; prefix[x] != '\0'; x++)
+    {
+      if (prefix[x] == '/')
+	prefix[x] = SEP_CHAR;
+    }
+}
+
+/* Leaves directories with nothing selected below out of a sorted walk;
+ * files are checked once they are visited. */
+static bool
+select_entry (Nks *nks, const char *dir, const NksEntry *entry, bool *ok)
+{
+  char prefix[FILENAME_MAX + 1];
+  char buffer[FILENAME_MAX + 1];
+
+  if (entry->type != NKS_ENT_DIRECTORY)
+    return true;
+
+  native_dir (dir, prefix, sizeof (prefix));
+  join_path_segments (prefix, entry->name, buffer, sizeof (buffer));
+
+  return nks_selection_match_directory (selection, buffer);
+}
+
+/* Extracts or lists one entry of a sorted or streamed walk. */
+static bool
+visit_entry (Nks *nks, const char *dir, const NksEntry *entry, bool *ok)
+{
+  char prefix[FILENAME_MAX + 1];
+  char buffer[FILENAME_MAX + 1];
+
+  native_dir (dir, prefix, sizeof (prefix));
+
+  if (entry->type != NKS_ENT_DIRECTORY)
+    {
+      if (!traverse_file (nks, (NksEntry *) entry, prefix))
+	*ok = false;
+
+      return true;
+    }
+
+  join_path_segments (prefix, entry->name, buffer, sizeof (buffer));
+
+  if (nks_selection_select_directory (selection, buffer)
+      && !show_directory (buffer))
+    *ok = false;
+
+  return true;
+}
+
+/* Extracts just the named files and directories, looking each one up
+ * instead of reading the whole tree.  Returns the result of the walk. */
+static int
+walk_selected_paths (Nks *nks, bool *ok)
+{
+  const GPtrArray *paths;
+  char **lookups;
+  int *results;
+  guint n;
+  size_t x;
+  int r;
+
+  paths	  = nks_selection_get_paths (selection);
+  lookups = g_new (char *, paths->len);
+  results = g_new (int, paths->len);
+
+  for (n = 0; n < paths->len; n++)
+    {
+      lookups[n] = g_strdup (g_ptr_array_index (paths, n));
+
+      for (x = 0; lookups[n][x] != '\0'; x++)
+	{
+	  if (lookups[n][x] == SEP_CHAR)
+	    lookups[n][x] = '/';
+	}
+    }
+
+  r = nks_walk_paths (nks, (const char * const *) lookups, paths->len,
+		      (NksStreamFunc) &visit_entry, ok, results);
+
+  /* Paths which are not there are reported with the unmatched ones. */
+  for (n = 0; n < paths->len; n++)
+    {
+      if (results[n] != 0 && results[n] != -ENOENT && results[n] != -ENOTDIR)
+	{
+	  fprintf_utf8 (stderr, "%s: %s\n",
+			(const char *) g_ptr_array_index (paths, n),
+			strerror (-results[n]));
+	  *ok = false;
+	}
+
+      g_free (lookups[n]);
+    }
+
+  g_free (lookups);
+  g_free (results);
+
+  return r;
+}
+
+static void
+print_stats (Nks *nks)
+{
+  NksStats s;
+
+  if (nks_get_stats (nks, &s) != 0)
+    return;
+
+  fprintf_utf8 (stderr,
+    "Bytes read:           %" PRIu64 "\n"
+    "Bytes written:        %" PRIu64 "\n"
+    "Read calls:           %" PRIu64 "\n"
+    "Seek calls:           %" PRIu64 "\n"
+    "Write calls:          %" PRIu64 "\n"
+    "Directories parsed:   %" PRIu64 "\n"
+    "Entries decoded:      %" PRIu64 "\n"
+    "Bytes decrypted:      %" PRIu64 "\n"
+    "Keystreams generated: %" PRIu64 "\n"
+    "Key cache:            %" PRIu64 " hits, %" PRIu64 " misses\n"
+    "Index cache:          %" PRIu64 " hits, %" PRIu64 " misses\n"
+    "Parse time:           %.3f ms\n"
+    "Decrypt time:         %.3f ms\n"
+    "Write time:           %.3f ms\n",
+    s.bytes_read, s.bytes_written, s.read_calls, s.seek_calls, s.write_calls,
+    s.directories_parsed, s.entries_decoded, s.bytes_decrypted,
+    s.keystreams_generated, s.key_cache_hits, s.key_cache_misses,
+    s.index_cache_hits, s.index_cache_misses, s.parse_ns / 1e6,
+    s.decrypt_ns / 1e6, s.write_ns / 1e6);
+}
+
 int
 main (int argc, char **argv)
 {
   NksEntry root_entry;
+  GPtrArray *unmatched;
+  unsigned int flags;
   Nks *nks;
+  guint n;
   int ret;
   int r;
 
   setlocale (LC_ALL, "");
 
+  selection = nks_selection_new ();
+  shown_directories = g_hash_table_new_full (&g_str_hash, &g_str_equal,
+					     &g_free, NULL);
   parse_arguments (argc, argv);
 
   if (file_name == NULL)
@@ -389,7 +803,39 @@ main (int argc, char **argv)
       goto end;
     }
 
-  r = nks_open (file_name, &nks);
+  flags = NKS_OPEN_MMAP;
+
+  /* A walk reads every directory once anyway, so building an index only
+   * pays off if it is kept for later runs.  Named paths are looked up
+   * directly, which reads only the directories along them. */
+  if (use_cache
+      && (operation != OP_EXTRACT || !nks_selection_is_exact (selection)))
+    flags |= NKS_OPEN_INDEX_CACHE;
+  flags |= (show_stats ? NKS_OPEN_STATS : 0);
+
+  if (operation != OP_EXTRACT)
+    jobs = 1;
+
+  if (strcmp (file_name, "-") == 0)
+    {
+      /* Files are extracted as the stream reaches them. */
+      jobs = 1;
+#ifdef _WIN32
+      _setmode (STDIN_FILENO, O_BINARY);
+#endif
+      r = nks_open_fd_flags (STDIN_FILENO, NKS_OPEN_STREAM
+			     | (flags & NKS_OPEN_STATS), &nks);
+    }
+  else
+    {
+      r = nks_open_flags (file_name,
+			  flags | (jobs > 1 ? NKS_OPEN_REENTRANT : 0), &nks);
+      if (r == -ENOTSUP && jobs > 1)
+	{
+	  jobs = 1;
+	  r = nks_open_flags (file_name, flags, &nks);
+	}
+    }
   if (r != 0)
     {
       fprintf_utf8 (stderr, "%s: %s\n", file_name, strerror (-r));
@@ -415,43 +861,87 @@ main (int argc, char **argv)
   root_entry.offset = 0;
   root_entry.type   = NKS_ENT_DIRECTORY;
 
-#ifdef _WIN32
-  if (file_names != NULL)
+  if (jobs > 1)
     {
-      size_t n, x;
+      queue = g_malloc0 (sizeof (*queue));
+      queue->nks   = nks;
+      queue->tasks = g_array_new (false, false, sizeof (ExtractTask));
+      g_mutex_init (&queue->lock);
+      g_cond_init (&queue->cond);
+    }
 
-      for (n = 0; file_names[n] != NULL; n++)
-	{
-	  for (x = 0; file_names[n][x] != 0; x++)
-	    {
-	      if (file_names[n][x] == '/')
-		file_names[n][x] = SEP_CHAR;
-	    }
-	}
+  if (strcmp (file_name, "-") == 0)
+    {
+      bool ok = true;
+
+      r = nks_stream_walk (nks, stream_memory,
+			   (NksStreamFunc) &visit_entry, &ok);
+      if (r != 0)
+	fprintf_utf8 (stderr, "%s: %s\n", file_name, strerror (-r));
+
+      ret = (r == 0 && ok ? EXIT_SUCCESS : EXIT_FAILURE);
     }
-#endif
+  else if (operation == OP_EXTRACT)
+    {
+      bool ok = true;
+
+      /* Directories are created first, then files are extracted in the
+       * order of their data in the archive. */
+      if (nks_selection_is_exact (selection))
+	r = walk_selected_paths (nks, &ok);
+      else
+	r = nks_walk_sorted_filter (nks, (NksStreamFunc) &select_entry,
+				    (NksStreamFunc) &visit_entry, &ok);
+      if (r != 0)
+	fprintf_utf8 (stderr, "%s: %s\n", file_name, strerror (-r));
+
+      ret = (r == 0 && ok ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+  else
+    {
+      Traversal t;
 
-  ret = !traverse_directory (nks, &root_entry, "");
+      t.entries = g_array_new (false, false, sizeof (NksEntry));
+      t.names	= nks_arena_new ();
 
-  if (file_names != NULL)
+      ret = !traverse_directory (nks, &root_entry, "", &t);
+
+      g_array_free (t.entries, true);
+      nks_arena_free (t.names);
+    }
+
+  if (queue != NULL)
     {
-      size_t to_extract = 0;
+      if (!run_queue ())
+	ret = EXIT_FAILURE;
 
-      while (file_names[to_extract] != NULL)
-	to_extract++;
+      free_queue ();
+    }
 
-      if (extr_count < to_extract)
-	{
-	  fprintf (stderr, "%s: Failed to extract all files\n", argv[0]);
-	  ret = EXIT_FAILURE;
-	}
+  unmatched = nks_selection_get_unmatched (selection);
+  for (n = 0; n < unmatched->len; n++)
+    fprintf_utf8 (stderr, "%s: Not found in archive\n",
+		  (const char *) g_ptr_array_index (unmatched, n));
+
+  if (unmatched->len > 0)
+    {
+      if (operation == OP_EXTRACT)
+	fprintf (stderr, "%s: Failed to extract all files\n", argv[0]);
+      ret = EXIT_FAILURE;
     }
 
+  g_ptr_array_free (unmatched, true);
+
+  if (show_stats)
+    print_stats (nks);
+
   nks_close (nks);
 
 end:
   g_free ((char *) file_name);
   g_free ((char *) directory);
+  nks_selection_free (selection);
+  g_hash_table_destroy (shown_directories);
 
   return ret;
 }
@@ -7,90 +7,6 @@
 
 #include "util.h"
 
-bool
-read_string (int fd, char *ret, size_t size)
-{
-  ssize_t cnt;
-
-  if (size > SSIZE_MAX)
-    return false;
-
-  cnt = read (fd, ret, size - 1);
-  if (cnt < 0 || cnt + 1 != (ssize_t) size)
-    return false;
-
-  ret[size - 1] = 0;
-  return true;
-}
-
-bool
-read_utf16_le_string (int fd, char **ret)
-{
-  GArray *array;
-  uint16_t c;
-
-  array = g_array_new (false, true, 2);
-
-  do
-    {
-      if (!read_u16_le (fd, &c))
-	goto err;
-
-      g_array_append_val (array, c);
-    }
-  while (c != 0);
-
-  *ret = g_utf16_to_utf8 ((gunichar2 *) array->data, 2 * array->len,
-			  NULL, NULL, NULL);
-  if (*ret == NULL)
-    goto err;
-
-  g_array_free (array, true);
-  return true;
-
-err:
-  g_array_free (array, true);
-  return false;
-}
-
-bool
-read_u32_le (int fd, uint32_t *ret)
-{
-  int n;
-  uint8_t c;
-  uint32_t num = 0;
-
-  for (n = 0; n < 4; n++)
-    {
-      if (read (fd, &c, 1) != 1)
-	return false;
-
-      num |= (c << (8 * n));
-    }
-
-  *ret = num;
-  return true;
-}
-
-bool
-read_u16_le (int fd, uint16_t *ret)
-{
-  int n;
-  uint8_t c;
-  uint16_t num = 0;
-
-  for (n = 0; n < 2; n++)
-    {
-      if (read (fd, &c, 1) != 1)
-	return false;
-
-      num |= ((uint16_t) c << (8 * n));
-    }
-
-  *ret = num;
-  return true;
-}
-
 uint32_t
 read_u32_be_mem (const void *mem)
 {
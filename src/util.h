@@ -39,10 +39,6 @@
 # define ENOKEY EPERM
 #endif
 
-bool read_string (int fd, char *ret, size_t size);
-bool read_utf16_le_string (int fd, char **ret);
-bool read_u32_le (int fd, uint32_t *ret);
-bool read_u16_le (int fd, uint16_t *ret);
 uint32_t read_u32_be_mem (const void *mem);
 
 int join_path_segments (const char *prefix, const char *suffix,